@@ -0,0 +1,189 @@
+#include "cpu.hpp"
+#include "config.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Host hardware counter for the calling thread, user space only.
+class HostCounter {
+private:
+    int fd_;
+
+public:
+    explicit HostCounter(uint64_t config)
+        : fd_(-1)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~HostCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    HostCounter(const HostCounter &) = delete;
+    HostCounter &operator=(const HostCounter &) = delete;
+
+    bool valid() const {
+        return fd_ >= 0;
+    }
+
+    void start() {
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    uint64_t stop() {
+        uint64_t value = 0;
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value))) {
+                value = 0;
+            }
+        }
+        return value;
+    }
+};
+
+struct Sample {
+    uint64_t guest_instrs;
+    double seconds;
+    uint64_t branches;
+    uint64_t branch_misses;
+};
+
+Sample run_once(const std::string &program,
+                const std::vector<std::pair<Sim::Register_idx, Sim::Register>> &inputs,
+                Sim::Engine engine) {
+    Sim::CPU cpu;
+    cpu.reset();
+    if (!cpu.load_program(program)) {
+        std::exit(1);
+    }
+    for (const auto &input : inputs) {
+        cpu.set_register(input.first, input.second);
+    }
+    cpu.set_engine(engine);
+
+    HostCounter branches(PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+    HostCounter misses(PERF_COUNT_HW_BRANCH_MISSES);
+
+    // Keep guest output out of the report.
+    std::ostringstream sink;
+    std::streambuf *saved = std::cout.rdbuf(sink.rdbuf());
+
+    branches.start();
+    misses.start();
+    auto t0 = std::chrono::steady_clock::now();
+    cpu.run();
+    auto t1 = std::chrono::steady_clock::now();
+    Sample sample{};
+    sample.branch_misses = misses.stop();
+    sample.branches = branches.stop();
+
+    std::cout.rdbuf(saved);
+
+    sample.guest_instrs = cpu.get_retired();
+    sample.seconds = std::chrono::duration<double>(t1 - t0).count();
+    return sample;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <program.bin> [--repeat=N] [x1=N ...]\n";
+        return 1;
+    }
+
+    std::string program = argv[1];
+    unsigned repeat = 5;
+    std::vector<std::pair<Sim::Register_idx, Sim::Register>> inputs;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--repeat=", 0) == 0) {
+            repeat = static_cast<unsigned>(std::stoul(arg.substr(9)));
+            continue;
+        }
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos || eq < 2 || (arg[0] != 'x' && arg[0] != 'X')) {
+            std::cerr << "Invalid register argument: " << arg << ". Expected format: x1=N\n";
+            return 1;
+        }
+        auto idx = static_cast<Sim::Register_idx>(std::stoul(arg.substr(1, eq - 1)));
+        auto value = static_cast<Sim::Register>(std::stoul(arg.substr(eq + 1), nullptr, 0));
+        if (idx >= Sim::kNumberOfRegisters) {
+            std::cerr << "Register index out of range: " << idx << "\n";
+            return 1;
+        }
+        inputs.emplace_back(idx, value);
+    }
+
+    const std::pair<const char *, Sim::Engine> engines[] = {
+        {"block", Sim::Engine::block},
+        {"threaded", Sim::Engine::threaded},
+        {"jit", Sim::Engine::jit},
+    };
+
+    std::cout << std::left << std::setw(10) << "engine"
+              << std::right << std::setw(14) << "guest instrs"
+              << std::setw(10) << "MIPS"
+              << std::setw(10) << "ns/instr"
+              << std::setw(14) << "host br-miss"
+              << std::setw(10) << "miss %"
+              << std::setw(14) << "miss/instr" << "\n";
+
+    for (const auto &engine : engines) {
+        Sample best{};
+        for (unsigned r = 0; r < repeat; ++r) {
+            Sample sample = run_once(program, inputs, engine.second);
+            if (r == 0 || sample.seconds < best.seconds) {
+                best = sample;
+            }
+        }
+
+        double instrs = static_cast<double>(best.guest_instrs);
+        std::cout << std::left << std::setw(10) << engine.first
+                  << std::right << std::setw(14) << best.guest_instrs
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(10) << instrs / best.seconds / 1e6
+                  << std::setprecision(2)
+                  << std::setw(10) << best.seconds * 1e9 / instrs;
+        if (best.branches != 0) {
+            std::cout << std::setw(14) << best.branch_misses
+                      << std::setw(10) << 100.0 * static_cast<double>(best.branch_misses) / static_cast<double>(best.branches)
+                      << std::setprecision(4)
+                      << std::setw(14) << static_cast<double>(best.branch_misses) / instrs;
+        } else {
+            std::cout << std::setw(14) << "n/a" << std::setw(10) << "n/a" << std::setw(14) << "n/a";
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,418 @@
+#include "assembler.hpp"
+#include "cpu.hpp"
+#include "config.hpp"
+#include "instrumentation.hpp"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// A guest program of the corpus, assembled by the native assembler, so
+// the encodings come from src/isa.hpp like everywhere else.
+struct Kernel {
+    std::string name;
+    std::string source;
+    std::vector<std::pair<Sim::Register_idx, Sim::Register>> inputs;
+
+    bool write(const std::filesystem::path &path) const {
+        if (source.empty()) {
+            return false;
+        }
+        std::vector<Sim::Instruction> words;
+        std::string error;
+        if (!Sim::assemble(source, words, error)) {
+            std::cerr << "toy_bench: " << name << ": " << error << "\n";
+            return false;
+        }
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (Sim::Instruction word : words) {
+            const char bytes[4] = {
+                static_cast<char>(word), static_cast<char>(word >> 8),
+                static_cast<char>(word >> 16), static_cast<char>(word >> 24),
+            };
+            out.write(bytes, sizeof(bytes));
+        }
+        return static_cast<bool>(out);
+    }
+};
+
+// All loop kernels count x4 from 0 up to x1, with x2 = 0 and x3 = 1,
+// and print a checksum before halting.
+constexpr Sim::Register kDataBase = 0x0010'0000;
+constexpr Sim::Register kFootprintBase = 0x0100'0000;
+
+Kernel loop_kernel(const char *name, Sim::Register iterations, const char *body, const char *checksum) {
+    Kernel k;
+    k.name = name;
+    k.source = std::string("top:\n") + body
+        + "    ADD x4, x4, x3\n"
+          "    BNE x4, x1, top\n"
+        + checksum
+        + "    SYSCALL #1\n"
+          "    SYSCALL #0\n";
+    k.inputs = {{1, iterations}, {3, 1}};
+    return k;
+}
+
+// fib.asm itself: one short loop of adds.
+Kernel fib_kernel(const std::filesystem::path &path, Sim::Register iterations) {
+    Kernel k;
+    k.name = "fib";
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "toy_bench: cannot read " << path << "\n";
+    }
+    k.source.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    k.inputs = {{1, iterations}};
+    return k;
+}
+
+// A data-dependent branch on a pseudo-random bit, taken about half the time.
+Kernel branch_kernel(Sim::Register iterations) {
+    Kernel k = loop_kernel("branches", iterations,
+        "    RORI x11, x10, #7\n"
+        "    ADD x10, x10, x11\n"
+        "    ADD x10, x10, x12\n"
+        "    AND x13, x10, x15\n"
+        "    BEQ x13, x2, skip\n"
+        "    ADD x14, x14, x3\n"
+        "skip:\n",
+        "    ADD x0, x14, x2\n");
+    k.inputs.insert(k.inputs.end(), {{10, 0x1234'5678}, {12, 0x9E37'79B9}, {15, 0x0001'0000}});
+    return k;
+}
+
+// Read-modify-write over a 16 KiB array.
+Kernel load_store_kernel(Sim::Register iterations) {
+    Kernel k = loop_kernel("ld-st", iterations,
+        "    ADD x17, x8, x16\n"
+        "    LD x6, 0(x17)\n"
+        "    ADD x6, x6, x3\n"
+        "    ST x6, 0(x17)\n"
+        "    ADD x8, x8, x9\n"
+        "    AND x8, x8, x15\n",
+        "    LD x0, 0(x16)\n");
+    k.inputs.insert(k.inputs.end(), {{9, 4}, {15, 0x3FFC}, {16, kDataBase}});
+    return k;
+}
+
+// Paired stores feeding a load of the second word.
+Kernel store_pair_kernel(Sim::Register iterations) {
+    Kernel k = loop_kernel("stp", iterations,
+        "    ADD x17, x8, x16\n"
+        "    STP x4, x6, 0(x17)\n"
+        "    LD x6, 4(x17)\n"
+        "    ADD x6, x6, x4\n"
+        "    ADD x8, x8, x9\n"
+        "    AND x8, x8, x15\n",
+        "    ADD x0, x6, x2\n");
+    k.inputs.insert(k.inputs.end(), {{9, 8}, {15, 0x3FF8}, {16, kDataBase}});
+    return k;
+}
+
+// The emulated bit operations: bdep, cls and ssat.
+Kernel bit_kernel(Sim::Register iterations) {
+    Kernel k = loop_kernel("bdep-cls-ssat", iterations,
+        "    BDEP x6, x10, x12\n"
+        "    CLS x7, x6\n"
+        "    SSAT x11, x6, #12\n"
+        "    ADD x10, x10, x7\n"
+        "    ADD x10, x10, x11\n"
+        "    RORI x10, x10, #3\n"
+        "    ADD x18, x18, x6\n",
+        "    ADD x0, x18, x2\n");
+    k.inputs.insert(k.inputs.end(), {{10, 0x1234'5678}, {12, 0x0F0F'0F0F}});
+    return k;
+}
+
+// One store per 64 bytes over a large region, so page faults and the
+// memory footprint dominate.
+Kernel footprint_kernel(Sim::Register bytes) {
+    Kernel k = loop_kernel("footprint", bytes / 64,
+        "    ADD x17, x8, x16\n"
+        "    ST x4, 0(x17)\n"
+        "    ADD x8, x8, x9\n",
+        "    ADD x0, x4, x2\n");
+    k.inputs.insert(k.inputs.end(), {{9, 64}, {16, kFootprintBase}});
+    return k;
+}
+
+struct Config {
+    const char *name;
+    Sim::Engine engine;
+    bool profile;
+};
+
+struct Sample {
+    uint64_t guest_instrs;
+    double startup_seconds;     // CPU construction, reset and program load
+    double seconds;             // run() to halt
+    long peak_rss_kib;
+};
+
+// Runs the kernel once in a child process so that startup cost and peak
+// RSS are those of a fresh simulator.
+bool run_once(const std::filesystem::path &program, const Kernel &kernel,
+              const Config &config, Sample &sample) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        std::cerr << "toy_bench: pipe failed\n";
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "toy_bench: fork failed\n";
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        Sample result{};
+        std::ostringstream sink;
+
+        auto t0 = std::chrono::steady_clock::now();
+        Sim::CPU cpu;
+        cpu.reset();
+        if (!cpu.load_program(program)) {
+            _exit(1);
+        }
+        for (const auto &input : kernel.inputs) {
+            cpu.set_register(input.first, input.second);
+        }
+        cpu.set_engine(config.engine);
+        cpu.set_output(sink);
+        auto t1 = std::chrono::steady_clock::now();
+        if (config.profile) {
+            Sim::CountingInstrumentation counters;
+            cpu.run(counters);
+        } else {
+            cpu.run();
+        }
+        auto t2 = std::chrono::steady_clock::now();
+
+        result.guest_instrs = cpu.get_retired();
+        result.startup_seconds = std::chrono::duration<double>(t1 - t0).count();
+        result.seconds = std::chrono::duration<double>(t2 - t1).count();
+        bool ok = write(fds[1], &result, sizeof(result)) == static_cast<ssize_t>(sizeof(result));
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool ok = read(fds[0], &sample, sizeof(sample)) == static_cast<ssize_t>(sizeof(sample));
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage{};
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        std::cerr << "toy_bench: " << kernel.name << " failed under " << config.name << "\n";
+        return false;
+    }
+    sample.peak_rss_kib = usage.ru_maxrss;
+    return true;
+}
+
+std::string utc_timestamp() {
+    std::time_t now = std::time(nullptr);
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    return text;
+}
+
+bool selected(const std::vector<std::string> &filter, const std::string &name) {
+    if (filter.empty()) {
+        return true;
+    }
+    for (const auto &entry : filter) {
+        if (entry == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    unsigned repeat = 3;
+    Sim::Register iterations = 10'000'000;
+    Sim::Register footprint_mib = 128;
+    std::string json_path;
+    std::filesystem::path fib_path = TOY_BENCH_FIB;
+    std::vector<std::string> kernel_filter;
+    std::vector<std::string> config_filter;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg.rfind("--repeat=", 0) == 0) {
+                repeat = static_cast<unsigned>(std::stoul(arg.substr(9)));
+            } else if (arg.rfind("--iterations=", 0) == 0) {
+                iterations = static_cast<Sim::Register>(std::stoul(arg.substr(13), nullptr, 0));
+            } else if (arg.rfind("--footprint=", 0) == 0) {
+                footprint_mib = static_cast<Sim::Register>(std::stoul(arg.substr(12)));
+            } else if (arg.rfind("--fib=", 0) == 0) {
+                fib_path = arg.substr(6);
+            } else if (arg.rfind("--json=", 0) == 0) {
+                json_path = arg.substr(7);
+            } else if (arg.rfind("--kernel=", 0) == 0) {
+                kernel_filter.push_back(arg.substr(9));
+            } else if (arg.rfind("--config=", 0) == 0) {
+                config_filter.push_back(arg.substr(9));
+            } else {
+                throw std::invalid_argument(arg);
+            }
+        } catch (const std::exception &) {
+            std::cerr << "Usage: " << argv[0] << " [--repeat=N] [--iterations=N] [--footprint=MiB]"
+                      << " [--fib=FILE] [--kernel=NAME ...] [--config=NAME ...] [--json=FILE]\n";
+            return 1;
+        }
+    }
+
+    if (repeat == 0 || iterations < 2 || footprint_mib == 0 || footprint_mib > 3 * 1024) {
+        std::cerr << "toy_bench: --repeat must be positive, --iterations at least 2"
+                  << " and --footprint between 1 and 3072 MiB\n";
+        return 1;
+    }
+
+    const std::vector<Kernel> kernels = {
+        fib_kernel(fib_path, iterations),
+        branch_kernel(iterations),
+        load_store_kernel(iterations),
+        store_pair_kernel(iterations),
+        bit_kernel(iterations),
+        footprint_kernel(footprint_mib << 20),
+    };
+
+    const Config configs[] = {
+        {"block", Sim::Engine::block, false},
+        {"threaded", Sim::Engine::threaded, false},
+        {"jit", Sim::Engine::jit, false},
+        {"profile", Sim::Engine::block, true},
+    };
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path()
+        / ("toy_bench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    std::ostringstream results;
+    bool first_result = true;
+    bool ok = true;
+
+    std::cout << std::left << std::setw(16) << "kernel" << std::setw(10) << "config"
+              << std::right << std::setw(14) << "guest instrs"
+              << std::setw(10) << "MIPS"
+              << std::setw(10) << "ns/instr"
+              << std::setw(12) << "startup us"
+              << std::setw(12) << "peak KiB" << "\n";
+
+    for (const Kernel &kernel : kernels) {
+        if (!selected(kernel_filter, kernel.name)) {
+            continue;
+        }
+        std::filesystem::path program = dir / (kernel.name + ".bin");
+        if (!kernel.write(program)) {
+            std::cerr << "toy_bench: cannot write " << program << "\n";
+            ok = false;
+            break;
+        }
+
+        for (const Config &config : configs) {
+            if (!selected(config_filter, config.name)) {
+                continue;
+            }
+
+            // Best run time and startup over the repeats; peak RSS is the largest seen.
+            Sample best{};
+            bool failed = false;
+            for (unsigned r = 0; r < repeat; ++r) {
+                Sample sample{};
+                if (!run_once(program, kernel, config, sample)) {
+                    failed = true;
+                    break;
+                }
+                if (r == 0) {
+                    best = sample;
+                    continue;
+                }
+                best.seconds = std::min(best.seconds, sample.seconds);
+                best.startup_seconds = std::min(best.startup_seconds, sample.startup_seconds);
+                best.peak_rss_kib = std::max(best.peak_rss_kib, sample.peak_rss_kib);
+            }
+            if (failed) {
+                ok = false;
+                continue;
+            }
+
+            double instrs = static_cast<double>(best.guest_instrs);
+            double mips = instrs / best.seconds / 1e6;
+            double ns_per_instr = best.seconds * 1e9 / instrs;
+            double startup_us = best.startup_seconds * 1e6;
+
+            std::cout << std::left << std::setw(16) << kernel.name << std::setw(10) << config.name
+                      << std::right << std::setw(14) << best.guest_instrs
+                      << std::fixed << std::setprecision(1)
+                      << std::setw(10) << mips
+                      << std::setprecision(2)
+                      << std::setw(10) << ns_per_instr
+                      << std::setprecision(1)
+                      << std::setw(12) << startup_us
+                      << std::setw(12) << best.peak_rss_kib << "\n";
+
+            results << (first_result ? "\n" : ",\n")
+                    << "    {\"kernel\":\"" << kernel.name << "\",\"config\":\"" << config.name
+                    << "\",\"instructions\":" << best.guest_instrs
+                    << std::setprecision(3)
+                    << ",\"seconds\":" << best.seconds
+                    << ",\"mips\":" << mips
+                    << ",\"ns_per_instr\":" << ns_per_instr
+                    << ",\"startup_us\":" << startup_us
+                    << ",\"peak_rss_kib\":" << best.peak_rss_kib << "}";
+            first_result = false;
+        }
+    }
+
+    std::error_code ignored;
+    std::filesystem::remove_all(dir, ignored);
+
+    if (!json_path.empty()) {
+        std::ofstream json(json_path, std::ios::trunc);
+        json << "{\n"
+             << "  \"bench\":\"toy_bench\",\n"
+             << "  \"version\":1,\n"
+             << "  \"timestamp\":\"" << utc_timestamp() << "\",\n"
+             << "  \"repeat\":" << repeat << ",\n"
+             << "  \"iterations\":" << iterations << ",\n"
+             << "  \"footprint_mib\":" << footprint_mib << ",\n"
+             << "  \"results\":[" << results.str() << "\n  ]\n"
+             << "}\n";
+        if (!json) {
+            std::cerr << "toy_bench: cannot write " << json_path << "\n";
+            return 1;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#ifndef TOY_CPU_H_
+#define TOY_CPU_H_
+
+/*
+ * C interface to the simulator, for embedding it in another process.
+ * Link against libtoy_cpu (static or shared). Every function is safe to
+ * call with instances used by one thread at a time; separate instances
+ * are independent.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define TOY_API __attribute__((visibility("default")))
+#else
+#define TOY_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TOY_API_VERSION 2
+
+typedef struct toy_cpu toy_cpu;
+
+typedef enum toy_engine {
+    TOY_ENGINE_BLOCK = 0,
+    TOY_ENGINE_THREADED = 1,
+    TOY_ENGINE_JIT = 2
+} toy_engine;
+
+/* Why toy_cpu_run() returned. */
+typedef enum toy_status {
+    TOY_STATUS_HALTED = 0,              /* halt syscall */
+    TOY_STATUS_BUDGET = 1,              /* budget used up; call again to continue */
+    TOY_STATUS_MISALIGNED = 2,          /* ld/st/stp at a misaligned address */
+    TOY_STATUS_UNKNOWN_INSTRUCTION = 3,
+    TOY_STATUS_UNKNOWN_SYSCALL = 4,
+    TOY_STATUS_ERROR = 5                /* host out of memory; see toy_cpu_diagnostics() */
+} toy_status;
+
+typedef struct toy_run_result {
+    toy_status status;
+    uint32_t pc;            /* next instruction, or the faulting one */
+    uint64_t executed;      /* instructions retired by this call */
+    uint64_t retired;       /* instructions retired since create/reset */
+} toy_run_result;
+
+/* Return values of the calls below that can fail. */
+#define TOY_OK 0
+#define TOY_ERR_ARGUMENT (-1)   /* null pointer, bad register or engine */
+#define TOY_ERR_RANGE (-2)      /* past the end of the 4 GiB address space */
+#define TOY_ERR_MEMORY (-3)     /* host out of memory; see toy_cpu_diagnostics() */
+
+TOY_API int toy_api_version(void);
+
+/* NULL if guest memory cannot be reserved. */
+TOY_API toy_cpu *toy_cpu_create(void);
+TOY_API void toy_cpu_destroy(toy_cpu *cpu);
+
+/*
+ * Clears registers, memory, decoded code and captured output. After
+ * TOY_ERR_MEMORY the CPU is only fit for toy_cpu_destroy().
+ */
+TOY_API int toy_cpu_reset(toy_cpu *cpu);
+TOY_API int toy_cpu_set_engine(toy_cpu *cpu, toy_engine engine);
+
+/* Copies size bytes of program or data to base. */
+TOY_API int toy_cpu_load_program(toy_cpu *cpu, const void *data, size_t size, uint32_t base);
+
+TOY_API int toy_cpu_get_register(const toy_cpu *cpu, unsigned index, uint32_t *value);
+TOY_API int toy_cpu_set_register(toy_cpu *cpu, unsigned index, uint32_t value);
+TOY_API uint32_t toy_cpu_get_pc(const toy_cpu *cpu);
+TOY_API void toy_cpu_set_pc(toy_cpu *cpu, uint32_t pc);
+
+TOY_API int toy_cpu_read_memory(const toy_cpu *cpu, uint32_t addr, void *data, size_t size);
+TOY_API int toy_cpu_write_memory(toy_cpu *cpu, uint32_t addr, const void *data, size_t size);
+
+/*
+ * Runs at most budget instructions, or until the CPU halts if budget is
+ * 0. A CPU that has halted stays halted, returning the same status,
+ * until toy_cpu_resume() or toy_cpu_reset().
+ */
+TOY_API toy_run_result toy_cpu_run(toy_cpu *cpu, uint64_t budget);
+TOY_API void toy_cpu_resume(toy_cpu *cpu);
+
+/*
+ * Text written by the output syscalls, and fault messages. Both are
+ * captured rather than printed and stay valid until the next call on
+ * cpu. size may be NULL.
+ */
+TOY_API const char *toy_cpu_output(const toy_cpu *cpu, size_t *size);
+TOY_API const char *toy_cpu_diagnostics(const toy_cpu *cpu, size_t *size);
+TOY_API void toy_cpu_clear_output(toy_cpu *cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TOY_CPU_H_ */
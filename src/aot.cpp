@@ -0,0 +1,438 @@
+#include "aot.hpp"
+#include "guest_memory.hpp"
+#include "isa.hpp"
+
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_set>
+
+namespace Sim {
+
+namespace {
+
+// Longer straight-line runs are split, so one block never holds back
+// too much of a run_for() budget.
+constexpr size_t kMaxBlockOps = 256;
+
+// Everything the generated file needs besides its blocks. The helpers
+// follow the CPU's exec_* handlers exactly.
+constexpr char kPrelude[] = R"(#include <cstdint>
+#include <cstring>
+
+namespace {
+
+// Mirrors Sim::AotContext.
+struct Context {
+    uint32_t *regs;
+    uint8_t *mem;
+    const uint8_t *flags;
+    const uint8_t *disabled;
+    void *cpu;
+    int (*store)(void *cpu, uint32_t addr, uint32_t value);
+    uint64_t retired;
+    uint64_t budget;
+    uint32_t pc;
+    uint32_t stop;
+};
+
+inline uint32_t load(const Context *c, uint32_t addr) {
+    uint32_t value;
+    std::memcpy(&value, c->mem + addr, sizeof(value));
+    return value;
+}
+
+// Pages with flags, and words straddling two pages, take the CPU's
+// store path; true if that store hit code.
+inline bool store(Context *c, uint32_t addr, uint32_t value) {
+    if ((addr & 0xFFFu) <= 0xFFCu && c->flags[addr >> 12] == 0) {
+        std::memcpy(c->mem + addr, &value, sizeof(value));
+        return false;
+    }
+    return c->store(c->cpu, addr, value) != 0;
+}
+
+inline uint32_t stop(Context *c, uint32_t retired, uint32_t pc) {
+    c->retired += retired;
+    c->stop = 1;
+    return pc;
+}
+
+inline uint32_t rotr(uint32_t v, uint32_t n) {
+    n &= 31;
+    return n == 0 ? v : (v >> n) | (v << (32 - n));
+}
+
+inline uint32_t bdep(uint32_t src, uint32_t mask) {
+    uint32_t result = 0;
+    for (uint32_t bit = 0; bit < 32; ++bit) {
+        if (((mask >> bit) & 1) != 0) {
+            result |= (src & 1) << bit;
+            src >>= 1;
+        }
+    }
+    return result;
+}
+
+inline uint32_t cls(uint32_t x) {
+    const uint32_t y = x ^ static_cast<uint32_t>(static_cast<int32_t>(x) >> 31);
+    const uint32_t count = y == 0 ? 32 : static_cast<uint32_t>(__builtin_clz(y));
+    return count >= 31 ? 31 : count;
+}
+
+inline uint32_t ssat(uint32_t v, uint32_t n) {
+    if (n == 0) {
+        return v;
+    }
+    const int64_t lo = -(int64_t{1} << (n - 1));
+    const int64_t hi = (int64_t{1} << (n - 1)) - 1;
+    const int64_t x = static_cast<int32_t>(v);
+    return static_cast<uint32_t>(static_cast<int32_t>(x < lo ? lo : x > hi ? hi : x));
+}
+
+} // namespace
+)";
+
+struct Block {
+    Address start;
+    std::vector<DecodedOp> ops;
+    Address next;       // fall-through pc after the last op
+};
+
+DecodedOp decode(Address pc, Instruction raw) {
+    DecodedOp op{};
+    op.pc = pc;
+    op.next = pc + kInstructionBytes;
+    op.target = op.next;
+    op.raw = raw;
+    op.kind = decode_kind(raw);
+    op.width = 1;
+    kFieldExtractors[static_cast<size_t>(describe(op.kind).format)](raw, op);
+    return op;
+}
+
+// Ops the translated code never runs: the interpreter takes over
+// before them.
+bool interpreted(const DecodedOp &op) {
+    switch (op.kind) {
+        case DecodedInstr::syscall:
+        case DecodedInstr::unknown:
+            return true;
+        case DecodedInstr::ld:
+        case DecodedInstr::st:
+            return (op.imm & 0x3u) != 0;    // always faults
+        default:
+            return false;
+    }
+}
+
+// As an unsigned literal of the generated source.
+std::string hex(uint32_t value) {
+    char text[16];
+    std::snprintf(text, sizeof(text), "0x%08xu", value);
+    return text;
+}
+
+std::string block_name(Address start) {
+    char text[24];
+    std::snprintf(text, sizeof(text), "block_%08x", start);
+    return text;
+}
+
+std::string reg(Register_idx index) {
+    return "r[" + std::to_string(index) + "]";
+}
+
+class Translator {
+private:
+    const Byte *program_;
+    size_t size_;
+    Address base_;
+
+    bool contains(Address pc) const {
+        return pc >= base_ && static_cast<uint64_t>(pc) - base_ + kInstructionBytes <= size_;
+    }
+
+    DecodedOp decode_at(Address pc) const {
+        Instruction raw = 0;
+        std::memcpy(&raw, program_ + (pc - base_), sizeof(raw));
+        return decode(pc, raw);
+    }
+
+public:
+    Translator(const Byte *program, size_t size, Address base)
+        : program_(program),
+        size_(size),
+        base_(base)
+    {}
+
+    // Walks the code reachable from entry and returns the pcs blocks
+    // must start at: entry, branch and jump targets, and the pc after
+    // each branch and syscall.
+    std::set<Address> find_leaders(Address entry) const {
+        std::set<Address> leaders;
+        std::unordered_set<Address> seen;
+        std::vector<Address> work{entry};
+        while (!work.empty()) {
+            Address pc = work.back();
+            work.pop_back();
+            if (!contains(pc) || !leaders.insert(pc).second) {
+                continue;
+            }
+            while (contains(pc) && seen.insert(pc).second) {
+                const DecodedOp op = decode_at(pc);
+                if (op.kind == DecodedInstr::j) {
+                    work.push_back(op.target);
+                    break;
+                }
+                if (op.kind == DecodedInstr::beq || op.kind == DecodedInstr::bne) {
+                    work.push_back(op.target);
+                    work.push_back(op.next);
+                    break;
+                }
+                if (op.kind == DecodedInstr::syscall) {
+                    work.push_back(op.next);
+                    break;
+                }
+                if (interpreted(op)) {
+                    break;
+                }
+                pc = op.next;
+            }
+        }
+        return leaders;
+    }
+
+    // The block at a leader runs to its first control transfer, op the
+    // interpreter must run, or the next leader. Empty if the leader
+    // itself is such an op.
+    Block block_at(Address start, const std::set<Address> &leaders) const {
+        Block block{start, {}, start};
+        Address pc = start;
+        while (contains(pc) && block.ops.size() < kMaxBlockOps) {
+            const DecodedOp op = decode_at(pc);
+            if (interpreted(op)) {
+                break;
+            }
+            block.ops.push_back(op);
+            pc = op.next;
+            if (ends_block(op.kind) || leaders.count(pc) != 0) {
+                break;
+            }
+        }
+        block.next = pc;
+        return block;
+    }
+};
+
+void emit_block(std::ostream &out, const Block &block) {
+    out << "\nstatic uint32_t " << block_name(block.start) << "(Context *c) {\n";
+    out << "    uint32_t *const r = c->regs;\n";
+    const std::string count = std::to_string(block.ops.size());
+    for (size_t index = 0; index < block.ops.size(); ++index) {
+        const DecodedOp &op = block.ops[index];
+        const std::string done = std::to_string(index + 1);
+        switch (op.kind) {
+            case DecodedInstr::add:
+                out << "    " << reg(op.rd) << " = " << reg(op.rs) << " + " << reg(op.rt) << ";\n";
+                break;
+            case DecodedInstr::and_:
+                out << "    " << reg(op.rd) << " = " << reg(op.rs) << " & " << reg(op.rt) << ";\n";
+                break;
+            case DecodedInstr::slti:
+                out << "    " << reg(op.rt) << " = static_cast<int32_t>(" << reg(op.rs)
+                    << ") < static_cast<int32_t>(" << hex(op.imm) << ") ? 1 : 0;\n";
+                break;
+            case DecodedInstr::rori:
+                out << "    " << reg(op.rd) << " = rotr(" << reg(op.rs) << ", " << hex(op.imm) << ");\n";
+                break;
+            case DecodedInstr::bdep:
+                out << "    " << reg(op.rd) << " = bdep(" << reg(op.rs) << ", " << reg(op.rt) << ");\n";
+                break;
+            case DecodedInstr::cls:
+                out << "    " << reg(op.rd) << " = cls(" << reg(op.rs) << ");\n";
+                break;
+            case DecodedInstr::ssat:
+                out << "    " << reg(op.rd) << " = ssat(" << reg(op.rs) << ", " << hex(op.imm & 0x1Fu) << ");\n";
+                break;
+            case DecodedInstr::ld:
+                out << "    " << reg(op.rt) << " = load(c, " << reg(op.rs) << " + " << hex(op.imm) << ");\n";
+                break;
+            case DecodedInstr::st:
+                out << "    if (store(c, " << reg(op.rs) << " + " << hex(op.imm) << ", " << reg(op.rt) << ")) {\n"
+                    << "        return stop(c, " << done << ", " << hex(op.next) << ");\n"
+                    << "    }\n";
+                break;
+            case DecodedInstr::stp:
+                // A misaligned pair faults in the interpreter.
+                out << "    {\n"
+                    << "        const uint32_t a = " << reg(op.rs) << " + " << hex(op.imm) << ";\n"
+                    << "        if ((a & 3u) != 0) {\n"
+                    << "            return stop(c, " << index << ", " << hex(op.pc) << ");\n"
+                    << "        }\n"
+                    << "        bool code = store(c, a, " << reg(op.rt) << ");\n"
+                    << "        code = store(c, a + 4u, " << reg(op.rd) << ") || code;\n"
+                    << "        if (code) {\n"
+                    << "            return stop(c, " << done << ", " << hex(op.next) << ");\n"
+                    << "        }\n"
+                    << "    }\n";
+                break;
+            case DecodedInstr::beq:
+            case DecodedInstr::bne:
+                out << "    c->retired += " << count << ";\n"
+                    << "    return " << reg(op.rs) << (op.kind == DecodedInstr::beq ? " == " : " != ")
+                    << reg(op.rt) << " ? " << hex(op.target) << " : " << hex(op.next) << ";\n}\n";
+                return;
+            case DecodedInstr::j:
+                out << "    c->retired += " << count << ";\n"
+                    << "    return " << hex(op.target) << ";\n}\n";
+                return;
+            case DecodedInstr::syscall:
+            case DecodedInstr::unknown:
+                break;      // never in a block
+        }
+    }
+    out << "    c->retired += " << count << ";\n"
+        << "    return " << hex(block.next) << ";\n}\n";
+}
+
+} // namespace
+
+bool aot_translate(const Byte *program, size_t size, Address base, Address entry,
+                   std::ostream &out, AotStats *stats) {
+    const Translator translator(program, size, base);
+    const std::set<Address> leaders = translator.find_leaders(entry);
+    std::vector<Block> blocks;
+    for (Address leader : leaders) {
+        Block block = translator.block_at(leader, leaders);
+        if (!block.ops.empty()) {
+            blocks.push_back(std::move(block));
+        }
+    }
+
+    out << "// Generated by toy_aot from a program at " << hex(base) << ", entry " << hex(entry)
+        << ". Do not edit.\n";
+    out << kPrelude;
+    for (const Block &block : blocks) {
+        emit_block(out, block);
+    }
+
+    // Each block as start, word count and index of its first word.
+    out << "\nextern \"C\" {\n\n";
+    out << "extern const uint32_t toy_aot_abi = " << kAotAbi << ";\n";
+    out << "extern const uint32_t toy_aot_block_count = " << blocks.size() << ";\n";
+    out << "extern const uint32_t toy_aot_blocks[] = {\n";
+    size_t words = 0;
+    for (const Block &block : blocks) {
+        out << "    " << hex(block.start) << ", " << block.ops.size() << ", " << words << ",\n";
+        words += block.ops.size();
+    }
+    out << "    0\n};\n";
+    out << "extern const uint32_t toy_aot_words[] = {\n";
+    for (const Block &block : blocks) {
+        out << "   ";
+        for (const DecodedOp &op : block.ops) {
+            out << " " << hex(op.raw) << ",";
+        }
+        out << "\n";
+    }
+    out << "    0\n};\n";
+
+    out << "\nvoid toy_aot_run(Context *c) {\n"
+        << "    uint32_t pc = c->pc;\n"
+        << "    for (;;) {\n"
+        << "        switch (pc) {\n";
+    for (size_t index = 0; index < blocks.size(); ++index) {
+        const Block &block = blocks[index];
+        out << "            case " << hex(block.start) << ":\n"
+            << "                if (c->disabled[" << index << "] != 0 || c->budget - c->retired < "
+            << block.ops.size() << ") {\n"
+            << "                    goto done;\n"
+            << "                }\n"
+            << "                pc = " << block_name(block.start) << "(c);\n"
+            << "                break;\n";
+    }
+    out << "            default:\n"
+        << "                goto done;\n"
+        << "        }\n"
+        << "        if (c->stop != 0) {\n"
+        << "            break;\n"
+        << "        }\n"
+        << "    }\n"
+        << "done:\n"
+        << "    c->pc = pc;\n"
+        << "}\n\n"
+        << "} // extern \"C\"\n";
+
+    if (stats != nullptr) {
+        stats->blocks = blocks.size();
+        stats->instructions = words;
+    }
+    return static_cast<bool>(out);
+}
+
+AotModule::~AotModule() {
+    dlclose(handle_);
+}
+
+std::unique_ptr<AotModule> AotModule::open(const std::filesystem::path &path, const GuestMemory &memory) {
+    // Without a slash dlopen() would search the library path instead.
+    std::error_code ec;
+    const std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+    void *handle = dlopen(ec ? path.c_str() : absolute.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        std::cerr << "aot: cannot load " << path << ": " << dlerror() << "\n";
+        return nullptr;
+    }
+
+    const auto *abi = static_cast<const uint32_t *>(dlsym(handle, "toy_aot_abi"));
+    const auto *count = static_cast<const uint32_t *>(dlsym(handle, "toy_aot_block_count"));
+    const auto *blocks = static_cast<const uint32_t *>(dlsym(handle, "toy_aot_blocks"));
+    const auto *words = static_cast<const uint32_t *>(dlsym(handle, "toy_aot_words"));
+    auto run = reinterpret_cast<RunFunction>(dlsym(handle, "toy_aot_run"));
+    if (abi == nullptr || count == nullptr || blocks == nullptr || words == nullptr || run == nullptr
+        || *abi != kAotAbi) {
+        std::cerr << "aot: " << path << " is not a module of this simulator version\n";
+        dlclose(handle);
+        return nullptr;
+    }
+
+    std::unique_ptr<AotModule> module(new AotModule(handle, run));
+    for (uint32_t index = 0; index < *count; ++index) {
+        const Address start = blocks[index * 3];
+        const uint32_t ops = blocks[index * 3 + 1];
+        const uint32_t *code = words + blocks[index * 3 + 2];
+        for (uint32_t op = 0; op < ops; ++op) {
+            if (memory.load32(start + op * kInstructionBytes) != code[op]) {
+                std::cerr << "aot: " << path << " was translated from other code (block at 0x" << std::hex
+                          << start << std::dec << ")\n";
+                return nullptr;
+            }
+        }
+        const Address bytes = ops * kInstructionBytes;
+        module->blocks_.push_back(Block{start, start + bytes});
+        module->max_block_bytes_ = std::max(module->max_block_bytes_, bytes);
+    }
+    module->disabled_.assign(module->blocks_.size(), 0);
+    return module;
+}
+
+void AotModule::invalidate(Address addr, size_t size) {
+    const Address from = addr > max_block_bytes_ ? addr - max_block_bytes_ : 0;
+    auto it = std::lower_bound(blocks_.begin(), blocks_.end(), from,
+        [](const Block &block, Address at) { return block.start < at; });
+    const uint64_t end = static_cast<uint64_t>(addr) + size;
+    for (; it != blocks_.end() && it->start < end; ++it) {
+        if (it->end > addr) {
+            disabled_[static_cast<size_t>(it - blocks_.begin())] = 1;
+        }
+    }
+}
+
+} // namespace Sim
@@ -0,0 +1,114 @@
+#ifndef AOT_HPP_
+#define AOT_HPP_
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+namespace Sim {
+
+class GuestMemory;
+
+// State shared with an AOT module's toy_aot_run(). The generated source
+// declares the same struct, so fields only ever get added at the end,
+// with kAotAbi bumped.
+struct AotContext {
+    Register *regs;
+    Byte *mem;                  // GuestMemory::data()
+    const uint8_t *flags;       // the page flag table
+    const uint8_t *disabled;    // per block; set once its code is written
+    void *cpu;
+    // Stores to a flagged or straddled page: CPU::write, then whether
+    // the page held code, which ends the block.
+    int (*store)(void *cpu, Address addr, Register value);
+    uint64_t retired;
+    uint64_t budget;            // retired count no block may run past
+    Address pc;                 // in: where to start; out: where it stopped
+    uint32_t stop;              // set by a block that exits early
+};
+
+constexpr uint32_t kAotAbi = 1;
+
+struct AotStats {
+    size_t blocks = 0;
+    size_t instructions = 0;
+};
+
+// Ahead-of-time translation: discovers the code of a program reachable
+// from entry by following j, beq and bne targets, fall-throughs and the
+// instruction after each syscall, and writes C++ with a function per
+// basic block plus a dispatcher, for the host compiler to build into a
+// shared object (see tools/toy_aot.cpp). Targets outside the program,
+// syscalls, unknown instructions and ld/st that always fault are left
+// to the interpreter. program holds size bytes placed at base.
+bool aot_translate(const Byte *program, size_t size, Address base, Address entry,
+                   std::ostream &out, AotStats *stats = nullptr);
+
+// A module aot_translate() produced, loaded into the process. Each
+// block keeps the words it was translated from; the module is only
+// accepted if memory holds them all, and CPU disables a block once any
+// of them is written.
+class AotModule {
+private:
+    struct Block {
+        Address start;
+        Address end;
+    };
+
+    using RunFunction = void (*)(AotContext *ctx);
+
+    void *handle_;
+    RunFunction run_;
+    std::vector<Block> blocks_;     // ascending by start
+    std::vector<uint8_t> disabled_;
+    Address max_block_bytes_ = 0;
+
+    AotModule(void *handle, RunFunction run)
+        : handle_(handle),
+        run_(run)
+    {}
+
+public:
+    ~AotModule();
+
+    AotModule(const AotModule &) = delete;
+    AotModule &operator=(const AotModule &) = delete;
+
+    // nullptr (and reports why) if path is not a module of this ABI or
+    // was translated from code other than what memory holds.
+    static std::unique_ptr<AotModule> open(const std::filesystem::path &path, const GuestMemory &memory);
+
+    // Runs translated blocks from ctx.pc until one is missing, disabled
+    // or would cross ctx.budget, or a block stops early.
+    void run(AotContext &ctx) const {
+        run_(&ctx);
+    }
+
+    const uint8_t *disabled() const {
+        return disabled_.data();
+    }
+
+    size_t size() const {
+        return blocks_.size();
+    }
+
+    Address block_start(size_t index) const {
+        return blocks_[index].start;
+    }
+
+    Address block_end(size_t index) const {
+        return blocks_[index].end;
+    }
+
+    // Disables every block holding a byte of [addr, addr + size).
+    void invalidate(Address addr, size_t size);
+};
+
+} // namespace Sim
+
+#endif // AOT_HPP_
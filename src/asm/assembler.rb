@@ -1,28 +1,9 @@
-class Assembler
-    OPCODE = {
-        j:       0b100111,
-        syscall: 0b000000,
-        stp:     0b001000,
-        rori:    0b111011,
-        slti:    0b010110,
-        st:      0b000011,
-        bdep:    0b000000,
-        cls:     0b000000,
-        add:     0b000000,
-        bne:     0b100100,
-        beq:     0b000010,
-        ld:      0b011010,
-        and_:    0b000000,
-        ssat:    0b001111,
-    }.freeze
+require_relative 'isa_tables'
 
-    SUB_ENCODING = {
-        syscall: 0b111110,
-        bdep:    0b111010,
-        cls:     0b111001,
-        add:     0b101011,
-        and_:    0b101101,
-    }.freeze
+class Assembler
+    # Encodings come from src/isa.hpp through the generated isa_tables.rb.
+    OPCODE = Isa::OPCODE
+    SUB_ENCODING = Isa::SUB_ENCODING
 
     REG_ALIAS = {
         "zero" => 0,
@@ -138,6 +119,20 @@ class Assembler
         push_encoded(word)
     end
 
+    # Bulk memory syscalls by name, operands in x1, x2 and x3 (see
+    # Syscall in src/cpu.hpp). src/assembler.cpp knows the same names.
+    def memcpy
+        syscall(8)
+    end
+
+    def memset
+        syscall(9)
+    end
+
+    def memcmp
+        syscall(10)
+    end
+
     # STP rt1, rt2, offset(base)
     def stp(rt1, rt2, offset, base)
         rt1_idx = reg_idx(rt1)
@@ -275,6 +270,17 @@ class Assembler
         path
     end
 
+    # One "<hex address> <name>" line per label, in address order; read
+    # by toy_cpu --profile-stacks.
+    def write_symbols(path)
+        File.open(path, "w") do |f|
+            @labels.each_with_index.sort_by { |(_, addr), i| [addr, i] }.each do |(name, addr), _|
+                f.write(format("%08x %s\n", addr, name))
+            end
+        end
+        path
+    end
+
     def dump
         puts "Label Symbol Table:"
         @labels.each { |name, addr| puts "  #{name}: 0x#{addr.to_s(16)}" }
@@ -27,4 +27,5 @@ assembler = Assembler.new(out_file: output_file)
 assembler.assemble_from_file(input_file)
 assembler.dump
 assembler.write_file
+assembler.write_symbols(File.join(File.dirname(output_file), File.basename(output_file, File.extname(output_file)) + ".sym"))
 puts "Assembled #{assembler.encoded.size} instructions into #{output_file}"
\ No newline at end of file
@@ -0,0 +1,597 @@
+#include "assembler.hpp"
+#include "cli.hpp"
+#include "isa.hpp"
+#include "program_image.hpp"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
+
+namespace Sim {
+
+namespace {
+
+// Bump when the encoding of some source changes, so that cached
+// binaries from before are not reused.
+constexpr uint64_t kCacheVersion = 2;
+
+// An operand as the Ruby assembler sees it: text, or a number once a
+// label name has been replaced by its address.
+struct Operand {
+    bool is_number;
+    int64_t number;
+    std::string text;
+};
+
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+bool is_word(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_hex_digit(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// String#strip, which also drops NULs.
+std::string strip(const std::string &text) {
+    size_t begin = 0;
+    size_t end = text.size();
+    while (begin < end && (is_space(text[begin]) || text[begin] == '\0')) {
+        ++begin;
+    }
+    while (end > begin && (is_space(text[end - 1]) || text[end - 1] == '\0')) {
+        --end;
+    }
+    return text.substr(begin, end - begin);
+}
+
+std::string downcase(std::string text) {
+    for (char &c : text) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    return text;
+}
+
+// String#to_i(base) for base 10 or 16, modulo 2^64: leading space, a
+// sign, an optional 0d/0x prefix, then digits with single underscores
+// between them, stopping at anything else.
+uint64_t ruby_to_i(const std::string &text, unsigned base) {
+    size_t i = 0;
+    while (i < text.size() && is_space(text[i])) {
+        ++i;
+    }
+    bool negative = false;
+    if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+        negative = text[i] == '-';
+        ++i;
+    }
+    const char prefix = base == 16 ? 'x' : 'd';
+    if (i + 1 < text.size() && text[i] == '0' && (text[i + 1] | 0x20) == prefix) {
+        i += 2;
+    }
+
+    uint64_t value = 0;
+    bool digits = false;
+    bool underscore = false;
+    for (; i < text.size(); ++i) {
+        const char c = text[i];
+        if (c == '_') {
+            if (!digits || underscore) {
+                break;
+            }
+            underscore = true;
+            continue;
+        }
+        unsigned digit = 0;
+        if (is_digit(c)) {
+            digit = static_cast<unsigned>(c - '0');
+        } else if (base == 16 && is_hex_digit(c)) {
+            digit = static_cast<unsigned>((c | 0x20) - 'a' + 10);
+        } else {
+            break;
+        }
+        value = value * base + digit;
+        digits = true;
+        underscore = false;
+    }
+    return negative ? 0 - value : value;
+}
+
+// Assembler#to_int.
+uint64_t to_int(const Operand &operand) {
+    if (operand.is_number) {
+        return static_cast<uint64_t>(operand.number);
+    }
+    const std::string text = strip(operand.text);
+    if (text.rfind("0x", 0) == 0) {
+        return ruby_to_i(text, 16);
+    }
+    if (text.rfind("#", 0) == 0) {
+        return ruby_to_i(text.substr(1), 10);
+    }
+    return ruby_to_i(text, 10);
+}
+
+// Assembler#reg_idx.
+bool reg_idx(const Operand &operand, uint32_t &idx, std::string &error) {
+    const std::string text = operand.is_number ? std::to_string(operand.number) : downcase(operand.text);
+    if (text == "zero") {
+        idx = 0;
+        return true;
+    }
+    if (text == "ra") {
+        idx = 1;
+        return true;
+    }
+    if (text == "sp") {
+        idx = 2;
+        return true;
+    }
+
+    const size_t first = !text.empty() && (text[0] == 'x' || text[0] == 'r') ? 1 : 0;
+    const size_t digits = text.size() - first;
+    if (digits >= 1 && digits <= 2 && is_digit(text[first]) && is_digit(text.back())) {
+        idx = static_cast<uint32_t>(std::stoul(text.substr(first)));
+        if (idx > 31) {
+            error = "Register out of range: " + text;
+            return false;
+        }
+        return true;
+    }
+    error = "Bad register name: \"" + text + "\"";
+    return false;
+}
+
+// "name:" at the start of a line, and whatever follows it.
+bool split_label(const std::string &line, std::string &label, std::string &rest) {
+    if (line.empty() || !(is_word(line[0]) && !is_digit(line[0]))) {
+        return false;
+    }
+    size_t end = 1;
+    while (end < line.size() && is_word(line[end])) {
+        ++end;
+    }
+    if (end == line.size() || line[end] != ':') {
+        return false;
+    }
+    size_t begin = end + 1;
+    while (begin < line.size() && is_space(line[begin])) {
+        ++begin;
+    }
+    label = line.substr(0, end);
+    rest = line.substr(begin);
+    return true;
+}
+
+// A bare number on its own line: [#][-]0xHEX or [#][-][-]DIGITS.
+bool is_data_word(const std::string &text) {
+    size_t i = text.rfind("#", 0) == 0 ? 1 : 0;
+    const size_t signed_at = i;
+
+    if (i < text.size() && text[i] == '-') {
+        ++i;
+    }
+    if (text.compare(i, 2, "0x") == 0 && i + 2 < text.size()) {
+        size_t j = i + 2;
+        while (j < text.size() && is_hex_digit(text[j])) {
+            ++j;
+        }
+        if (j == text.size()) {
+            return true;
+        }
+    }
+
+    i = signed_at;
+    for (int dashes = 0; dashes < 2 && i < text.size() && text[i] == '-'; ++dashes) {
+        ++i;
+    }
+    if (i == text.size()) {
+        return false;
+    }
+    while (i < text.size() && is_digit(text[i])) {
+        ++i;
+    }
+    return i == text.size();
+}
+
+// The text of a line before any ';' comment, stripped.
+std::string clean(const std::string &line) {
+    return strip(line.substr(0, line.find(';')));
+}
+
+// "offset(base)", split into its two operands.
+bool split_offset_base(const std::string &text, std::string &offset, std::string &base) {
+    const size_t open = text.rfind('(');
+    if (text.size() < 4 || text.back() != ')' || open == std::string::npos || open == 0
+        || open + 2 >= text.size()) {
+        return false;
+    }
+    for (size_t i = open + 1; i + 1 < text.size(); ++i) {
+        if (!is_word(text[i])) {
+            return false;
+        }
+    }
+    offset = strip(text.substr(0, open));
+    base = text.substr(open + 1, text.size() - open - 2);
+    return true;
+}
+
+bool expect_operands(const InstrDesc &desc, const std::vector<Operand> &args, size_t min, size_t max,
+                     std::string &error) {
+    if (args.size() < min || args.size() > max) {
+        error = std::string("wrong number of operands for ") + desc.mnemonic + " (given "
+            + std::to_string(args.size()) + ", expected " + std::to_string(max) + ")";
+        return false;
+    }
+    return true;
+}
+
+// The encoding methods of the Ruby Assembler, one per format.
+bool encode(const InstrDesc &desc, const std::vector<Operand> &args, Instruction &word, std::string &error) {
+    static constexpr size_t kOperands[kFormats] = {0, 1, 1, 3, 3, 2, 3, 3, 3, 4, 3};
+    const size_t wanted = kOperands[static_cast<size_t>(desc.format)];
+    if (!expect_operands(desc, args, desc.format == Format::system ? 0 : wanted, wanted, error)) {
+        return false;
+    }
+
+    uint32_t r[3] = {};
+    word = static_cast<Instruction>(desc.opcode) << 26;
+    const Instruction funct = desc.funct == kNoFunct ? 0 : static_cast<Instruction>(desc.funct);
+
+    switch (desc.format) {
+        case Format::jump: {
+            const uint64_t target = to_int(args[0]);
+            if ((target & 0x3) != 0) {
+                error = "J target must be word-aligned: " + std::to_string(static_cast<int64_t>(target));
+                return false;
+            }
+            word |= static_cast<Instruction>((target >> 2) & 0x03FF'FFFF);
+            return true;
+        }
+        case Format::system: {
+            const uint64_t code = args.empty() ? 0 : to_int(args[0]);
+            word |= static_cast<Instruction>((code & 0x3'FFFF) << 6) | funct;
+            return true;
+        }
+        case Format::pair: {
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error) || !reg_idx(args[3], r[2], error)) {
+                return false;
+            }
+            const uint64_t offset = to_int(args[2]);
+            if ((offset & 0x3) != 0) {
+                error = "STP offset must be word aligned: " + std::to_string(static_cast<int64_t>(offset));
+                return false;
+            }
+            word |= (r[2] << 21) | (r[0] << 16) | (r[1] << 11) | static_cast<Instruction>(offset & 0x7FF);
+            return true;
+        }
+        case Format::mem: {
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[2], r[1], error)) {
+                return false;
+            }
+            const uint64_t offset = to_int(args[1]);
+            if ((offset & 0x3) != 0) {
+                error = std::string(desc.kind == DecodedInstr::ld ? "LD" : "ST")
+                    + " offset must be word aligned: " + std::to_string(static_cast<int64_t>(offset));
+                return false;
+            }
+            word |= (r[1] << 21) | (r[0] << 16) | static_cast<Instruction>(offset & 0xFFFF);
+            return true;
+        }
+        case Format::dri:
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error)) {
+                return false;
+            }
+            word |= (r[0] << 21) | (r[1] << 16) | static_cast<Instruction>((to_int(args[2]) & 0x1F) << 11);
+            return true;
+        case Format::imm16s:
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error)) {
+                return false;
+            }
+            word |= (r[1] << 21) | (r[0] << 16) | static_cast<Instruction>(to_int(args[2]) & 0xFFFF);
+            return true;
+        case Format::branch:
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error)) {
+                return false;
+            }
+            word |= (r[0] << 21) | (r[1] << 16) | static_cast<Instruction>(to_int(args[2]) & 0xFFFF);
+            return true;
+        case Format::drr:
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error) || !reg_idx(args[2], r[2], error)) {
+                return false;
+            }
+            word |= (r[0] << 21) | (r[1] << 16) | (r[2] << 11) | funct;
+            return true;
+        case Format::dr:
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error)) {
+                return false;
+            }
+            word |= (r[0] << 21) | (r[1] << 16) | funct;
+            return true;
+        case Format::rrr:
+            if (!reg_idx(args[0], r[0], error) || !reg_idx(args[1], r[1], error) || !reg_idx(args[2], r[2], error)) {
+                return false;
+            }
+            word |= (r[1] << 21) | (r[2] << 16) | (r[0] << 11) | funct;
+            return true;
+        case Format::none:
+            break;
+    }
+    error = std::string("cannot encode ") + desc.mnemonic;
+    return false;
+}
+
+// Syscalls with a name of their own, as methods of the Ruby assembler.
+struct SyscallAlias {
+    const char *name;
+    uint32_t code;
+};
+
+constexpr SyscallAlias kSyscallAliases[] = {
+    {"memcpy", 8},
+    {"memset", 9},
+    {"memcmp", 10},
+};
+
+const SyscallAlias *find_syscall_alias(const std::string &name) {
+    for (const SyscallAlias &alias : kSyscallAliases) {
+        if (name == alias.name) {
+            return &alias;
+        }
+    }
+    return nullptr;
+}
+
+const InstrDesc *find_instruction(const std::string &name) {
+    for (const InstrDesc &desc : kIsa) {
+        if (name == desc.name) {
+            return &desc;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+bool assemble(const std::string &source, std::vector<Instruction> &words, std::string &error,
+              std::vector<Symbol> *symbols) {
+    std::vector<std::string> lines;
+    std::istringstream in(source);
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(clean(line));
+    }
+
+    // Pass 1: label addresses.
+    std::unordered_map<std::string, int64_t> labels;
+    std::vector<std::string> defined;   // first definitions, in order
+    int64_t address = 0;
+    for (const std::string &line : lines) {
+        if (line.empty()) {
+            continue;
+        }
+        std::string label;
+        std::string rest;
+        if (split_label(line, label, rest)) {
+            if (labels.count(label) == 0) {
+                defined.push_back(label);
+            }
+            labels[label] = address;
+            if (!strip(rest).empty()) {
+                address += kInstructionBytes;
+            }
+        } else {
+            address += kInstructionBytes;
+        }
+    }
+
+    // Pass 2: encoding.
+    words.clear();
+    int64_t pc = 0;
+    for (size_t number = 0; number < lines.size(); ++number) {
+        std::string line = lines[number];
+        if (line.empty()) {
+            continue;
+        }
+        std::string label;
+        std::string rest;
+        if (split_label(line, label, rest)) {
+            line = strip(rest);
+            if (line.empty()) {
+                continue;
+            }
+        }
+        const std::string where = "line " + std::to_string(number + 1) + ": ";
+
+        if (is_data_word(line)) {
+            words.push_back(static_cast<Instruction>(to_int(Operand{false, 0, line})));
+            pc += kInstructionBytes;
+            continue;
+        }
+
+        size_t split = 0;
+        while (split < line.size() && !is_space(line[split])) {
+            ++split;
+        }
+        std::string name = downcase(line.substr(0, split));
+        while (split < line.size() && is_space(line[split])) {
+            ++split;
+        }
+        if (name == "and") {
+            name = "and_";
+        }
+
+        std::vector<std::string> args;
+        std::istringstream fields(line.substr(split));
+        for (std::string field; std::getline(fields, field, ',');) {
+            field = strip(field);
+            if (!field.empty()) {
+                args.push_back(field);
+            }
+        }
+
+        if (const SyscallAlias *alias = find_syscall_alias(name)) {
+            if (!args.empty()) {
+                error = where + name + " takes no operands";
+                return false;
+            }
+            name = "syscall";
+            args.push_back(std::to_string(alias->code));
+        }
+
+        const InstrDesc *desc = find_instruction(name);
+        if (desc == nullptr) {
+            char pc_text[32];
+            std::snprintf(pc_text, sizeof(pc_text), "%llx", static_cast<unsigned long long>(pc));
+            error = where + "Unknown instruction '" + name + "' at pc=0x" + pc_text + " (line: " + line + ")";
+            return false;
+        }
+
+        if ((desc->format == Format::mem || desc->format == Format::pair) && !args.empty()) {
+            std::string offset = "0";
+            std::string base = args.back();
+            std::string last = args.back();
+            args.pop_back();
+            split_offset_base(last, offset, base);
+            args.push_back(offset);
+            args.push_back(base);
+        }
+
+        std::vector<Operand> operands;
+        if (!args.empty() && (desc->format == Format::branch || desc->format == Format::jump)) {
+            const std::string &target = desc->format == Format::branch ? args.back() : args.front();
+            auto it = labels.find(target);
+            if (it == labels.end()) {
+                error = where + "Undefined label: " + target;
+                return false;
+            }
+            if (desc->format == Format::jump) {
+                args.clear();
+            } else {
+                args.pop_back();
+            }
+            for (const std::string &arg : args) {
+                operands.push_back(Operand{false, 0, arg});
+            }
+            const int64_t offset = desc->format == Format::jump ? it->second : (it->second - pc) >> 2;
+            operands.push_back(Operand{true, offset, std::string()});
+        } else {
+            for (const std::string &arg : args) {
+                operands.push_back(Operand{false, 0, arg});
+            }
+        }
+        for (Operand &operand : operands) {
+            auto it = operand.is_number ? labels.end() : labels.find(operand.text);
+            if (it != labels.end()) {
+                operand = Operand{true, it->second, std::string()};
+            }
+        }
+
+        Instruction word = 0;
+        if (!encode(*desc, operands, word, error)) {
+            error = where + error;
+            return false;
+        }
+        words.push_back(word);
+        pc += kInstructionBytes;
+    }
+
+    if (symbols != nullptr) {
+        symbols->clear();
+        for (const std::string &name : defined) {
+            symbols->push_back(Symbol{static_cast<Address>(labels[name]), name});
+        }
+    }
+    return true;
+}
+
+std::filesystem::path default_asm_cache_dir() {
+    return user_cache_dir("TOY_ASM_CACHE", "asm");
+}
+
+std::filesystem::path assemble_cached(const std::filesystem::path &source,
+                                      const std::filesystem::path &cache_dir) {
+    std::ifstream in(source, std::ios::binary);
+    if (!in) {
+        std::cerr << "asm: cannot open file: " << source << "\n";
+        return {};
+    }
+    const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    const uint64_t hash = program_hash(reinterpret_cast<const Byte*>(text.data()), text.size()) ^ kCacheVersion;
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+    const std::filesystem::path cached = cache_dir / name;
+
+    std::error_code ec;
+    if (std::filesystem::file_size(cached, ec) > 0 && !ec) {
+        return cached;
+    }
+
+    std::vector<Instruction> words;
+    std::vector<Symbol> symbols;
+    std::string error;
+    if (!assemble(text, words, error, &symbols)) {
+        std::cerr << "asm: " << source.string() << ": " << error << "\n";
+        return {};
+    }
+    if (words.empty()) {
+        std::cerr << "asm: " << source.string() << ": no instructions\n";
+        return {};
+    }
+
+    std::vector<Byte> bytes;
+    for (Instruction word : words) {
+        for (unsigned i = 0; i < kInstructionBytes; ++i) {
+            bytes.push_back(static_cast<Byte>(word >> (8 * i)));
+        }
+    }
+
+    // Written under a private name and renamed, so a concurrent run
+    // never sees a partial file. The symbols go first: a cached binary
+    // always has them.
+    std::filesystem::create_directories(cache_dir, ec);
+    const std::filesystem::path partial_symbols = symbol_path(cached).string() + "." + std::to_string(getpid());
+    if (!SymbolTable::write(partial_symbols, symbols)) {
+        std::filesystem::remove(partial_symbols, ec);
+        return {};
+    }
+    std::filesystem::rename(partial_symbols, symbol_path(cached), ec);
+    if (ec) {
+        std::filesystem::remove(partial_symbols, ec);
+        std::cerr << "asm: cannot write cache file: " << symbol_path(cached) << "\n";
+        return {};
+    }
+    const std::filesystem::path partial = cached.string() + "." + std::to_string(getpid());
+    std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    out.close();
+    if (!out) {
+        std::filesystem::remove(partial, ec);
+        std::cerr << "asm: cannot write cache file: " << cached << "\n";
+        return {};
+    }
+    std::filesystem::rename(partial, cached, ec);
+    if (ec) {
+        std::filesystem::remove(partial, ec);
+        std::cerr << "asm: cannot write cache file: " << cached << "\n";
+        return {};
+    }
+    return cached;
+}
+
+} // namespace Sim
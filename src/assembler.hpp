@@ -0,0 +1,37 @@
+#ifndef ASSEMBLER_HPP_
+#define ASSEMBLER_HPP_
+
+#include "config.hpp"
+#include "symbols.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace Sim {
+
+// Two-pass assembler for the syntax of src/asm/assembler.rb: labels,
+// ';' comments, offset(base) operands, the zero/ra/sp register aliases
+// and bare numbers as raw data words. Operands are read the way the
+// Ruby assembler reads them, down to its String#to_i rules, so any
+// source both accept assembles to the same words.
+//
+// On failure error names the line and what was wrong with it. If
+// symbols is given it receives the labels, in order of definition.
+bool assemble(const std::string &source, std::vector<Instruction> &words, std::string &error,
+              std::vector<Symbol> *symbols = nullptr);
+
+// Assembles the file at source into cache_dir/<hash>.bin, where hash
+// covers the source text, with its labels in <hash>.sym, and returns
+// the .bin path. A cached binary is
+// reused without assembling. Returns an empty path (and reports why)
+// on failure.
+std::filesystem::path assemble_cached(const std::filesystem::path &source,
+                                      const std::filesystem::path &cache_dir);
+
+// $TOY_ASM_CACHE, else toy_cpu/asm under $XDG_CACHE_HOME or ~/.cache.
+std::filesystem::path default_asm_cache_dir();
+
+} // namespace Sim
+
+#endif // ASSEMBLER_HPP_
@@ -0,0 +1,250 @@
+#include "batch.hpp"
+#include "cli.hpp"
+#include "lockstep.hpp"
+#include "thread_pool.hpp"
+
+#include <condition_variable>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <unordered_map>
+
+namespace Sim {
+
+namespace {
+
+// Records are buffered until every earlier one is written; this bounds
+// how far the reader may run ahead of the slowest job.
+constexpr size_t kJobsPerWorker = 64;
+
+struct Record {
+    std::string text;
+    bool ok;
+};
+
+std::string error_record(size_t job, const std::string &error) {
+    std::string text = "{\"job\":" + std::to_string(job) + ",\"error\":";
+    append_json_string(text, error);
+    text += '}';
+    return text;
+}
+
+bool is_blank(const std::string &line) {
+    size_t first = line.find_first_not_of(" \t\r");
+    return first == std::string::npos || line[first] == '#';
+}
+
+} // namespace
+
+bool BatchRunner::prepare(CPU &cpu, Snapshot &warm, size_t job, const std::string &line,
+                          std::string &error_text) const {
+    std::vector<std::pair<Register_idx, Register>> assignments;
+    std::istringstream tokens(line);
+    std::string token;
+    while (tokens >> token) {
+        Register_idx idx = 0;
+        Register value = 0;
+        std::string error;
+        if (!parse_register_assignment(token, idx, value, error)) {
+            error_text = error_record(job, error);
+            return false;
+        }
+        assignments.emplace_back(idx, value);
+    }
+
+    if (warm.epoch == 0) {
+        // The first job on this CPU loads the program, or the snapshot,
+        // and the images; later ones only rewind the pages their
+        // predecessor wrote and keep the decoded and translated code.
+        if (!options_.resume) {
+            cpu.reset();
+            if (!cpu.load_program(*program_, options_.base)) {
+                error_text = error_record(job, "cannot load program");
+                return false;
+            }
+        } else {
+            if (!cpu.load_snapshot(program_->path())) {
+                error_text = error_record(job, "cannot load snapshot");
+                return false;
+            }
+            cpu.resume();
+        }
+        if (!load_images(cpu)) {
+            error_text = error_record(job, "cannot load image");
+            return false;
+        }
+        warm = cpu.snapshot();
+    } else if (!cpu.restore(warm)) {
+        error_text = error_record(job, "cannot restore snapshot");
+        return false;
+    }
+    for (const auto &reg : options_.registers) {
+        cpu.set_register(reg.first, reg.second);
+    }
+    for (const auto &reg : assignments) {
+        cpu.set_register(reg.first, reg.second);
+    }
+    if (options_.entry) {
+        cpu.set_PC(*options_.entry);
+    }
+    return true;
+}
+
+bool BatchRunner::load_images(CPU &cpu) const {
+    for (const auto &image : options_.images) {
+        if (!cpu.load_program(*image.first, image.second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string BatchRunner::record(const CPU &cpu, size_t job, const std::string &output) {
+    std::string text = "{\"job\":" + std::to_string(job)
+        + ",\"halted\":" + (cpu.is_halted() ? "true" : "false")
+        + ",\"retired\":" + std::to_string(cpu.get_retired())
+        + ",\"pc\":" + std::to_string(cpu.get_PC())
+        + ",\"regs\":[";
+    for (Register_idx i = 0; i < kNumberOfRegisters; ++i) {
+        if (i != 0) {
+            text += ',';
+        }
+        text += std::to_string(cpu.get_register(i));
+    }
+    text += "],\"output\":";
+    append_json_string(text, output);
+    text += '}';
+    return text;
+}
+
+bool BatchRunner::run(std::istream &in, std::ostream &out) const {
+    ThreadPool pool(options_.threads);
+    const size_t lanes = options_.lanes < 1 ? 1 : options_.lanes;
+
+    // Per worker: one CPU per lane and, with lanes, a lockstep engine.
+    struct Worker {
+        std::vector<std::unique_ptr<CPU>> cpus;
+        std::vector<Snapshot> warm;         // per CPU
+        std::unique_ptr<Lockstep<8>> lockstep8;
+        std::unique_ptr<Lockstep<16>> lockstep16;
+    };
+    std::vector<Worker> workers(pool.size());
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::unordered_map<size_t, Record> done;
+    size_t written = 0;
+    bool ok = true;
+
+    // Writes finished records in job order, waiting until at least
+    // `until` of them are out.
+    auto drain = [&](size_t until) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            auto it = done.find(written);
+            if (it == done.end()) {
+                if (written >= until) {
+                    return;
+                }
+                ready.wait(lock);
+                continue;
+            }
+            Record record = std::move(it->second);
+            done.erase(it);
+            lock.unlock();
+            out << record.text << '\n';
+            ok = ok && record.ok;
+            lock.lock();
+            ++written;
+        }
+    };
+
+    // Runs jobs first .. first + lines.size() - 1 on one worker.
+    auto run_group = [this, lanes, &workers, &mutex, &ready, &done](size_t worker, size_t first,
+                                                                 const std::vector<std::string> &lines) {
+        Worker &state = workers[worker];
+        while (state.cpus.size() < lines.size()) {
+            state.cpus.push_back(std::make_unique<CPU>());
+            state.cpus.back()->set_engine(options_.engine);
+            state.warm.emplace_back();
+        }
+
+        std::vector<Record> records(lines.size());
+        std::vector<std::ostringstream> outputs(lines.size());
+        std::vector<CPU*> runnable;
+        std::vector<size_t> runnable_jobs;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            CPU &cpu = *state.cpus[i];
+            if (!prepare(cpu, state.warm[i], first + i, lines[i], records[i].text)) {
+                records[i].ok = false;
+                continue;
+            }
+            cpu.set_output(outputs[i]);
+            runnable.push_back(&cpu);
+            runnable_jobs.push_back(i);
+        }
+
+        if (lanes == 1) {
+            for (CPU *cpu : runnable) {
+                cpu->run();
+            }
+        } else if (lanes <= 8) {
+            if (state.lockstep8 == nullptr) {
+                state.lockstep8 = std::make_unique<Lockstep<8>>();
+            }
+            state.lockstep8->run(runnable.data(), runnable.size());
+        } else {
+            if (state.lockstep16 == nullptr) {
+                state.lockstep16 = std::make_unique<Lockstep<16>>();
+            }
+            state.lockstep16->run(runnable.data(), runnable.size());
+        }
+
+        for (size_t k = 0; k < runnable.size(); ++k) {
+            const size_t i = runnable_jobs[k];
+            runnable[k]->set_output(std::cout);
+            records[i].text = record(*runnable[k], first + i, outputs[i].str());
+            records[i].ok = true;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < lines.size(); ++i) {
+            done.emplace(first + i, std::move(records[i]));
+        }
+        ready.notify_one();
+    };
+
+    const size_t window = pool.size() * lanes * kJobsPerWorker;
+    size_t submitted = 0;
+    std::vector<std::string> group;
+    auto submit = [&]() {
+        const size_t first = submitted;
+        submitted += group.size();
+        pool.submit([&run_group, first, lines = std::move(group)](size_t worker) {
+            run_group(worker, first, lines);
+        });
+        group.clear();
+        drain(submitted >= window ? submitted - window : 0);
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (is_blank(line)) {
+            continue;
+        }
+        group.push_back(line);
+        if (group.size() == lanes) {
+            submit();
+        }
+    }
+    if (!group.empty()) {
+        submit();
+    }
+
+    drain(submitted);
+    out.flush();
+    return ok;
+}
+
+} // namespace Sim
@@ -0,0 +1,70 @@
+#ifndef BATCH_HPP_
+#define BATCH_HPP_
+
+#include "config.hpp"
+#include "cpu.hpp"
+#include "program_image.hpp"
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Sim {
+
+struct BatchOptions {
+    Engine engine = Engine::block;
+    Address base = 0;
+    std::optional<Address> entry;   // unset: where the program or snapshot starts
+    bool resume = false;            // the program file is a snapshot to continue from
+    size_t threads = 0;     // 0: one per hardware thread
+    size_t lanes = 1;       // jobs run together in lockstep: 1, 8 or 16
+    std::vector<std::pair<std::shared_ptr<const ProgramImage>, Address>> images;
+    std::vector<std::pair<Register_idx, Register>> registers;  // defaults for every job
+};
+
+// Runs one program over many register-initialization vectors. The
+// program and data images are opened once and mapped into a private
+// CPU per worker thread. Each CPU loads them, or with resume the
+// snapshot, once and takes a Snapshot; every later job restores it, so
+// it costs a rewind of the pages the previous job wrote rather than a
+// reset and reload.
+// With lanes > 1, each worker takes groups of that many consecutive
+// jobs and runs them in lockstep (see Lockstep).
+//
+// Input has one job per line: whitespace-separated "xN=V" assignments
+// applied on top of the defaults. Blank lines and lines starting with
+// '#' are skipped. Output has one JSON object per job, in input order:
+//
+//   {"job":0,"halted":true,"retired":42,"pc":28,"regs":[...],"output":"144\n"}
+//
+// or {"job":N,"error":"..."} for a line that could not be parsed.
+class BatchRunner {
+private:
+    std::shared_ptr<const ProgramImage> program_;
+    BatchOptions options_;
+
+    // Sets cpu up for the job, loading it on its first job and
+    // restoring warm after that; on failure error_text is the job's
+    // error record.
+    bool prepare(CPU &cpu, Snapshot &warm, size_t job, const std::string &line,
+                 std::string &error_text) const;
+    bool load_images(CPU &cpu) const;
+    static std::string record(const CPU &cpu, size_t job, const std::string &output);
+
+public:
+    BatchRunner(std::shared_ptr<const ProgramImage> program, BatchOptions options)
+        : program_(std::move(program)),
+        options_(std::move(options))
+    {}
+
+    // Returns false if any job could not be parsed or loaded.
+    bool run(std::istream &in, std::ostream &out) const;
+};
+
+} // namespace Sim
+
+#endif // BATCH_HPP_
@@ -0,0 +1,116 @@
+#include "block_cache.hpp"
+
+#include <algorithm>
+
+namespace Sim {
+
+BlockCache::BlockCache()
+    : generation_(0)
+{
+    fast_.fill(nullptr);
+}
+
+BasicBlock *BlockCache::lookup(Address pc) {
+    retired_.clear();
+
+    BasicBlock *&slot = fast_[slot_of(pc)];
+    if (slot != nullptr && slot->start == pc) {
+        return slot;
+    }
+
+    auto it = blocks_.find(pc);
+    if (it == blocks_.end()) {
+        return nullptr;
+    }
+    slot = it->second.get();
+    return slot;
+}
+
+BasicBlock &BlockCache::insert(std::unique_ptr<BasicBlock> block) {
+    BasicBlock *raw = block.get();
+
+    uint64_t end = raw->start + raw->ops.size() * kInstructionBytes;
+    for (uint64_t page = raw->start >> kPageShift; page <= ((end - 1) >> kPageShift); ++page) {
+        page_blocks_[static_cast<Address>(page)].push_back(raw);
+    }
+
+    fast_[slot_of(raw->start)] = raw;
+    blocks_[raw->start] = std::move(block);
+    return *raw;
+}
+
+void BlockCache::drop(BasicBlock *block) {
+    uint64_t end = block->start + block->ops.size() * kInstructionBytes;
+    for (uint64_t page = block->start >> kPageShift; page <= ((end - 1) >> kPageShift); ++page) {
+        auto it = page_blocks_.find(static_cast<Address>(page));
+        if (it == page_blocks_.end()) {
+            continue;
+        }
+        std::vector<BasicBlock*> &list = it->second;
+        list.erase(std::remove(list.begin(), list.end(), block), list.end());
+        if (list.empty()) {
+            page_blocks_.erase(it);
+        }
+    }
+
+    BasicBlock *&slot = fast_[slot_of(block->start)];
+    if (slot == block) {
+        slot = nullptr;
+    }
+
+    auto it = blocks_.find(block->start);
+    if (it != blocks_.end() && it->second.get() == block) {
+        // The block may still be executing, so keep it alive until the
+        // next lookup instead of freeing it under the caller's feet.
+        retired_.push_back(std::move(it->second));
+        blocks_.erase(it);
+    }
+    ++generation_;
+}
+
+void BlockCache::collect(Address addr, size_t size, std::vector<BasicBlock*> &hit) const {
+    uint64_t lo = addr;
+    uint64_t hi = lo + size;
+
+    for (uint64_t page = lo >> kPageShift; page <= ((hi - 1) >> kPageShift); ++page) {
+        auto it = page_blocks_.find(static_cast<Address>(page));
+        if (it == page_blocks_.end()) {
+            continue;
+        }
+        for (BasicBlock *block : it->second) {
+            uint64_t start = block->start;
+            uint64_t end = start + block->ops.size() * kInstructionBytes;
+            if (start < hi && lo < end
+                && std::find(hit.begin(), hit.end(), block) == hit.end()) {
+                hit.push_back(block);
+            }
+        }
+    }
+}
+
+bool BlockCache::overlaps(Address addr, size_t size) const {
+    std::vector<BasicBlock*> hit;
+    collect(addr, size, hit);
+    return !hit.empty();
+}
+
+void BlockCache::invalidate(Address addr, size_t size) {
+    std::vector<BasicBlock*> hit;
+    collect(addr, size, hit);
+
+    for (BasicBlock *block : hit) {
+        drop(block);
+    }
+}
+
+void BlockCache::clear() {
+    for (auto &entry : blocks_) {
+        retired_.push_back(std::move(entry.second));
+    }
+    blocks_.clear();
+    page_blocks_.clear();
+    fast_.fill(nullptr);
+    ++generation_;
+}
+
+} // namespace Sim
@@ -0,0 +1,97 @@
+#ifndef BLOCK_CACHE_HPP_
+#define BLOCK_CACHE_HPP_
+
+#include "config.hpp"
+#include "instructions.hpp"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace Sim {
+
+class CPU;
+struct DecodedOp;
+
+using OpHandler = void (CPU::*)(const DecodedOp &op, Address &next_pc);
+
+// One instruction with its fields already extracted, so executing it
+// is a single indirect call with no decoding left to do.
+struct DecodedOp {
+    OpHandler handler;
+    Register_idx rd;
+    Register_idx rs;
+    Register_idx rt;
+    Register imm;
+    Address pc;
+    Address next;     // fall-through pc
+    Address target;   // taken target of j/beq/bne
+    Instruction raw;
+    DecodedInstr kind;
+    const void *dispatch;   // handler label for the threaded engine
+    OpHandler fused;        // runs this op and the next width - 1 as one
+    uint8_t width;          // ops covered by fused; 0 inside a fused run
+};
+
+// Straight-line run of decoded instructions ending at the first
+// control transfer (j, beq, bne, syscall, unknown) or at kMaxBlockOps.
+struct BasicBlock {
+    Address start;
+    Address end;      // address past the last instruction
+    std::vector<DecodedOp> ops;
+    bool threaded;    // ops[].dispatch is filled in
+    uint32_t heat;    // executions so far, drives JIT translation
+};
+
+class BlockCache {
+public:
+    static constexpr size_t kMaxBlockOps = 64;
+    static constexpr unsigned kPageShift = 12;
+
+private:
+    static constexpr size_t kFastSlots = 1024;
+
+    std::unordered_map<Address, std::unique_ptr<BasicBlock>> blocks_;
+    std::unordered_map<Address, std::vector<BasicBlock*>> page_blocks_;
+    std::array<BasicBlock*, kFastSlots> fast_;
+    std::vector<std::unique_ptr<BasicBlock>> retired_;
+
+    uint64_t generation_;
+
+    static size_t slot_of(Address pc) {
+        return (pc >> 2) & (kFastSlots - 1);
+    }
+
+    void drop(BasicBlock *block);
+    void collect(Address addr, size_t size, std::vector<BasicBlock*> &hit) const;
+
+public:
+    BlockCache();
+
+    BasicBlock *lookup(Address pc);
+    BasicBlock &insert(std::unique_ptr<BasicBlock> block);
+
+    // Whether any cached block holds a byte of [addr, addr + size).
+    bool overlaps(Address addr, size_t size) const;
+    void invalidate(Address addr, size_t size);
+    void clear();
+
+    template <class Visit>
+    void for_each(Visit &&visit) const {
+        for (const auto &entry : blocks_) {
+            visit(*entry.second);
+        }
+    }
+
+    // Bumped whenever a block is dropped; the executing block is only
+    // safe to continue while this stays unchanged.
+    uint64_t generation() const {
+        return generation_;
+    }
+};
+
+} // namespace Sim
+
+#endif // BLOCK_CACHE_HPP_
@@ -0,0 +1,222 @@
+#include "toy_cpu.h"
+#include "cpu.hpp"
+
+#include <new>
+#include <sstream>
+#include <string>
+
+// The C interface in include/toy_cpu.h. Nothing may throw across it,
+// so every entry point that can allocate catches and reports failure.
+struct toy_cpu {
+    Sim::CPU cpu;
+    std::ostringstream output;
+    std::ostringstream diagnostics;
+    mutable std::string output_text;
+    mutable std::string diagnostics_text;
+
+    toy_cpu() {
+        cpu.reset();
+        cpu.set_output(output);
+        cpu.set_diagnostics(diagnostics);
+    }
+};
+
+namespace {
+
+toy_status status_of(const Sim::CPU &cpu) {
+    if (!cpu.is_halted()) {
+        return TOY_STATUS_BUDGET;
+    }
+    switch (cpu.get_fault()) {
+        case Sim::Fault::misaligned_access:
+            return TOY_STATUS_MISALIGNED;
+        case Sim::Fault::unknown_instruction:
+            return TOY_STATUS_UNKNOWN_INSTRUCTION;
+        case Sim::Fault::unknown_syscall:
+            return TOY_STATUS_UNKNOWN_SYSCALL;
+        case Sim::Fault::none:
+            break;
+    }
+    return TOY_STATUS_HALTED;
+}
+
+const char *text_of(const std::ostringstream &stream, std::string &text, size_t *size) {
+    try {
+        text = stream.str();
+    } catch (const std::bad_alloc &) {
+        text.clear();
+    }
+    if (size != nullptr) {
+        *size = text.size();
+    }
+    return text.c_str();
+}
+
+} // namespace
+
+extern "C" {
+
+int toy_api_version(void) {
+    return TOY_API_VERSION;
+}
+
+toy_cpu *toy_cpu_create(void) {
+    try {
+        return new toy_cpu();
+    } catch (const std::exception &) {
+        return nullptr;
+    }
+}
+
+void toy_cpu_destroy(toy_cpu *cpu) {
+    delete cpu;
+}
+
+int toy_cpu_reset(toy_cpu *cpu) {
+    if (cpu == nullptr) {
+        return TOY_ERR_ARGUMENT;
+    }
+    toy_cpu_clear_output(cpu);
+    try {
+        cpu->cpu.reset();
+    } catch (const std::exception &e) {
+        // Only remapping guest memory or allocation can fail here.
+        cpu->diagnostics << "toy_cpu_reset: " << e.what() << "\n";
+        return TOY_ERR_MEMORY;
+    }
+    return TOY_OK;
+}
+
+int toy_cpu_set_engine(toy_cpu *cpu, toy_engine engine) {
+    if (cpu == nullptr) {
+        return TOY_ERR_ARGUMENT;
+    }
+    switch (engine) {
+        case TOY_ENGINE_BLOCK:
+            cpu->cpu.set_engine(Sim::Engine::block);
+            return TOY_OK;
+        case TOY_ENGINE_THREADED:
+            cpu->cpu.set_engine(Sim::Engine::threaded);
+            return TOY_OK;
+        case TOY_ENGINE_JIT:
+            cpu->cpu.set_engine(Sim::Engine::jit);
+            return TOY_OK;
+    }
+    return TOY_ERR_ARGUMENT;
+}
+
+int toy_cpu_load_program(toy_cpu *cpu, const void *data, size_t size, uint32_t base) {
+    if (cpu == nullptr || (data == nullptr && size != 0)) {
+        return TOY_ERR_ARGUMENT;
+    }
+    try {
+        return cpu->cpu.load_buffer(data, size, base) ? TOY_OK : TOY_ERR_RANGE;
+    } catch (const std::bad_alloc &) {
+        cpu->diagnostics << "toy_cpu_load_program: out of memory\n";
+        return TOY_ERR_MEMORY;
+    }
+}
+
+int toy_cpu_get_register(const toy_cpu *cpu, unsigned index, uint32_t *value) {
+    if (cpu == nullptr || value == nullptr || index >= Sim::kNumberOfRegisters) {
+        return TOY_ERR_ARGUMENT;
+    }
+    *value = cpu->cpu.get_register(index);
+    return TOY_OK;
+}
+
+int toy_cpu_set_register(toy_cpu *cpu, unsigned index, uint32_t value) {
+    if (cpu == nullptr || index >= Sim::kNumberOfRegisters) {
+        return TOY_ERR_ARGUMENT;
+    }
+    cpu->cpu.set_register(index, value);
+    return TOY_OK;
+}
+
+uint32_t toy_cpu_get_pc(const toy_cpu *cpu) {
+    return cpu != nullptr ? cpu->cpu.get_PC() : 0;
+}
+
+void toy_cpu_set_pc(toy_cpu *cpu, uint32_t pc) {
+    if (cpu != nullptr) {
+        cpu->cpu.set_PC(pc);
+    }
+}
+
+int toy_cpu_read_memory(const toy_cpu *cpu, uint32_t addr, void *data, size_t size) {
+    if (cpu == nullptr || (data == nullptr && size != 0)) {
+        return TOY_ERR_ARGUMENT;
+    }
+    return cpu->cpu.read_memory(addr, data, size) ? TOY_OK : TOY_ERR_RANGE;
+}
+
+int toy_cpu_write_memory(toy_cpu *cpu, uint32_t addr, const void *data, size_t size) {
+    if (cpu == nullptr || (data == nullptr && size != 0)) {
+        return TOY_ERR_ARGUMENT;
+    }
+    try {
+        return cpu->cpu.write_memory(addr, data, size) ? TOY_OK : TOY_ERR_RANGE;
+    } catch (const std::bad_alloc &) {
+        cpu->diagnostics << "toy_cpu_write_memory: out of memory\n";
+        return TOY_ERR_MEMORY;
+    }
+}
+
+toy_run_result toy_cpu_run(toy_cpu *cpu, uint64_t budget) {
+    toy_run_result result{};
+    if (cpu == nullptr) {
+        result.status = TOY_STATUS_HALTED;
+        return result;
+    }
+
+    Sim::CPU &core = cpu->cpu;
+    const uint64_t before = core.get_retired();
+    bool failed = false;
+    try {
+        if (budget == 0) {
+            core.run();
+        } else {
+            core.run_for(budget);
+        }
+    } catch (const std::exception &e) {
+        // Only allocation can throw here.
+        cpu->diagnostics << "toy_cpu_run: " << e.what() << "\n";
+        failed = true;
+    }
+
+    result.status = failed ? TOY_STATUS_ERROR : status_of(core);
+    result.pc = core.get_fault() != Sim::Fault::none ? core.get_fault_pc() : core.get_PC();
+    result.executed = core.get_retired() - before;
+    result.retired = core.get_retired();
+    return result;
+}
+
+void toy_cpu_resume(toy_cpu *cpu) {
+    if (cpu != nullptr) {
+        cpu->cpu.resume();
+    }
+}
+
+const char *toy_cpu_output(const toy_cpu *cpu, size_t *size) {
+    if (cpu == nullptr) {
+        return nullptr;
+    }
+    return text_of(cpu->output, cpu->output_text, size);
+}
+
+const char *toy_cpu_diagnostics(const toy_cpu *cpu, size_t *size) {
+    if (cpu == nullptr) {
+        return nullptr;
+    }
+    return text_of(cpu->diagnostics, cpu->diagnostics_text, size);
+}
+
+void toy_cpu_clear_output(toy_cpu *cpu) {
+    if (cpu == nullptr) {
+        return;
+    }
+    cpu->output.str(std::string());
+    cpu->diagnostics.str(std::string());
+}
+
+} // extern "C"
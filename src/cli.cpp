@@ -0,0 +1,110 @@
+#include "cli.hpp"
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace Sim {
+
+bool parse_address(const std::string &text, Address &out) {
+    uint64_t value = 0;
+    std::from_chars_result rc;
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+        rc = std::from_chars(text.data() + 2, text.data() + text.size(), value, kBaseOfNumSys16);
+    } else {
+        rc = std::from_chars(text.data(), text.data() + text.size(), value, kBaseOfNumSys10);
+    }
+    if (rc.ec != std::errc() || rc.ptr != text.data() + text.size() || value > UINT32_MAX) {
+        return false;
+    }
+    out = static_cast<Address>(value);
+    return true;
+}
+
+bool parse_register_assignment(const std::string &text, Register_idx &idx, Register &value,
+                               std::string &error) {
+    size_t eq_pos = text.find('=');
+    if (eq_pos == std::string::npos
+        || eq_pos < 2
+        || (text[0] != 'x' && text[0] != 'X')) {
+        error = "Invalid register argument: " + text + ". Expected format: x1=N";
+        return false;
+    }
+
+    std::string reg_str = text.substr(1, eq_pos - 1);
+
+    size_t reg_idx = 0;
+    std::from_chars_result rc_reg = std::from_chars(reg_str.data(), reg_str.data() + reg_str.size(),
+                                                    reg_idx, kBaseOfNumSys10);
+    if (rc_reg.ec != std::errc()) {
+        error = "Invalid register numder in: " + text;
+        return false;
+    }
+    if (reg_idx >= kNumberOfRegisters) {
+        error = "Register index out of range (0.." + std::to_string(kNumberOfRegisters - 1)
+            + "): " + std::to_string(reg_idx);
+        return false;
+    }
+
+    std::string val_str = text.substr(eq_pos + 1);
+    if (val_str.empty()) {
+        error = "Empty value in argument: " + text;
+        return false;
+    }
+
+    size_t val_val = 0;
+    std::from_chars_result rc_val;
+    if (val_str.size() > 2 && (val_str[0] == '0')
+        && (val_str[1] == 'x'
+        || val_str[1] == 'X')) {
+        rc_val = std::from_chars(val_str.data() + 2, val_str.data() + val_str.size(), val_val, kBaseOfNumSys16);
+    } else {
+        rc_val = std::from_chars(val_str.data(), val_str.data() + val_str.size(), val_val, kBaseOfNumSys10);
+    }
+    if (rc_val.ec != std::errc()) {
+        error = "Bad number in argument: " + text;
+        return false;
+    }
+
+    idx = static_cast<Register_idx>(reg_idx);
+    value = static_cast<Register>(val_val & 0xFFFFFFFF);
+    return true;
+}
+
+void append_json_string(std::string &out, const std::string &text) {
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+                break;
+        }
+    }
+    out += '"';
+}
+
+std::filesystem::path user_cache_dir(const char *variable, const char *name) {
+    if (const char *dir = std::getenv(variable); dir != nullptr && *dir != '\0') {
+        return dir;
+    }
+    if (const char *dir = std::getenv("XDG_CACHE_HOME"); dir != nullptr && *dir != '\0') {
+        return std::filesystem::path(dir) / "toy_cpu" / name;
+    }
+    if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+        return std::filesystem::path(home) / ".cache" / "toy_cpu" / name;
+    }
+    return std::filesystem::temp_directory_path() / (std::string("toy_cpu-") + name);
+}
+
+} // namespace Sim
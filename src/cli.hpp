@@ -0,0 +1,28 @@
+#ifndef CLI_HPP_
+#define CLI_HPP_
+
+#include "config.hpp"
+
+#include <filesystem>
+#include <string>
+
+namespace Sim {
+
+// Decimal or 0x-prefixed hex guest address.
+bool parse_address(const std::string &text, Address &out);
+
+// An "xN=V" register assignment; V is decimal or 0x-prefixed hex and
+// is truncated to 32 bits. On failure error says what was wrong.
+bool parse_register_assignment(const std::string &text, Register_idx &idx, Register &value,
+                               std::string &error);
+
+// Appends text as a quoted, escaped JSON string.
+void append_json_string(std::string &out, const std::string &text);
+
+// Directory of an on-disk cache: $variable if set, else toy_cpu/name
+// under $XDG_CACHE_HOME or ~/.cache.
+std::filesystem::path user_cache_dir(const char *variable, const char *name);
+
+} // namespace Sim
+
+#endif // CLI_HPP_
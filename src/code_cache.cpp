@@ -0,0 +1,111 @@
+#include "code_cache.hpp"
+#include "cli.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace Sim {
+
+constexpr char CodeCacheHeader::kMagic[8];
+
+CodeCache::CodeCache(const Byte *map, size_t size)
+    : map_(map),
+    size_(size),
+    header_(reinterpret_cast<const CodeCacheHeader*>(map)),
+    blocks_(reinterpret_cast<const CachedBlock*>(map + sizeof(CodeCacheHeader))),
+    ops_(reinterpret_cast<const CachedOp*>(map + sizeof(CodeCacheHeader)
+                                           + header_->block_count * sizeof(CachedBlock)))
+{}
+
+CodeCache::~CodeCache() {
+    munmap(const_cast<Byte*>(map_), size_);
+}
+
+std::unique_ptr<const CodeCache> CodeCache::open(const std::filesystem::path &path, uint64_t program,
+                                                 Address base, uint64_t decoder) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CodeCacheHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    const auto *header = static_cast<const CodeCacheHeader*>(map);
+    const uint64_t expected = sizeof(CodeCacheHeader)
+        + static_cast<uint64_t>(header->block_count) * sizeof(CachedBlock)
+        + static_cast<uint64_t>(header->op_count) * sizeof(CachedOp);
+    if (std::memcmp(header->magic, CodeCacheHeader::kMagic, sizeof(header->magic)) != 0
+        || header->version != CodeCacheHeader::kVersion || header->program != program
+        || header->base != base || header->decoder != decoder || expected != size) {
+        munmap(map, size);
+        return nullptr;
+    }
+
+    std::unique_ptr<const CodeCache> cache(new CodeCache(static_cast<const Byte*>(map), size));
+    // Op ranges are checked once here; the ops themselves when CPU
+    // builds the blocks.
+    Address previous = 0;
+    for (const CachedBlock &block : *cache) {
+        if ((&block != cache->begin() && block.start <= previous) || block.op_count == 0
+            || block.first_op > header->op_count || block.op_count > header->op_count - block.first_op) {
+            return nullptr;
+        }
+        previous = block.start;
+    }
+    return cache;
+}
+
+bool CodeCache::write(const std::filesystem::path &path, const CodeCacheHeader &header,
+                      const std::vector<CachedBlock> &blocks, const std::vector<CachedOp> &ops) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    const std::filesystem::path partial = path.string() + "." + std::to_string(getpid());
+    std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(blocks.data()),
+              static_cast<std::streamsize>(blocks.size() * sizeof(CachedBlock)));
+    out.write(reinterpret_cast<const char*>(ops.data()),
+              static_cast<std::streamsize>(ops.size() * sizeof(CachedOp)));
+    out.close();
+    if (!out) {
+        std::filesystem::remove(partial, ec);
+        std::cerr << "code cache: cannot write file: " << path << "\n";
+        return false;
+    }
+    std::filesystem::rename(partial, path, ec);
+    if (ec) {
+        std::filesystem::remove(partial, ec);
+        std::cerr << "code cache: cannot write file: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+std::filesystem::path code_cache_path(const std::filesystem::path &dir, uint64_t program, Address base) {
+    char name[40];
+    std::snprintf(name, sizeof(name), "%016llx-%08x.code", static_cast<unsigned long long>(program), base);
+    return dir / name;
+}
+
+std::filesystem::path default_code_cache_dir() {
+    return user_cache_dir("TOY_CODE_CACHE", "code");
+}
+
+} // namespace Sim
@@ -0,0 +1,105 @@
+#ifndef CODE_CACHE_HPP_
+#define CODE_CACHE_HPP_
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+namespace Sim {
+
+// On-disk decoded blocks of one program, so a later run of the same
+// binary maps them in instead of decoding and fusing again.
+//
+//   0      CodeCacheHeader
+//   ...    CachedBlock entries, ascending by start
+//   ...    CachedOp records; each block's ops are contiguous
+//
+// Handlers are host code addresses and are not stored: an op keeps its
+// kind and, at the head of a superinstruction, the index of the fusion
+// rule, and CPU turns those back into handlers. JIT output is not
+// stored either. Fields are in host byte order.
+struct CodeCacheHeader {
+    static constexpr char kMagic[8] = {'T', 'O', 'Y', 'C', 'O', 'D', 'E', '\0'};
+    static constexpr uint32_t kVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t base;          // load address of the program
+    uint64_t program;       // program_hash of its bytes
+    uint64_t decoder;       // CPU::decoder_fingerprint() of the writer
+    uint32_t block_count;
+    uint32_t op_count;
+};
+
+struct CachedBlock {
+    Address start;
+    uint32_t first_op;
+    uint32_t op_count;
+};
+
+struct CachedOp {
+    Instruction raw;
+    Register imm;
+    Address target;
+    uint8_t kind;
+    uint8_t rd;
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t width;          // as DecodedOp::width
+    uint8_t rule;           // fusion rule when width > 1
+    uint8_t pad[2];
+};
+
+// A cache file mapped read-only. The mapping outlives the file, so a
+// run may replace the file while another one is still reading it.
+class CodeCache {
+private:
+    const Byte *map_;
+    size_t size_;
+    const CodeCacheHeader *header_;
+    const CachedBlock *blocks_;
+    const CachedOp *ops_;
+
+    CodeCache(const Byte *map, size_t size);
+
+public:
+    ~CodeCache();
+
+    CodeCache(const CodeCache &) = delete;
+    CodeCache &operator=(const CodeCache &) = delete;
+
+    // nullptr if there is no file or it was written for another
+    // program, base or decoder; a stale cache is simply rebuilt.
+    static std::unique_ptr<const CodeCache> open(const std::filesystem::path &path, uint64_t program,
+                                                 Address base, uint64_t decoder);
+
+    // Written under a private name and renamed into place.
+    static bool write(const std::filesystem::path &path, const CodeCacheHeader &header,
+                      const std::vector<CachedBlock> &blocks, const std::vector<CachedOp> &ops);
+
+    const CachedOp *ops(const CachedBlock &block) const {
+        return ops_ + block.first_op;
+    }
+
+    const CachedBlock *begin() const {
+        return blocks_;
+    }
+
+    const CachedBlock *end() const {
+        return blocks_ + header_->block_count;
+    }
+};
+
+// <dir>/<program hash>-<base>.code
+std::filesystem::path code_cache_path(const std::filesystem::path &dir, uint64_t program, Address base);
+
+// $TOY_CODE_CACHE, else toy_cpu/code under $XDG_CACHE_HOME or ~/.cache.
+std::filesystem::path default_code_cache_dir();
+
+} // namespace Sim
+
+#endif // CODE_CACHE_HPP_
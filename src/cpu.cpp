@@ -1,142 +1,438 @@
 #include "cpu.hpp"
 #include "instructions.hpp"
-
+#include "isa.hpp"
+#include "machine.hpp"
+#include "profiler.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <cstring>
 #include <fstream>
 #include <filesystem>
+#include <mutex>
+#include <type_traits>
 
 namespace Sim {
 
 void CPU::reset() {
     memory_.clear();
+    blocks_.clear();
     std::memset(regs_, 0, sizeof(regs_));
     pc_ = 0;
     halted_ = false;
-    std::cerr << "CPU reset complete successfully.\n\n";
+    retired_ = 0;
+    fault_ = Fault::none;
+    fault_pc_ = 0;
+    code_cache_.reset();
+    code_cache_path_.clear();
+    aot_.reset();
+    devices_.reset();
+    yielded_ = false;
 }
 
 bool CPU::load_program(const std::filesystem::path &path, Address base) {
-    std::ifstream instr_file(path, std::ios::binary);
-    if (!instr_file) {
-        std::cerr << "CPU: Error in load program - cannot open file: " << path << "\n";
+    std::shared_ptr<const ProgramImage> image = ProgramImage::open(path);
+    return image != nullptr && load_program(*image, base);
+}
+
+bool CPU::load_program(const ProgramImage &image, Address base) {
+    // The image is not written through write(), so a tracked baseline
+    // would miss it.
+    if (memory_.tracking()) {
+        memory_.untrack();
+    }
+    if (!image.load_into(memory_, base)) {
         return false;
     }
 
-    instr_file.seekg(0, std::ios::end);
-    std::streamsize file_size = instr_file.tellg();
-    instr_file.seekg(0, std::ios::beg);
-    if (file_size <= 0) {
-        std::cerr << "CPU: Error in load programm - wrong file size (" << file_size << ").\n";
+    blocks_.clear();
+    aot_.reset();
+    memory_.clear_flags(kPageCode);
+    preload_code_cache();
+    return true;
+}
+
+bool CPU::load_buffer(const void *data, size_t size, Address base) {
+    if (size > GuestMemory::kSpaceBytes - base) {
+        *diag_ << "CPU: Error in load program - image does not fit at 0x" << std::hex << base << std::dec << "\n";
         return false;
     }
+    if (memory_.tracking()) {
+        memory_.untrack();
+    }
+    std::memcpy(memory_.data() + base, data, size);
 
-    memory_.resize(base + static_cast<size_t>(file_size));
-    instr_file.read(reinterpret_cast<char*>(&memory_[base]), file_size);
+    blocks_.clear();
+    aot_.reset();
+    memory_.clear_flags(kPageCode);
+    preload_code_cache();
     return true;
 }
 
-void CPU::run() {
-    while (!halted_) {
-        step();
+bool CPU::read_memory(Address addr, void *data, size_t size) const {
+    if (size > GuestMemory::kSpaceBytes - addr) {
+        return false;
     }
+    std::memcpy(data, memory_.data() + addr, size);
+    return true;
 }
 
-void CPU::step() {
-    Instruction instr = read(pc_);
-    Address next_pc = pc_ + kInstructionBytes;
+bool CPU::write_memory(Address addr, const void *data, size_t size) {
+    if (size > GuestMemory::kSpaceBytes - addr) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    const uint8_t flags = begin_store(addr, size);
+    std::memcpy(memory_.data() + addr, data, size);
+    end_store(addr, size, flags);
+    return true;
+}
 
-    DecodedInstr decoded = decode_opcode(instr);
+uint8_t CPU::begin_store(Address addr, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    uint8_t flags = 0;
+    const uint64_t last = (static_cast<uint64_t>(addr) + size - 1) >> GuestMemory::kPageShift;
+    for (uint64_t page = addr >> GuestMemory::kPageShift; page <= last; ++page) {
+        const Address at = std::max(addr, static_cast<Address>(page << GuestMemory::kPageShift));
+        const uint8_t page_flags = memory_.flags_of_word(at);
+        if ((page_flags & kPageTracked) != 0) {
+            memory_.save_original(at);
+        }
+        flags |= page_flags;
+    }
+    return flags;
+}
 
-    switch (decoded) {
-        case DecodedInstr::j:
-            exec_j(instr, next_pc);
-            break;
-        case DecodedInstr::syscall:
-            exec_syscall(instr, next_pc);
-            break;
-        case DecodedInstr::stp:
-            exec_stp(instr, next_pc);
-            break;
-        case DecodedInstr::rori:
-            exec_rori(instr, next_pc);
-            break;
-        case DecodedInstr::slti:
-            exec_slti(instr, next_pc);
-            break;
-        case DecodedInstr::st:
-            exec_st(instr, next_pc);
-            break;
-        case DecodedInstr::bdep:
-            exec_bdep(instr, next_pc);
-            break;
-        case DecodedInstr::cls:
-            exec_cls(instr, next_pc);
-            break;
-        case DecodedInstr::add:
-            exec_add(instr, next_pc);
-            break;
-        case DecodedInstr::bne:
-            exec_bne(instr, next_pc);
-            break;
-        case DecodedInstr::beq:
-            exec_beq(instr, next_pc);
-            break;
-        case DecodedInstr::ld:
-            exec_ld(instr, next_pc);
+void CPU::end_store(Address addr, size_t size, uint8_t flags) {
+    if ((flags & kPageMmio) != 0 && devices_ != nullptr) {
+        devices_->refresh(addr, size);
+    }
+    if ((flags & kPageCode) != 0) {
+        blocks_.invalidate(addr, size);
+        if (aot_ != nullptr) {
+            aot_->invalidate(addr, size);
+        }
+        if (machine_ != nullptr) {
+            machine_->code_stored();
+        }
+    }
+}
+
+Snapshot CPU::snapshot() {
+    static std::atomic<uint64_t> next_epoch{1};
+
+    memory_.track();
+    snapshot_epoch_ = next_epoch.fetch_add(1, std::memory_order_relaxed);
+
+    Snapshot s;
+    s.pc = pc_;
+    s.halted = halted_;
+    s.retired = retired_;
+    std::memcpy(s.regs, regs_, sizeof(regs_));
+    s.epoch = snapshot_epoch_;
+    return s;
+}
+
+bool CPU::restore(const Snapshot &s) {
+    if (s.epoch == 0 || s.epoch != snapshot_epoch_ || !memory_.tracking()) {
+        *diag_ << "CPU: Error in restore - snapshot is not the current one of this CPU\n";
+        return false;
+    }
+
+    for (uint32_t page : memory_.rewind()) {
+        const Address addr = static_cast<Address>(static_cast<uint64_t>(page) << GuestMemory::kPageShift);
+        if ((memory_.flags_of_word(addr) & kPageCode) != 0) {
+            blocks_.invalidate(addr, GuestMemory::kPageSize);
+            if (aot_ != nullptr) {
+                aot_->invalidate(addr, GuestMemory::kPageSize);
+            }
+        }
+    }
+
+    pc_ = s.pc;
+    halted_ = s.halted;
+    retired_ = s.retired;
+    fault_ = Fault::none;
+    std::memcpy(regs_, s.regs, sizeof(regs_));
+    return true;
+}
+
+bool CPU::save_snapshot(const std::filesystem::path &path) const {
+    Snapshot s;
+    s.pc = pc_;
+    s.halted = halted_;
+    s.retired = retired_;
+    std::memcpy(s.regs, regs_, sizeof(regs_));
+    return write_snapshot_file(path, s, memory_);
+}
+
+bool CPU::load_snapshot(const std::filesystem::path &path) {
+    reset();
+
+    Snapshot s;
+    if (!read_snapshot_file(path, s, memory_)) {
+        reset();
+        return false;
+    }
+    pc_ = s.pc;
+    halted_ = s.halted;
+    retired_ = s.retired;
+    std::memcpy(regs_, s.regs, sizeof(regs_));
+    return true;
+}
+
+void CPU::run() {
+    run_until(UINT64_MAX);
+}
+
+void CPU::run_for(uint64_t budget) {
+    run_until(budget > UINT64_MAX - retired_ ? UINT64_MAX : retired_ + budget);
+}
+
+// With devices, the engine runs up to the next device deadline at most,
+// so polling them costs nothing per instruction or block.
+void CPU::run_until(uint64_t end) {
+    if (devices_ == nullptr) {
+        run_engine(end);
+    } else {
+        do {
+            run_engine(std::min(end, devices_->deadline()));
+            poll_devices();
+        } while (!halted_ && retired_ < end);
+    }
+    output_.flush();
+}
+
+void CPU::run_engine(uint64_t end) {
+    if (aot_ != nullptr) {
+        run_aot(end);
+        return;
+    }
+    switch (engine_) {
+        case Engine::block:
+            run_blocks(end);
             break;
-        case DecodedInstr::and_:
-            exec_and(instr, next_pc);
+        case Engine::threaded:
+            run_threaded(end);
             break;
-        case DecodedInstr::ssat:
-            exec_ssat(instr, next_pc);
-            break;
-        case DecodedInstr::unknown:
-            std::cerr << "Unknown decoded opcode at pc 0x" << std::hex << pc_ << std::dec << ", CPU halted.\n";
-            halted_ = true;
+        case Engine::jit:
+            run_jit(end);
             break;
     }
+}
+
+void CPU::run_blocks(uint64_t end) {
+    while (!halted_ && retired_ < end) {
+        BasicBlock &block = block_at(pc_);
+        if (block.ops.size() <= end - retired_) {
+            exec_block(block);
+        } else {
+            step();
+        }
+    }
+}
+
+template <class Instrumentation>
+void CPU::run(Instrumentation &inst) {
+    while (!halted_) {
+        exec_block(block_at(pc_), inst);
+        // Devices act at block boundaries here, not exactly at deadlines.
+        if (devices_ != nullptr) {
+            poll_devices();
+        }
+    }
+    output_.flush();
+}
+
+void CPU::step() {
+    NullInstrumentation none;
+    step(none);
+}
+
+template <class Instrumentation>
+void CPU::step(Instrumentation &inst) {
+    DecodedOp op = decode_at(pc_);
+    Address next_pc = op.next;
+
+    observe_memory(op, inst);
+    (this->*op.handler)(op, next_pc);
 
     pc_ = next_pc;
+    ++retired_;
+    inst.on_retire(op, next_pc);
 }
 
-Instruction CPU::read(Address addr) {
-    if (addr > memory_.size() - kInstructionBytes) {
-        std::cerr << "Error in read: out-of-range read at 0x" << std::hex << addr << std::dec << "\n";
-        return 0;
+template <class Instrumentation>
+void CPU::observe_memory(const DecodedOp &op, Instrumentation &inst) const {
+    if constexpr (Instrumentation::kEnabled) {
+        // Only accesses the handler is about to make; the misaligned
+        // ones it rejects are not reported.
+        const Address addr = regs_[op.rs] + op.imm;
+        switch (op.kind) {
+            case DecodedInstr::ld:
+                if ((op.imm & 0x3u) == 0) {
+                    inst.on_load(op, addr);
+                }
+                break;
+            case DecodedInstr::st:
+                if ((op.imm & 0x3u) == 0) {
+                    inst.on_store(op, addr);
+                }
+                break;
+            case DecodedInstr::stp:
+                if ((addr & 0x3u) == 0) {
+                    inst.on_store(op, addr);
+                    inst.on_store(op, addr + kInstructionBytes);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+BasicBlock &CPU::block_at(Address pc) {
+    BasicBlock *cached = blocks_.lookup(pc);
+    if (cached != nullptr) {
+        return *cached;
+    }
+    if (!code_cache_path_.empty()) {
+        ++code_cache_misses_;
+    }
+    return blocks_.insert(decode_block(pc));
+}
+
+std::unique_ptr<BasicBlock> CPU::decode_block(Address pc) {
+    auto block = std::make_unique<BasicBlock>();
+    block->start = pc;
+    block->threaded = false;
+    block->heat = 0;
+
+    Address addr = pc;
+    while (block->ops.size() < BlockCache::kMaxBlockOps) {
+        DecodedOp op = decode_at(addr);
+        block->ops.push_back(op);
+        addr += kInstructionBytes;
+
+        if (ends_block(op.kind)) {
+            break;
+        }
     }
+    block->end = addr;
+    memory_.set_flags(pc, block->ops.size() * kInstructionBytes, kPageCode);
+    fuse(*block);
+    return block;
+}
 
-    Instruction word = 0;
-    std::memcpy(&word, memory_.data() + addr, kInstructionBytes);
+template <class Instrumentation>
+void CPU::exec_block(const BasicBlock &block, Instrumentation &inst) {
+    const uint64_t generation = blocks_.generation();
+    inst.on_block(block);
+
+    if constexpr (std::is_same_v<Instrumentation, NullInstrumentation>) {
+        // Uninstrumented: one dispatch per superinstruction.
+        const DecodedOp *op = block.ops.data();
+        const DecodedOp *end = op + block.ops.size();
+        while (op != end) {
+            Address next_pc = op[op->width - 1].next;
+            (this->*op->fused)(*op, next_pc);
+            pc_ = next_pc;
+            retired_ += op->width;
+            op += op->width;
+
+            if (halted_ || generation != blocks_.generation()) {
+                return;
+            }
+        }
+        return;
+    }
 
-    return static_cast<Instruction>(word);
+    for (const DecodedOp &op : block.ops) {
+        Address next_pc = op.next;
+        observe_memory(op, inst);
+        (this->*op.handler)(op, next_pc);
+        pc_ = next_pc;
+        ++retired_;
+        inst.on_retire(op, next_pc);
+
+        // A store may have rewritten this very block.
+        if (halted_ || generation != blocks_.generation()) {
+            return;
+        }
+    }
 }
 
+template void CPU::run(CountingInstrumentation &);
+template void CPU::step(CountingInstrumentation &);
+template void CPU::run(TraceInstrumentation &);
+template void CPU::run(StackProfiler &);
+template void CPU::run(TimingModel &);
+
+Instruction CPU::read(Address addr) {
+    return static_cast<Instruction>(memory_.load32(addr));
+}
 
 void CPU::write(Address addr, uint32_t value) {
-    size_t need = static_cast<size_t>(addr) + kInstructionBytes;
-    if (need > memory_.size()) {
-        memory_.resize(need, 0);
+    const uint8_t flags = memory_.flags_of_word(addr);
+    if ((flags & kPageMmio) != 0) {
+        device_write(addr, value);
+        return;
     }
-    Instruction word = value;
+    if ((flags & kPageTracked) != 0) {
+        memory_.save_original(addr);
+    }
+
+    memory_.store32(addr, value);
 
-    std::memcpy(memory_.data() + addr, &word, kInstructionBytes);
+    if ((flags & kPageCode) != 0) {
+        blocks_.invalidate(addr, kInstructionBytes);
+        if (aot_ != nullptr) {
+            aot_->invalidate(addr, kInstructionBytes);
+        }
+        if (machine_ != nullptr) {
+            machine_->code_stored();
+        }
+    }
 }
 
 
-Opcode CPU::opcode_of(Instruction instr) {
-    return (static_cast<Opcode>((instr >> 26) & 0x0000'003F));
+void CPU::device_write(Address addr, Register value) {
+    if (devices_ == nullptr) {
+        return;
+    }
+    DeviceHost host{*this, output_, in_, retired_};
+    if (devices_->write(host, addr, value)) {
+        // Every engine stops right after a halting instruction.
+        yielded_ = true;
+        halted_ = true;
+    }
 }
 
-Opcode CPU::func_of(Instruction instr) {
-    return (static_cast<Opcode>(instr & 0x0000'003F));
+void CPU::poll_devices() {
+    if (yielded_) {
+        yielded_ = false;
+        halted_ = false;
+    }
+    DeviceHost host{*this, output_, in_, retired_};
+    devices_->poll(host);
 }
 
-Register_idx CPU::sign_extend(Register_idx v) {
-    if (v & 0x0000'8000) {
-        return static_cast<Register_idx>(v | 0xFFFF'0000);
+bool CPU::attach_device(std::unique_ptr<Device> device, Address base) {
+    if (devices_ == nullptr) {
+        devices_ = std::make_unique<DeviceBus>();
+    }
+    if (device == nullptr || !devices_->attach(std::move(device), memory_.data() + base, base)) {
+        return false;
     }
-    return static_cast<Register_idx>(v & 0x0000'FFFF);
+    memory_.set_flags(base, GuestMemory::kPageSize, kPageMmio);
+    return true;
 }
 
 Register_idx CPU::rot_r(Register_idx v, Register n) {
@@ -184,55 +480,276 @@ Register_idx CPU::cls_emulate(Register_idx x) {
     return static_cast<Register_idx>(count);
 }
 
-DecodedInstr CPU::decode_opcode(Instruction instr) {
-    Opcode op = opcode_of(instr);
-    InstrOpcodes upper_bits = static_cast<InstrOpcodes>(op);
-    if (upper_bits != InstrOpcodes::syscall) {
-        switch (upper_bits) {
-            case InstrOpcodes::j:
-                return DecodedInstr::j;
-            case InstrOpcodes::stp:
-                return DecodedInstr::stp;
-            case InstrOpcodes::rori:
-                return DecodedInstr::rori;
-            case InstrOpcodes::slti:
-                return DecodedInstr::slti;
-            case InstrOpcodes::st:
-                return DecodedInstr::st;
-            case InstrOpcodes::bne:
-                return DecodedInstr::bne;
-            case InstrOpcodes::beq:
-                return DecodedInstr::beq;
-            case InstrOpcodes::ld:
-                return DecodedInstr::ld;
-            case InstrOpcodes::ssat:
-                return DecodedInstr::ssat;
-            default:
-                std::cerr << "Unknown primary opcode: 0x" << std::hex << int(op) << " at pc 0x" << pc_ << std::dec << "\n";
-                halted_ = true;
-                return DecodedInstr::unknown;
-        }
-    }
-
-    Opcode func = func_of(instr);
-    switch (static_cast<SubEncoding>(func)) {
-        case SubEncoding::add:
-            return DecodedInstr::add;
-        case SubEncoding::and_:
-            return DecodedInstr::and_;
-        case SubEncoding::bdep:
-            return DecodedInstr::bdep;
-        case SubEncoding::cls:
-            return DecodedInstr::cls;
-        case SubEncoding::syscall:
-            return DecodedInstr::syscall;
-        default:
-            std::cerr << "Unknown subencoding: 0x" << std::hex << int(func) << " at pc 0x" << pc_ << std::dec << "\n";
-            halted_ = true;
-            return DecodedInstr::unknown;
+const OpHandler CPU::kHandlers[kInstrKinds] = {
+    &CPU::exec_j, &CPU::exec_syscall, &CPU::exec_stp, &CPU::exec_rori, &CPU::exec_slti,
+    &CPU::exec_st, &CPU::exec_bdep, &CPU::exec_cls, &CPU::exec_add, &CPU::exec_bne,
+    &CPU::exec_beq, &CPU::exec_ld, &CPU::exec_and, &CPU::exec_ssat, &CPU::exec_unknown,
+};
+
+DecodedOp CPU::decode(Address pc, Instruction instr) {
+    DecodedOp op{};
+    op.pc = pc;
+    op.next = pc + kInstructionBytes;
+    op.target = op.next;
+    op.raw = instr;
+    op.kind = decode_kind(instr);
+    op.handler = kHandlers[static_cast<size_t>(op.kind)];
+    op.fused = op.handler;
+    op.width = 1;
+    kFieldExtractors[static_cast<size_t>(describe(op.kind).format)](instr, op);
+    return op;
+}
+
+DecodedOp CPU::decode_at(Address pc) {
+    return decode(pc, read(pc));
+}
+
+//------------------ jit engine -----------------------
+void CPU::run_jit(uint64_t end) {
+    if (!jit_) {
+        jit_ = std::make_unique<Jit>();
+    }
+    if (!jit_->ready()) {
+        run_blocks(end);
+        return;
+    }
+
+    // Translated code only checks the limit between blocks, so stop it
+    // a whole block early and interpret the rest.
+    JitContext ctx{};
+    ctx.regs = regs_;
+    ctx.mem = memory_.data();
+    ctx.limit = end == UINT64_MAX ? UINT64_MAX : end - std::min<uint64_t>(end, BlockCache::kMaxBlockOps);
+    ctx.cpu = this;
+
+    while (!halted_ && retired_ < end) {
+        if (retired_ >= ctx.limit) {
+            BasicBlock &block = block_at(pc_);
+            if (block.ops.size() <= end - retired_) {
+                exec_block(block);
+            } else {
+                step();
+            }
+            continue;
+        }
+
+        jit_->sync(blocks_.generation());
+
+        const uint8_t *entry = jit_->lookup(pc_);
+        if (entry == nullptr) {
+            BasicBlock &block = block_at(pc_);
+            if (++block.heat < Jit::kHotThreshold || !jit_->translate(block)) {
+                exec_block(block);
+                continue;
+            }
+            entry = jit_->lookup(pc_);
+        }
+
+        ctx.retired = retired_;
+        jit_->enter(ctx, entry);
+        retired_ = ctx.retired;
+        pc_ = ctx.pc;
+    }
+}
+
+//------------------ aot ------------------------------
+bool CPU::use_aot(const std::filesystem::path &path) {
+    std::unique_ptr<AotModule> module = AotModule::open(path, memory_);
+    if (module == nullptr) {
+        return false;
+    }
+    // So stores to translated code reach write() and disable it.
+    for (size_t index = 0; index < module->size(); ++index) {
+        memory_.set_flags(module->block_start(index), module->block_end(index) - module->block_start(index),
+                          kPageCode);
+    }
+    aot_ = std::move(module);
+    return true;
+}
+
+int CPU::aot_store(void *cpu, Address addr, Register value) {
+    CPU &self = *static_cast<CPU *>(cpu);
+    const bool code = (self.memory_.flags_of_word(addr) & kPageCode) != 0;
+    self.write(addr, value);
+    return code || self.halted_ ? 1 : 0;
+}
+
+void CPU::run_aot(uint64_t end) {
+    AotContext ctx{};
+    ctx.regs = regs_;
+    ctx.mem = memory_.data();
+    ctx.flags = memory_.data() - GuestMemory::kFlagsBytes;
+    ctx.disabled = aot_->disabled();
+    ctx.cpu = this;
+    ctx.store = &CPU::aot_store;
+    ctx.budget = end;
+
+    while (!halted_ && retired_ < end) {
+        ctx.retired = retired_;
+        ctx.pc = pc_;
+        ctx.stop = 0;
+        aot_->run(ctx);
+        retired_ = ctx.retired;
+        pc_ = ctx.pc;
+        if (halted_ || retired_ >= end) {
+            break;
+        }
+
+        // Native code stops at whatever it cannot run: a pc it has no
+        // block for, a disabled block, a syscall, a fault or the end of
+        // the budget. One interpreted block gets past it.
+        BasicBlock &block = block_at(pc_);
+        if (block.ops.size() <= end - retired_) {
+            exec_block(block);
+        } else {
+            step();
+        }
     }
 }
 
+//------------------ threaded engine ------------------
+// Every handler ends with its own indirect jump to the next op, so the
+// host predictor sees one branch per guest opcode instead of a single
+// shared dispatch branch. Only ld/st/stp/syscall/unknown can halt or
+// invalidate code, so only they check for it.
+void CPU::run_threaded(uint64_t end_at) {
+#if defined(__GNUC__)
+    static const void *const kDispatch[] = {
+        &&op_j, &&op_syscall, &&op_stp, &&op_rori, &&op_slti, &&op_st, &&op_bdep,
+        &&op_cls, &&op_add, &&op_bne, &&op_beq, &&op_ld, &&op_and, &&op_ssat,
+        &&op_unknown
+    };
+    static_assert(sizeof(kDispatch) / sizeof(kDispatch[0]) == static_cast<size_t>(DecodedInstr::unknown) + 1,
+                  "kDispatch must follow the order of DecodedInstr");
+
+    const DecodedOp *begin = nullptr;
+    const DecodedOp *end = nullptr;
+    const DecodedOp *op = nullptr;
+    uint64_t generation = 0;
+    Address next_pc = 0;
+
+#define TOY_NEXT()                  \
+    do {                            \
+        if (++op == end) {          \
+            goto block_exit;        \
+        }                           \
+        goto *op->dispatch;         \
+    } while (0)
+
+#define TOY_LEAVE()                                             \
+    do {                                                        \
+        pc_ = next_pc;                                          \
+        retired_ += static_cast<uint64_t>(op - begin) + 1;      \
+        goto enter;                                             \
+    } while (0)
+
+#define TOY_CHECKED_NEXT()                                      \
+    do {                                                        \
+        if (halted_ || generation != blocks_.generation()) {    \
+            next_pc = op->next;                                 \
+            TOY_LEAVE();                                        \
+        }                                                       \
+        TOY_NEXT();                                             \
+    } while (0)
+
+enter:
+    if (halted_ || retired_ >= end_at) {
+        return;
+    }
+    {
+        BasicBlock &block = block_at(pc_);
+        if (block.ops.size() > end_at - retired_) {
+            step();
+            goto enter;
+        }
+        if (!block.threaded) {
+            for (DecodedOp &entry : block.ops) {
+                entry.dispatch = entry.width > 1 ? &&op_fused : kDispatch[static_cast<size_t>(entry.kind)];
+            }
+            block.threaded = true;
+        }
+        begin = block.ops.data();
+        end = begin + block.ops.size();
+        op = begin;
+        generation = blocks_.generation();
+    }
+    goto *op->dispatch;
+
+block_exit:
+    pc_ = (end - 1)->next;
+    retired_ += static_cast<uint64_t>(end - begin);
+    goto enter;
+
+op_j:
+    next_pc = op->target;
+    TOY_LEAVE();
+op_beq:
+    next_pc = (regs_[op->rs] == regs_[op->rt]) ? op->target : op->next;
+    TOY_LEAVE();
+op_bne:
+    next_pc = (regs_[op->rs] != regs_[op->rt]) ? op->target : op->next;
+    TOY_LEAVE();
+op_syscall:
+    next_pc = op->next;
+    exec_syscall(*op, next_pc);
+    TOY_LEAVE();
+op_unknown:
+    next_pc = op->next;
+    (this->*op->handler)(*op, next_pc);
+    TOY_LEAVE();
+op_fused:
+    {
+        // Only the last op of the run can branch, halt or store.
+        const DecodedOp *first = op;
+        op += first->width - 1;
+        next_pc = op->next;
+        (this->*first->fused)(*first, next_pc);
+        if (next_pc != op->next) {
+            TOY_LEAVE();
+        }
+        TOY_CHECKED_NEXT();
+    }
+op_stp:
+    exec_stp(*op, next_pc);
+    TOY_CHECKED_NEXT();
+op_st:
+    exec_st(*op, next_pc);
+    TOY_CHECKED_NEXT();
+op_ld:
+    exec_ld(*op, next_pc);
+    TOY_CHECKED_NEXT();
+op_rori:
+    exec_rori(*op, next_pc);
+    TOY_NEXT();
+op_slti:
+    exec_slti(*op, next_pc);
+    TOY_NEXT();
+op_bdep:
+    exec_bdep(*op, next_pc);
+    TOY_NEXT();
+op_cls:
+    exec_cls(*op, next_pc);
+    TOY_NEXT();
+op_add:
+    exec_add(*op, next_pc);
+    TOY_NEXT();
+op_and:
+    exec_and(*op, next_pc);
+    TOY_NEXT();
+op_ssat:
+    exec_ssat(*op, next_pc);
+    TOY_NEXT();
+
+#undef TOY_CHECKED_NEXT
+#undef TOY_LEAVE
+#undef TOY_NEXT
+#else
+    // No labels-as-values on this compiler: the block engine is the
+    // closest portable equivalent.
+    run_blocks(end_at);
+#endif
+}
+
 //---------------------- dump -------------------------
 void CPU::dump_regs() const {
     std::ios::fmtflags f = std::cout.flags();
@@ -248,257 +765,507 @@ void CPU::dump_regs() const {
 }
 
 //------------------ instructions ---------------------
-void CPU::exec_j(Instruction instr, Address &next_pc) {
-    Instruction instr_index = instr & 0x03FF'FFFF;
-    next_pc = static_cast<Address>((pc_ & 0xF000'0000) | (instr_index << 2));
+void CPU::exec_j(const DecodedOp &op, Address &next_pc) {
+    next_pc = op.target;
 }
 
-void CPU::exec_syscall(Instruction instr, Address &next_pc) {
-    const Register syscall_num = static_cast<Register>((instr >> 6) & 0x0003'FFFF);
-
-    switch (syscall_num) {
-        case 0:
+void CPU::exec_syscall(const DecodedOp &op, Address &next_pc) {
+    // The memory syscalls stop at the end of the address space.
+    const Register range = static_cast<Register>(
+        std::min<uint64_t>(regs_[2], GuestMemory::kSpaceBytes - regs_[1]));
+    switch (static_cast<Syscall>(op.imm)) {
+        case Syscall::halt:
             halted_ = true;
             break;
-        case 1:
-            std::cout << regs_[0] << "\n";
+        case Syscall::print:
+            output_.word(regs_[0]);
+            break;
+        case Syscall::hart_id:
+            regs_[0] = hart_id_;
+            break;
+        case Syscall::spawn:
+            regs_[0] = machine_ != nullptr ? machine_->spawn(*this, regs_[1]) : kNoHart;
+            break;
+        case Syscall::barrier:
+            if (machine_ != nullptr) {
+                output_.flush();
+                machine_->barrier();
+                // Code other harts stored before the barrier may be
+                // decoded here still.
+                const uint64_t stores = machine_->code_stores();
+                if (stores != code_stores_seen_) {
+                    code_stores_seen_ = stores;
+                    blocks_.clear();
+                }
+            }
+            break;
+        case Syscall::write:
+            output_.write(memory_.data() + regs_[1], range);
+            regs_[0] = range;
+            break;
+        case Syscall::read:
+            regs_[0] = read_input(regs_[1], range);
+            break;
+        case Syscall::print_words: {
+            const Register count = static_cast<Register>(
+                std::min<uint64_t>(regs_[2], (GuestMemory::kSpaceBytes - regs_[1]) / sizeof(Register)));
+            output_.words(memory_.data() + regs_[1], count);
+            regs_[0] = count;
             break;
+        }
+        // One range check and one (vectorized) libc call per syscall,
+        // where a guest loop pays both per word.
+        case Syscall::memcpy: {
+            const Register size = static_cast<Register>(
+                std::min<uint64_t>(range, GuestMemory::kSpaceBytes - regs_[3]));
+            const uint8_t flags = begin_store(regs_[1], size);
+            std::memmove(memory_.data() + regs_[1], memory_.data() + regs_[3], size);
+            end_store(regs_[1], size, flags);
+            regs_[0] = size;
+            break;
+        }
+        case Syscall::memset: {
+            const uint8_t flags = begin_store(regs_[1], range);
+            std::memset(memory_.data() + regs_[1], static_cast<Byte>(regs_[3]), range);
+            end_store(regs_[1], range, flags);
+            regs_[0] = range;
+            break;
+        }
+        case Syscall::memcmp: {
+            const Register size = static_cast<Register>(
+                std::min<uint64_t>(range, GuestMemory::kSpaceBytes - regs_[3]));
+            const int order = std::memcmp(memory_.data() + regs_[1], memory_.data() + regs_[3], size);
+            regs_[0] = order == 0 ? 0 : order > 0 ? 1 : 0xFFFFFFFF;
+            break;
+        }
         default:
-            std::cerr << "syscall: unhandled code " << syscall_num << "\n";
-            halted_ = true;
+            *diag_ << "syscall: unhandled code " << op.imm << "\n";
+            fault(Fault::unknown_syscall, op.pc);
             break;
     }
 }
 
+Register CPU::read_input(Address addr, Register size) {
+    if (in_ == nullptr || size == 0) {
+        return 0;
+    }
+    // A prompt printed before the wait should be seen.
+    output_.flush();
+    std::unique_lock<std::mutex> lock;
+    if (machine_ != nullptr) {
+        lock = std::unique_lock<std::mutex>(machine_->input_mutex_);
+    }
 
-void CPU::exec_stp(Instruction instr, Address &next_pc) {
-    Register_idx base = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt1 = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Register_idx rt2 = static_cast<Register_idx>((instr >> 11) & 0x0000'001F);
-    Address offset = static_cast<Address>(instr & 0x0000'07FF);
-
-    if (base >= kNumberOfRegisters
-        || rt1 >= kNumberOfRegisters
-        || rt2 >= kNumberOfRegisters) {
-    std::cerr << "exec_stp: bad register index, halting.\n";
-    halted_ = true;
-    return;
+    // Through a bounce buffer, so stores to code and tracked pages are
+    // handled as for any other store.
+    constexpr size_t kChunk = 64 * 1024;
+    std::unique_ptr<char[]> chunk = std::make_unique<char[]>(std::min<size_t>(size, kChunk));
+    Register done = 0;
+    while (done < size) {
+        const size_t want = std::min<size_t>(size - done, kChunk);
+        in_->read(chunk.get(), static_cast<std::streamsize>(want));
+        const size_t got = static_cast<size_t>(in_->gcount());
+        write_memory(addr + done, chunk.get(), got);
+        done += static_cast<Register>(got);
+        if (got < want) {
+            break;
+        }
     }
-    Address addr = regs_[base] + offset;
+    return done;
+}
+
+
+void CPU::exec_stp(const DecodedOp &op, Address &next_pc) {
+    Address addr = regs_[op.rs] + op.imm;
 
     if ((addr & 0x0000'0003) != 0) {
-        std::cerr << "exec_stp:  lowest 2 bits of offset must be zero: 0x" << std::hex << offset << std::dec << ", halting.\n";
-        halted_ = true;
+        *diag_ << "exec_stp:  lowest 2 bits of offset must be zero: 0x" << std::hex << op.imm << std::dec << ", halting.\n";
+        fault(Fault::misaligned_access, op.pc);
         return;
     }
 
-    write(addr, regs_[rt1]);
-    write(addr + kInstructionBytes, regs_[rt2]);
+    write(addr, regs_[op.rt]);
+    write(addr + kInstructionBytes, regs_[op.rd]);
 }
 
-void CPU::exec_rori(Instruction instr, Address &next_pc) {
-    Register_idx rd = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rs = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    uint32_t imm5 = (instr >> 11) & 0x0000'001F;
+void CPU::exec_rori(const DecodedOp &op, Address &next_pc) {
+    regs_[op.rd] = rot_r(regs_[op.rs], op.imm);
+}
 
-    if (rd >= kNumberOfRegisters
-        || rs >= kNumberOfRegisters) {
-        std::cerr << "exec_rori: bad register index, halting.\n";
-        halted_ = true;
+void CPU::exec_slti(const DecodedOp &op, Address &next_pc) {
+    regs_[op.rt] = (static_cast<int32_t>(regs_[op.rs]) < static_cast<int32_t>(op.imm)) ? 0x0000'0001 : 0x0000'0000;
+}
+
+void CPU::exec_st(const DecodedOp &op, Address &next_pc) {
+    if ((op.imm & 0x3u) != 0x0000'0000) {
+        *diag_ << "exec_st: lowest 2 bits of offset must be zero: 0x" << std::hex << op.imm << std::dec << ", halting.\n";
+        fault(Fault::misaligned_access, op.pc);
         return;
     }
 
-    regs_[rd] = rot_r(regs_[rs], imm5);
-}
+    Address addr = regs_[op.rs] + op.imm;
 
-void CPU::exec_slti(Instruction instr, Address &next_pc) {
-    Register_idx rs = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
+    write(addr, regs_[op.rt]);
+}
 
-    if (rs >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters) {
-        std::cerr << "exec_slti: bad register index, halting.\n";
-        halted_ = true;
-        return;
-    }
+void CPU::exec_bdep(const DecodedOp &op, Address &next_pc) {
+    regs_[op.rd] = pdep_emulate(regs_[op.rs], regs_[op.rt]);
+}
 
-    int32_t imm = sign_extend(instr & 0x0000'FFFF);
+void CPU::exec_cls(const DecodedOp &op, Address &next_pc) {
+    regs_[op.rd] = cls_emulate(regs_[op.rs]);
+}
 
-    regs_[rt] = (static_cast<int32_t>(regs_[rs]) < imm) ? 0x0000'0001 : 0x0000'0000;
+void CPU::exec_add(const DecodedOp &op, Address &next_pc) {
+    regs_[op.rd] = regs_[op.rs] + regs_[op.rt];
 }
 
-void CPU::exec_st(Instruction instr, Address &next_pc) {
-    Register_idx base = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Address offset = static_cast<Address>(instr & 0x0000'FFFF);
+void CPU::exec_bne(const DecodedOp &op, Address &next_pc) {
+    if (regs_[op.rs] != regs_[op.rt]) {
+        next_pc = op.target;
+    }
+}
 
-    if (base >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters) {
-        std::cerr << "exec_st: bad register index, halting.\n";
-        halted_ = true;
-        return;
+void CPU::exec_beq(const DecodedOp &op, Address &next_pc) {
+    if (regs_[op.rs] == regs_[op.rt]) {
+        next_pc = op.target;
     }
+}
 
-    if ((offset & 0x3u) != 0x0000'0000) {
-        std::cerr << "exec_st: lowest 2 bits of offset must be zero: 0x" << std::hex << offset << std::dec << ", halting.\n";
-        halted_ = true;
+void CPU::exec_ld(const DecodedOp &op, Address &next_pc) {
+    if ((op.imm & 0x0000'0003) != 0x0000'0000) {
+        *diag_ << "exec_ld: lowest 2 bits of offset must be zero: 0x" << std::hex << op.imm << std::dec << ", halting.\n";
+        fault(Fault::misaligned_access, op.pc);
         return;
     }
 
-    Address addr = regs_[base] + offset;
-
-    write(addr, regs_[rt]);
+    Address addr = regs_[op.rs] + op.imm;
+    regs_[op.rt] = read(addr);
 }
 
-void CPU::exec_bdep(Instruction instr, Address &next_pc) {
-    Register_idx rd = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rs1 = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Register_idx rs2 = static_cast<Register_idx>((instr >> 11) & 0x0000'001F);
+void CPU::exec_and(const DecodedOp &op, Address &next_pc) {
+    regs_[op.rd] = regs_[op.rs] & regs_[op.rt];
+}
 
-    if (rd >= kNumberOfRegisters
-        || rs1 >= kNumberOfRegisters
-        || rs2 >= kNumberOfRegisters) {
-        std::cerr << "exec_bdep: bad register index, halting.\n";
-        halted_ = true;
+void CPU::exec_ssat(const DecodedOp &op, Address &next_pc) {
+    const Register_idx N = op.imm & 0x1Fu;
+    if (N == 0) {
+        regs_[op.rd] = regs_[op.rs];
         return;
     }
 
-    regs_[rd] = pdep_emulate(regs_[rs1], regs_[rs2]);
-}
+    const int64_t minv = -(1LL << (N - 1));
+    const int64_t maxv = (1LL << (N - 1)) - 1;
 
-void CPU::exec_cls(Instruction instr, Address &next_pc) {
-    Register_idx rd = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rs = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
+    int64_t val = static_cast<int64_t>(static_cast<int32_t>(regs_[op.rs]));
 
-    if (rd >= kNumberOfRegisters
-        || rs >= kNumberOfRegisters) {
-        std::cerr << "exec_cls: bad register index, halting.\n";
-        halted_ = true;
-        return;
-    }
+    if (val < minv) val = minv;
+    if (val > maxv) val = maxv;
 
-    regs_[rd] = cls_emulate(regs_[rs]);
+    regs_[op.rd] = static_cast<Register_idx>(static_cast<int32_t>(val));
 }
 
-void CPU::exec_add(Instruction instr, Address &next_pc) {
-    Register_idx rs = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Register_idx rd = static_cast<Register_idx>((instr >> 11) & 0x0000'001F);
-
-    if (rs >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters
-        || rd >= kNumberOfRegisters) {
-        std::cerr << "exec_add: bad register index, halting.\n";
-        halted_ = true;
-        return;
+void CPU::exec_unknown(const DecodedOp &op, Address &next_pc) {
+    const uint32_t opcode = opcode_of(op.raw);
+    if (opcode != kSpecialOpcode) {
+        *diag_ << "Unknown primary opcode: 0x" << std::hex << opcode << " at pc 0x" << op.pc << std::dec << "\n";
+    } else {
+        *diag_ << "Unknown subencoding: 0x" << std::hex << funct_of(op.raw) << " at pc 0x" << op.pc << std::dec << "\n";
     }
+    *diag_ << "Unknown decoded opcode at pc 0x" << std::hex << op.pc << std::dec << ", CPU halted.\n";
+    fault(Fault::unknown_instruction, op.pc);
+}
 
-    regs_[rd] = regs_[rs] + regs_[rt];
+//------------------ superinstructions -----------------
+// Superinstructions: a run of adjacent ops in a block executed by one
+// handler, so the block and threaded engines dispatch once per run.
+// Every op but the last must be unable to halt, branch or write memory,
+// which keeps faults, self-modifying stores and the pc at a halt
+// exactly where the unfused ops would put them: the only op that can
+// stop the run is its last one.
+template <OpHandler First, OpHandler... Rest>
+void CPU::exec_fused(const DecodedOp &op, Address &next_pc) {
+    if constexpr (sizeof...(Rest) == 0) {
+        (this->*First)(op, next_pc);
+    } else {
+        Address fall_through = op.next;
+        (this->*First)(op, fall_through);
+        exec_fused<Rest...>((&op)[1], next_pc);
+    }
 }
 
-void CPU::exec_bne(Instruction instr, Address &next_pc) {
-    Register_idx rs = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
+struct CPU::FusionRule {
+    DecodedInstr kinds[3];
+    uint8_t width;
+    OpHandler handler;
+};
 
-    if (rs >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters) {
-        std::cerr << "exec_bne: bad register index, halting.\n";
-        halted_ = true;
-        return;
+namespace {
+
+// True if op may run before another op of the same superinstruction.
+bool fusible_prefix(const DecodedOp &op) {
+    if ((describe(op.kind).effects & (kEffectControl | kEffectStore)) != 0) {
+        return false;
     }
+    // A load with a misaligned offset halts.
+    return op.kind != DecodedInstr::ld || (op.imm & 0x3u) == 0;
+}
 
-    Instruction imm16 = instr & 0x0000'FFFF;
-    Address offset = sign_extend(imm16) << 2;
+} // namespace
+
+// Rules, longest first, from the pair counts of --profile over fib.asm,
+// the toy_bench kernels and the batch test programs. The leading pairs
+// were add+add, add+bne, ld+add, add+st, slti+add, slti+st and
+// slti+beq; runs of three adds are fib's loop body.
+using K = DecodedInstr;
+const CPU::FusionRule CPU::kFusionRules[] = {
+    {{K::add, K::add, K::add}, 3, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_add, &CPU::exec_add>},
+    {{K::add, K::add, K::bne}, 3, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_add, &CPU::exec_bne>},
+    {{K::ld, K::add, K::st}, 3, &CPU::exec_fused<&CPU::exec_ld, &CPU::exec_add, &CPU::exec_st>},
+    {{K::add, K::add}, 2, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_add>},
+    {{K::add, K::bne}, 2, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_bne>},
+    {{K::add, K::beq}, 2, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_beq>},
+    {{K::add, K::and_}, 2, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_and>},
+    {{K::and_, K::add}, 2, &CPU::exec_fused<&CPU::exec_and, &CPU::exec_add>},
+    {{K::and_, K::bne}, 2, &CPU::exec_fused<&CPU::exec_and, &CPU::exec_bne>},
+    {{K::slti, K::beq}, 2, &CPU::exec_fused<&CPU::exec_slti, &CPU::exec_beq>},
+    {{K::slti, K::bne}, 2, &CPU::exec_fused<&CPU::exec_slti, &CPU::exec_bne>},
+    {{K::slti, K::add}, 2, &CPU::exec_fused<&CPU::exec_slti, &CPU::exec_add>},
+    {{K::slti, K::st}, 2, &CPU::exec_fused<&CPU::exec_slti, &CPU::exec_st>},
+    {{K::ld, K::add}, 2, &CPU::exec_fused<&CPU::exec_ld, &CPU::exec_add>},
+    {{K::ld, K::st}, 2, &CPU::exec_fused<&CPU::exec_ld, &CPU::exec_st>},
+    {{K::add, K::st}, 2, &CPU::exec_fused<&CPU::exec_add, &CPU::exec_st>},
+};
+
+const size_t CPU::kFusionRuleCount = sizeof(kFusionRules) / sizeof(kFusionRules[0]);
+
+void CPU::fuse(BasicBlock &block) {
+    std::vector<DecodedOp> &ops = block.ops;
+    size_t i = 0;
+    while (i < ops.size()) {
+        const FusionRule *match = nullptr;
+        for (const FusionRule &rule : kFusionRules) {
+            if (i + rule.width > ops.size()) {
+                continue;
+            }
+            bool fits = true;
+            for (size_t k = 0; k < rule.width && fits; ++k) {
+                fits = ops[i + k].kind == rule.kinds[k]
+                    && (k + 1 == rule.width || fusible_prefix(ops[i + k]));
+            }
+            if (fits) {
+                match = &rule;
+                break;
+            }
+        }
 
-    if (regs_[rs] != regs_[rt]) {
-        next_pc = pc_ + offset;
+        if (match == nullptr) {
+            ++i;
+            continue;
+        }
+        ops[i].fused = match->handler;
+        ops[i].width = match->width;
+        for (size_t k = 1; k < match->width; ++k) {
+            ops[i + k].width = 0;
+        }
+        i += match->width;
     }
 }
 
-void CPU::exec_beq(Instruction instr, Address &next_pc) {
-    Register_idx rs = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
+//------------------ code cache -----------------------
+namespace {
 
-    if (rs >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters) {
-        std::cerr << "exec_beq: bad register index, halting.\n";
-        halted_ = true;
-        return;
-    }
+// Bump when decode() or the field extractors change what an op holds.
+constexpr uint64_t kDecoderVersion = 1;
 
-    Instruction imm16 = instr & 0x0000'FFFF;
-    Address offset = static_cast<Address>(sign_extend(imm16)) << 2;
+void mix(uint64_t &hash, uint64_t value) {
+    hash = (hash ^ value) * 0x100000001b3ull;
+}
 
-    if (regs_[rs] == regs_[rt]) {
-        next_pc = pc_ + offset;
+} // namespace
+
+uint64_t CPU::decoder_fingerprint() {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    mix(hash, kDecoderVersion);
+    mix(hash, BlockCache::kMaxBlockOps);
+    for (const InstrDesc &desc : kIsa) {
+        mix(hash, static_cast<uint64_t>(desc.kind));
+        mix(hash, desc.opcode);
+        mix(hash, static_cast<uint64_t>(desc.funct));
+        mix(hash, static_cast<uint64_t>(desc.format));
+        mix(hash, desc.effects);
     }
+    for (const FusionRule &rule : kFusionRules) {
+        mix(hash, rule.width);
+        for (size_t k = 0; k < rule.width; ++k) {
+            mix(hash, static_cast<uint64_t>(rule.kinds[k]));
+        }
+    }
+    return hash;
 }
 
-void CPU::exec_ld(Instruction instr, Address &next_pc) {
-    Register_idx base = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Address offset = static_cast<Address>(instr & 0x0000'FFFF);
+void CPU::use_code_cache(const std::filesystem::path &dir, Address base, size_t size) {
+    code_cache_program_ = program_hash(memory_.data() + base, size);
+    code_cache_base_ = base;
+    code_cache_path_ = code_cache_path(dir, code_cache_program_, base);
+    code_cache_ = CodeCache::open(code_cache_path_, code_cache_program_, base, decoder_fingerprint());
+    code_cache_misses_ = 0;
+    preload_code_cache();
+}
 
-    if (base >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters) {
-        std::cerr << "exec_ld: bad register index, halting.\n";
-        halted_ = true;
+void CPU::preload_code_cache() {
+    if (code_cache_ == nullptr) {
         return;
     }
-
-    if ((offset & 0x0000'0003) != 0x0000'0000) {
-        std::cerr << "exec_ld: lowest 2 bits of offset must be zero: 0x" << std::hex << offset << std::dec << ", halting.\n";
-        halted_ = true;
-        return;
+    for (const CachedBlock &entry : *code_cache_) {
+        std::unique_ptr<BasicBlock> block = cached_block(entry);
+        if (block != nullptr) {
+            blocks_.insert(std::move(block));
+        }
     }
-
-    Address addr = regs_[base] + offset;
-    regs_[rt] = read(addr);
 }
 
-void CPU::exec_and(Instruction instr, Address &next_pc) {
-    Register_idx rs = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rt = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Register_idx rd = static_cast<Register_idx>((instr >> 11) & 0x0000'001F);
-
-    if (rs >= kNumberOfRegisters
-        || rt >= kNumberOfRegisters
-        || rd >= kNumberOfRegisters) {
-        std::cerr << "exec_and: bad register index, halting.\n";
-        halted_ = true;
-        return;
+std::unique_ptr<BasicBlock> CPU::cached_block(const CachedBlock &entry) {
+    const Address pc = entry.start;
+    const CachedOp *cached = code_cache_->ops(entry);
+    const size_t count = entry.op_count;
+    if (count > BlockCache::kMaxBlockOps
+        || static_cast<uint64_t>(pc) + count * kInstructionBytes > GuestMemory::kSpaceBytes) {
+        return nullptr;
     }
 
-    regs_[rd] = regs_[rs] & regs_[rt];
-}
-
-void CPU::exec_ssat(Instruction instr, Address &next_pc) {
-    Register_idx rd = static_cast<Register_idx>((instr >> 21) & 0x0000'001F);
-    Register_idx rs = static_cast<Register_idx>((instr >> 16) & 0x0000'001F);
-    Register_idx imm5 = static_cast<Register_idx>((instr >> 11) & 0x0000'001F);
+    // The words may have changed since the file was written: by a store
+    // of an earlier run of this CPU, an image loaded on top, or a
+    // rebuilt program that happens to hash the same. Any difference
+    // and the block is decoded afresh.
+    for (size_t i = 0; i < count; ++i) {
+        if (read(pc + static_cast<Address>(i * kInstructionBytes)) != cached[i].raw) {
+            return nullptr;
+        }
+    }
 
-    if (rd >= kNumberOfRegisters
-        || rs >= kNumberOfRegisters) {
-        std::cerr << "exec_ssat: bad register index\n";
-        halted_ = true;
-        return;
+    auto block = std::make_unique<BasicBlock>();
+    block->start = pc;
+    block->end = pc + static_cast<Address>(count * kInstructionBytes);
+    block->threaded = false;
+    block->heat = 0;
+    block->ops.resize(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        const CachedOp &in = cached[i];
+        if (in.kind >= kInstrKinds || in.rd >= kNumberOfRegisters || in.rs >= kNumberOfRegisters
+            || in.rt >= kNumberOfRegisters) {
+            return nullptr;
+        }
+        DecodedOp &op = block->ops[i];
+        op.pc = pc + static_cast<Address>(i * kInstructionBytes);
+        op.next = op.pc + kInstructionBytes;
+        op.target = in.target;
+        op.raw = in.raw;
+        op.kind = static_cast<DecodedInstr>(in.kind);
+        op.rd = in.rd;
+        op.rs = in.rs;
+        op.rt = in.rt;
+        op.imm = in.imm;
+        op.handler = kHandlers[in.kind];
+        op.fused = op.handler;
+        op.width = in.width;
     }
 
-    const Register_idx N = imm5 & 0x1Fu;
-    if (N == 0) {
-        regs_[rd] = regs_[rs];
-        return;
+    // Superinstructions must tile the block with rules that match their
+    // ops, or exec_block would run the wrong handlers or walk off the end.
+    for (size_t i = 0; i < count; i += cached[i].width) {
+        const size_t width = cached[i].width;
+        if (width == 0 || width > count - i) {
+            return nullptr;
+        }
+        if (width == 1) {
+            continue;
+        }
+        if (cached[i].rule >= kFusionRuleCount || kFusionRules[cached[i].rule].width != width) {
+            return nullptr;
+        }
+        const FusionRule &rule = kFusionRules[cached[i].rule];
+        for (size_t k = 0; k < width; ++k) {
+            if (block->ops[i + k].kind != rule.kinds[k] || (k > 0 && cached[i + k].width != 0)) {
+                return nullptr;
+            }
+        }
+        block->ops[i].fused = rule.handler;
     }
 
-    const int64_t minv = -(1LL << (N - 1));
-    const int64_t maxv = (1LL << (N - 1)) - 1;
+    memory_.set_flags(pc, count * kInstructionBytes, kPageCode);
+    return block;
+}
 
-    int64_t val = static_cast<int64_t>(static_cast<int32_t>(regs_[rs]));
+bool CPU::save_code_cache() {
+    if (code_cache_path_.empty() || code_cache_misses_ == 0) {
+        return true;
+    }
 
-    if (val < minv) val = minv;
-    if (val > maxv) val = maxv;
+    // Blocks decoded in this run, plus the saved ones it did not reach.
+    std::vector<const BasicBlock*> live;
+    blocks_.for_each([&live](const BasicBlock &block) { live.push_back(&block); });
+    std::sort(live.begin(), live.end(),
+              [](const BasicBlock *a, const BasicBlock *b) { return a->start < b->start; });
+
+    std::vector<CachedBlock> blocks;
+    std::vector<CachedOp> ops;
+    auto add_live = [&](const BasicBlock &block) {
+        blocks.push_back({block.start, static_cast<uint32_t>(ops.size()), static_cast<uint32_t>(block.ops.size())});
+        for (const DecodedOp &op : block.ops) {
+            CachedOp out{};
+            out.raw = op.raw;
+            out.imm = op.imm;
+            out.target = op.target;
+            out.kind = static_cast<uint8_t>(op.kind);
+            out.rd = static_cast<uint8_t>(op.rd);
+            out.rs = static_cast<uint8_t>(op.rs);
+            out.rt = static_cast<uint8_t>(op.rt);
+            out.width = op.width;
+            for (size_t r = 0; op.width > 1 && r < kFusionRuleCount; ++r) {
+                if (kFusionRules[r].handler == op.fused) {
+                    out.rule = static_cast<uint8_t>(r);
+                    break;
+                }
+            }
+            ops.push_back(out);
+        }
+    };
+    auto add_saved = [&](const CachedBlock &block) {
+        const CachedOp *saved = code_cache_->ops(block);
+        blocks.push_back({block.start, static_cast<uint32_t>(ops.size()), block.op_count});
+        ops.insert(ops.end(), saved, saved + block.op_count);
+    };
+
+    const CachedBlock *saved = code_cache_ != nullptr ? code_cache_->begin() : nullptr;
+    const CachedBlock *saved_end = code_cache_ != nullptr ? code_cache_->end() : nullptr;
+    for (const BasicBlock *block : live) {
+        for (; saved != saved_end && saved->start < block->start; ++saved) {
+            add_saved(*saved);
+        }
+        if (saved != saved_end && saved->start == block->start) {
+            ++saved;
+        }
+        add_live(*block);
+    }
+    for (; saved != saved_end; ++saved) {
+        add_saved(*saved);
+    }
 
-    regs_[rd] = static_cast<Register_idx>(static_cast<int32_t>(val));
+    CodeCacheHeader header{};
+    std::memcpy(header.magic, CodeCacheHeader::kMagic, sizeof(header.magic));
+    header.version = CodeCacheHeader::kVersion;
+    header.base = code_cache_base_;
+    header.program = code_cache_program_;
+    header.decoder = decoder_fingerprint();
+    header.block_count = static_cast<uint32_t>(blocks.size());
+    header.op_count = static_cast<uint32_t>(ops.size());
+    if (!CodeCache::write(code_cache_path_, header, blocks, ops)) {
+        return false;
+    }
+    code_cache_misses_ = 0;
+    return true;
 }
 
-} // namespace Sim
\ No newline at end of file
+} // namespace Sim
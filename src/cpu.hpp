@@ -2,60 +2,321 @@
 #define CPU_HPP_
 
 #include "config.hpp"
+#include "aot.hpp"
 #include "instructions.hpp"
+#include "block_cache.hpp"
+#include "code_cache.hpp"
+#include "devices.hpp"
+#include "guest_memory.hpp"
+#include "guest_output.hpp"
+#include "jit.hpp"
+#include "program_image.hpp"
+#include "snapshot.hpp"
+#include "instrumentation.hpp"
 
+#include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
 namespace Sim {
 
+enum class Engine {
+    block,      // predecoded blocks, one indirect call per instruction
+    threaded,   // predecoded blocks, direct-threaded dispatch
+    jit         // hot blocks translated to x86-64
+};
+
+// Why a CPU halted, other than through the halt syscall.
+enum class Fault : uint8_t {
+    none,
+    misaligned_access,      // ld/st offset or stp address not word aligned
+    unknown_instruction,
+    unknown_syscall
+};
+
+// Syscall numbers, the immediate of the syscall instruction. Results
+// go to x0. The hart syscalls do what they say on a Machine; a lone CPU
+// is hart 0 of one, where spawn fails and barrier returns at once.
+enum class Syscall : uint32_t {
+    halt = 0,
+    print = 1,      // prints x0
+    hart_id = 2,    // x0 = this hart's id, 0 for the first
+    spawn = 3,      // starts a hart at x1 with a copy of the registers and
+                    // x0 = 0; x0 = its id, or kNoHart if none is left
+    barrier = 4,    // waits until every running hart is in a barrier
+    write = 5,      // writes x2 bytes at x1 to output; x0 = bytes written
+    read = 6,       // reads up to x2 bytes of input to x1; x0 = bytes read,
+                    // fewer only at the end of input
+    print_words = 7,// prints the x2 words at x1 as print does; x0 = words
+    memcpy = 8,     // copies x2 bytes from x3 to x1, overlap allowed; x0 = bytes copied
+    memset = 9,     // fills x2 bytes at x1 with the low byte of x3; x0 = bytes filled
+    memcmp = 10     // compares x2 bytes at x1 and x3; x0 = 0 if equal, else 1 or
+                    // 0xFFFFFFFF as the first differing byte at x1 is above or below
+};
+
+constexpr Register kNoHart = 0xFFFFFFFF;
+
+class Machine;
+
 class CPU {
 private:
-    std::vector<Byte> memory_;
+    // A CPU's own unless it is a hart of a Machine (see machine.hpp).
+    std::shared_ptr<GuestMemory> shared_memory_;
+    GuestMemory &memory_;
     Register regs_[kNumberOfRegisters];
     Address pc_;
     bool halted_;
+    uint64_t retired_;
+    Fault fault_ = Fault::none;
+    Address fault_pc_ = 0;
+
+    BlockCache blocks_;
+    Engine engine_ = Engine::block;
+    std::unique_ptr<Jit> jit_;
+    std::unique_ptr<AotModule> aot_;
+    std::unique_ptr<DeviceBus> devices_;
+    bool yielded_ = false;      // halted_ only until the devices are polled
+    GuestOutput output_{std::cout};
+    std::istream *in_ = nullptr;
+    std::ostream *diag_ = &std::cerr;
+    uint64_t snapshot_epoch_ = 0;
+
+    // See use_code_cache().
+    std::unique_ptr<const CodeCache> code_cache_;
+    std::filesystem::path code_cache_path_;
+    uint64_t code_cache_program_ = 0;
+    Address code_cache_base_ = 0;
+    uint64_t code_cache_misses_ = 0;
+
+    Machine *machine_ = nullptr;
+    Register hart_id_ = 0;
+    uint64_t code_stores_seen_ = 0;     // Machine::code_stores() at the last barrier
+
+    // Indexed by DecodedInstr.
+    static const OpHandler kHandlers[];
+    struct FusionRule;
+    static const FusionRule kFusionRules[];
+    static const size_t kFusionRuleCount;
 
     Instruction read(Address pc_);
-    Opcode opcode_of(Instruction instr);
-    Opcode func_of(Instruction instr);
-    DecodedInstr decode_opcode(Instruction instr);
+    DecodedOp decode(Address pc, Instruction instr);
+    DecodedOp decode_at(Address pc);
+
+    BasicBlock &block_at(Address pc);
+    std::unique_ptr<BasicBlock> decode_block(Address pc);
+    std::unique_ptr<BasicBlock> cached_block(const CachedBlock &entry);
+    void preload_code_cache();
+    void fuse(BasicBlock &block);
+    // Changes whenever decoded blocks would come out differently.
+    static uint64_t decoder_fingerprint();
+    template <class Instrumentation>
+    void exec_block(const BasicBlock &block, Instrumentation &inst);
+    template <class Instrumentation>
+    void observe_memory(const DecodedOp &op, Instrumentation &inst) const;
+
+    void exec_block(const BasicBlock &block) {
+        NullInstrumentation none;
+        exec_block(block, none);
+    }
+    // end is the retired count at which to stop; blocks that would
+    // cross it are stepped instead.
+    void run_until(uint64_t end);
+    void run_engine(uint64_t end);
+    void run_blocks(uint64_t end = UINT64_MAX);
+    void run_threaded(uint64_t end = UINT64_MAX);
+    void run_jit(uint64_t end = UINT64_MAX);
+    void run_aot(uint64_t end = UINT64_MAX);
+    // AotContext::store.
+    static int aot_store(void *cpu, Address addr, Register value);
+    // A store to a device page.
+    void device_write(Address addr, Register value);
+    // Resumes a CPU a device write stopped and lets every device act.
+    void poll_devices();
+    void fault(Fault kind, Address pc) {
+        halted_ = true;
+        fault_ = kind;
+        fault_pc_ = pc;
+    }
 
-    Register_idx sign_extend(Register_idx v);
     Register_idx rot_r(Register_idx v, Register n);
     Register_idx pdep_emulate(Register_idx src, uint32_t mask);
     Register_idx cls_emulate(Register_idx x);
 
-    void exec_j(Instruction instr, Address &next_pc);
-    void exec_syscall(Instruction instr, Address &next_pc);
-    void exec_stp(Instruction instr, Address &next_pc);
-    void exec_rori(Instruction instr, Address &next_pc);
-    void exec_slti(Instruction instr, Address &next_pc);
-    void exec_st(Instruction instr, Address &next_pc);
-    void exec_bdep(Instruction instr, Address &next_pc);
-    void exec_cls(Instruction instr, Address &next_pc);
-    void exec_add(Instruction instr, Address &next_pc);
-    void exec_bne(Instruction instr, Address &next_pc);
-    void exec_beq(Instruction instr, Address &next_pc);
-    void exec_ld(Instruction instr, Address &next_pc);
-    void exec_and(Instruction instr, Address &next_pc);
-    void exec_ssat(Instruction instr, Address &next_pc);
+    void exec_j(const DecodedOp &op, Address &next_pc);
+    void exec_syscall(const DecodedOp &op, Address &next_pc);
+    // The read syscall: returns the bytes read into memory at addr.
+    Register read_input(Address addr, Register size);
+    // Around a host-side store to [addr, addr + size), which must not
+    // wrap: begin_store() saves tracked pages and returns the flags of
+    // the pages, end_store() drops the decoded code the store hit.
+    uint8_t begin_store(Address addr, size_t size);
+    void end_store(Address addr, size_t size, uint8_t flags);
+    void exec_stp(const DecodedOp &op, Address &next_pc);
+    void exec_rori(const DecodedOp &op, Address &next_pc);
+    void exec_slti(const DecodedOp &op, Address &next_pc);
+    void exec_st(const DecodedOp &op, Address &next_pc);
+    void exec_bdep(const DecodedOp &op, Address &next_pc);
+    void exec_cls(const DecodedOp &op, Address &next_pc);
+    void exec_add(const DecodedOp &op, Address &next_pc);
+    void exec_bne(const DecodedOp &op, Address &next_pc);
+    void exec_beq(const DecodedOp &op, Address &next_pc);
+    void exec_ld(const DecodedOp &op, Address &next_pc);
+    void exec_and(const DecodedOp &op, Address &next_pc);
+    void exec_ssat(const DecodedOp &op, Address &next_pc);
+    void exec_unknown(const DecodedOp &op, Address &next_pc);
+    template <OpHandler First, OpHandler... Rest>
+    void exec_fused(const DecodedOp &op, Address &next_pc);
+
+    friend class Jit;
+    friend class Machine;
+    template <size_t Lanes> friend class Lockstep;
 
 public:
-    CPU() {};
+    CPU()
+        : CPU(std::make_shared<GuestMemory>())
+    {}
+
+    // A CPU that shares memory with others.
+    explicit CPU(std::shared_ptr<GuestMemory> memory)
+        : shared_memory_(std::move(memory)),
+        memory_(*shared_memory_)
+    {}
+
     ~CPU() = default;
 
+    CPU(const CPU &) = delete;
+    CPU &operator=(const CPU &) = delete;
+
     void reset();
     bool load_program(const std::filesystem::path &path, Address base = 0);
+    bool load_program(const ProgramImage &image, Address base = 0);
     void write(Address addr, Register value);
     void run();
+    // Runs until halted or until budget more instructions have retired.
+    void run_for(uint64_t budget);
     void step();
 
+    // Loads size bytes from host memory, as load_program() does a file.
+    bool load_buffer(const void *data, size_t size, Address base = 0);
+    // Byte ranges of guest memory; false if the range wraps past the
+    // end of the address space. Writes go through snapshot tracking and
+    // drop any decoded code they overlap.
+    bool read_memory(Address addr, void *data, size_t size) const;
+    bool write_memory(Address addr, const void *data, size_t size);
+
+    // Keeps the decoded blocks of the program just loaded at [base,
+    // base + size) in a file under dir named by a hash of those bytes
+    // (see code_cache.hpp). Every block an earlier run saved there is
+    // built here, and again after an image is loaded on top, so the run
+    // starts without decoding; a block whose words no longer match memory
+    // is left out and decoded afresh if reached. save_code_cache() writes
+    // back what was decoded.
+    void use_code_cache(const std::filesystem::path &dir, Address base, size_t size);
+    // Only writes if some block had to be decoded; false if the file
+    // cannot be written.
+    bool save_code_cache();
+
+    // Runs the blocks an AOT module (see aot.hpp) translated from the
+    // program now in memory natively from then on, and the rest, and
+    // blocks stores have rewritten, in the block engine. Call after
+    // loading every image; loading another or reset() drops the module.
+    // False if path is not a module of this program. Not for the harts
+    // of a Machine.
+    bool use_aot(const std::filesystem::path &path);
+
+    // Maps device registers at the page at base (see devices.hpp); false
+    // if base is not page aligned or already has a device. Attach after
+    // loading every image: reset() detaches every device. Only this CPU
+    // reaches them, not other harts of a Machine, and their state is
+    // not part of snapshots.
+    bool attach_device(std::unique_ptr<Device> device, Address base);
+
+    // Runs or steps with instrumentation hooks (see instrumentation.hpp).
+    // Instrumented runs always use the block engine.
+    template <class Instrumentation>
+    void run(Instrumentation &inst);
+    template <class Instrumentation>
+    void step(Instrumentation &inst);
+
+    // Captures the registers and starts tracking guest memory writes.
+    // Only the most recent snapshot of a CPU can be restored; loading a
+    // program or image, or reset(), ends tracking.
+    Snapshot snapshot();
+    // Rewinds to s, copying back only pages written since the snapshot
+    // or the previous restore. False if s is not the current snapshot.
+    bool restore(const Snapshot &s);
+
+    // Whole-state files, readable by another process. Loading replaces
+    // everything, as after reset().
+    bool save_snapshot(const std::filesystem::path &path) const;
+    bool load_snapshot(const std::filesystem::path &path);
+
+    // Lets a halted CPU continue from its pc, e.g. a snapshot taken when
+    // the setup part of a program halted.
+    void resume() {
+        halted_ = false;
+        fault_ = Fault::none;
+    }
+
+    void set_engine(Engine engine) {
+        engine_ = engine;
+    }
+
+    Engine get_engine() const {
+        return engine_;
+    }
+
+    // Where the output syscalls write; std::cout unless redirected.
+    // Output is buffered and reaches out by the time run() or
+    // run_for() returns.
+    void set_output(std::ostream &out) {
+        output_.set_stream(out);
+    }
+
+    // Words printed as raw bytes rather than decimal lines.
+    void set_raw_output(bool raw) {
+        output_.set_raw(raw);
+    }
+
+    void flush_output() {
+        output_.flush();
+    }
+
+    // Where the read syscall reads from; without one it finds the end of
+    // input at once.
+    void set_input(std::istream &in) {
+        in_ = &in;
+    }
+
+    // Where fault messages go; std::cerr unless redirected.
+    void set_diagnostics(std::ostream &diag) {
+        diag_ = &diag;
+    }
+
+    // Fault::none unless the last halt was a fault; get_fault_pc() is
+    // the faulting instruction.
+    Fault get_fault() const {
+        return fault_;
+    }
+
+    Address get_fault_pc() const {
+        return fault_pc_;
+    }
+
+    uint64_t get_retired() const {
+        return retired_;
+    }
+
+    bool is_halted() const {
+        return halted_;
+    }
+
     void set_PC(const Address addr) {
         pc_ = addr;
     }
@@ -0,0 +1,285 @@
+#include "devices.hpp"
+#include "cpu.hpp"
+#include "guest_memory.hpp"
+#include "guest_output.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <iterator>
+
+namespace Sim {
+
+namespace {
+
+// Counts retired instructions. Writing DELAY arms it to expire that
+// many instructions later (0 disarms); each expiry adds one to COUNT
+// and, if PERIOD is not 0, re-arms it PERIOD instructions on.
+class Timer : public Device {
+private:
+    static constexpr uint32_t kDelay = 0x0;
+    static constexpr uint32_t kPeriod = 0x4;
+    static constexpr uint32_t kCount = 0x8;
+
+    Register delay_ = 0;
+    Register period_ = 0;
+    Register count_ = 0;
+    bool arm_ = false;
+    uint64_t deadline_ = kNever;
+
+public:
+    bool write(DeviceHost &, uint32_t offset, Register value) override {
+        switch (offset) {
+            case kDelay:
+                delay_ = value;
+                arm_ = true;
+                set(kDelay, value);
+                return true;
+            case kPeriod:
+                period_ = value;
+                set(kPeriod, value);
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    void poll(DeviceHost &host) override {
+        if (arm_) {
+            arm_ = false;
+            deadline_ = delay_ == 0 ? kNever : host.now + delay_;
+        }
+        while (host.now >= deadline_) {
+            set(kCount, ++count_);
+            deadline_ = period_ == 0 ? kNever : deadline_ + period_;
+        }
+    }
+
+    uint64_t deadline() const override {
+        return deadline_;
+    }
+
+    void refresh() override {
+        set(kDelay, delay_);
+        set(kPeriod, period_);
+        set(kCount, count_);
+    }
+};
+
+// A byte stream on the CPU's output and input. A store to DATA sends
+// its low byte. A store to NEXT takes the next input byte, waiting for
+// it: DATA then holds it and STATUS bit 0 is set, or at the end of
+// input STATUS bit 1 is set instead.
+class Uart : public Device {
+private:
+    static constexpr uint32_t kData = 0x0;
+    static constexpr uint32_t kStatus = 0x4;
+    static constexpr uint32_t kNext = 0x8;
+
+    static constexpr Register kReceived = 0x1;
+    static constexpr Register kEnded = 0x2;
+
+    Register data_ = 0;
+    Register status_ = 0;
+
+public:
+    bool write(DeviceHost &host, uint32_t offset, Register value) override {
+        if (offset == kData) {
+            const char byte = static_cast<char>(value);
+            host.output.write(&byte, 1);
+        } else if (offset == kNext) {
+            // A prompt written before the wait should be seen.
+            host.output.flush();
+            const int byte = host.input != nullptr ? host.input->get() : std::char_traits<char>::eof();
+            if (byte == std::char_traits<char>::eof()) {
+                data_ = 0;
+                status_ = kEnded;
+            } else {
+                data_ = static_cast<Register>(byte & 0xFF);
+                status_ = kReceived;
+            }
+            refresh();
+        }
+        return false;
+    }
+
+    void refresh() override {
+        set(kData, data_);
+        set(kStatus, status_);
+    }
+};
+
+// Copies from a host buffer into guest memory. Set DST (guest address),
+// SRC (offset in the buffer) and LEN (bytes), then store anything to
+// START. STATUS reads 1 while the transfer runs, which takes
+// kSetupInstructions plus one instruction per kBytesPerInstruction, then
+// 2 once the bytes are in memory, or 3 if the range was outside the
+// buffer or guest memory. SIZE is the size of the buffer.
+class Dma : public Device {
+private:
+    static constexpr uint32_t kDst = 0x00;
+    static constexpr uint32_t kSrc = 0x04;
+    static constexpr uint32_t kLen = 0x08;
+    static constexpr uint32_t kStart = 0x0C;
+    static constexpr uint32_t kStatus = 0x10;
+    static constexpr uint32_t kSize = 0x14;
+
+    static constexpr Register kIdle = 0;
+    static constexpr Register kBusy = 1;
+    static constexpr Register kDone = 2;
+    static constexpr Register kFailed = 3;
+
+    static constexpr uint64_t kSetupInstructions = 16;
+    static constexpr uint64_t kBytesPerInstruction = 16;
+
+    std::vector<Byte> buffer_;
+    Register dst_ = 0;
+    Register src_ = 0;
+    Register len_ = 0;
+    Register status_ = kIdle;
+    bool start_ = false;
+    uint64_t deadline_ = kNever;
+
+public:
+    explicit Dma(std::vector<Byte> buffer)
+        : buffer_(std::move(buffer))
+    {}
+
+    bool write(DeviceHost &, uint32_t offset, Register value) override {
+        if (status_ == kBusy) {
+            return false;
+        }
+        switch (offset) {
+            case kDst:
+                dst_ = value;
+                break;
+            case kSrc:
+                src_ = value;
+                break;
+            case kLen:
+                len_ = value;
+                break;
+            case kStart:
+                start_ = true;
+                return true;
+            default:
+                return false;
+        }
+        refresh();
+        return false;
+    }
+
+    void poll(DeviceHost &host) override {
+        if (start_) {
+            start_ = false;
+            if (src_ > buffer_.size() || len_ > buffer_.size() - src_) {
+                status_ = kFailed;
+            } else {
+                status_ = kBusy;
+                deadline_ = host.now + kSetupInstructions + len_ / kBytesPerInstruction;
+            }
+            refresh();
+        }
+        if (host.now >= deadline_) {
+            deadline_ = kNever;
+            status_ = host.cpu.write_memory(dst_, buffer_.data() + src_, len_) ? kDone : kFailed;
+            refresh();
+        }
+    }
+
+    uint64_t deadline() const override {
+        return deadline_;
+    }
+
+    void refresh() override {
+        set(kDst, dst_);
+        set(kSrc, src_);
+        set(kLen, len_);
+        set(kStatus, status_);
+        set(kSize, static_cast<Register>(std::min<size_t>(buffer_.size(), UINT32_MAX)));
+    }
+};
+
+} // namespace
+
+std::unique_ptr<Device> make_device(const std::string &name, const std::filesystem::path &file) {
+    if (name != "dma" && !file.empty()) {
+        std::cerr << "devices: " << name << " takes no file\n";
+        return nullptr;
+    }
+    if (name == "timer") {
+        return std::make_unique<Timer>();
+    }
+    if (name == "uart") {
+        return std::make_unique<Uart>();
+    }
+    if (name == "dma") {
+        std::ifstream in(file, std::ios::binary);
+        if (file.empty() || !in) {
+            std::cerr << "devices: dma needs a file to serve: " << file << "\n";
+            return nullptr;
+        }
+        std::vector<Byte> buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return std::make_unique<Dma>(std::move(buffer));
+    }
+    std::cerr << "devices: unknown device: " << name << ". Expected timer, uart or dma\n";
+    return nullptr;
+}
+
+bool DeviceBus::attach(std::unique_ptr<Device> device, Byte *page, Address base) {
+    if ((base & (GuestMemory::kPageSize - 1)) != 0) {
+        std::cerr << "devices: address 0x" << std::hex << base << std::dec << " is not page aligned\n";
+        return false;
+    }
+    if (at(base) != nullptr) {
+        std::cerr << "devices: two devices at 0x" << std::hex << base << std::dec << "\n";
+        return false;
+    }
+    device->map(page);
+    devices_.push_back(Mapping{base >> GuestMemory::kPageShift, std::move(device)});
+    return true;
+}
+
+Device *DeviceBus::at(Address addr) const {
+    for (const Mapping &mapping : devices_) {
+        if (mapping.page == addr >> GuestMemory::kPageShift) {
+            return mapping.device.get();
+        }
+    }
+    return nullptr;
+}
+
+bool DeviceBus::write(DeviceHost &host, Address addr, Register value) {
+    Device *device = (addr & 0x3u) == 0 ? at(addr) : nullptr;
+    if (device == nullptr) {
+        return false;
+    }
+    return device->write(host, addr & (GuestMemory::kPageSize - 1), value);
+}
+
+void DeviceBus::poll(DeviceHost &host) {
+    for (Mapping &mapping : devices_) {
+        mapping.device->poll(host);
+    }
+}
+
+uint64_t DeviceBus::deadline() const {
+    uint64_t deadline = Device::kNever;
+    for (const Mapping &mapping : devices_) {
+        deadline = std::min(deadline, mapping.device->deadline());
+    }
+    return deadline;
+}
+
+void DeviceBus::refresh(Address addr, size_t size) {
+    const uint64_t first = addr >> GuestMemory::kPageShift;
+    const uint64_t last = (static_cast<uint64_t>(addr) + size - 1) >> GuestMemory::kPageShift;
+    for (Mapping &mapping : devices_) {
+        if (mapping.page >= first && mapping.page <= last) {
+            mapping.device->refresh();
+        }
+    }
+}
+
+} // namespace Sim
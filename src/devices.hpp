@@ -0,0 +1,107 @@
+#ifndef DEVICES_HPP_
+#define DEVICES_HPP_
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Sim {
+
+class CPU;
+class GuestOutput;
+
+// What a device may touch outside its own registers.
+struct DeviceHost {
+    CPU &cpu;               // write_memory() for transfers into the guest
+    GuestOutput &output;
+    std::istream *input;    // nullptr for none
+    uint64_t now;           // retired instructions; exact in poll() only
+};
+
+// A memory-mapped device: a page of word registers in guest memory.
+// Loads read the page like any other memory, so they cost nothing
+// extra and a device keeps its readable registers stored there. Stores
+// to the page are not applied; the CPU hands them to write() instead,
+// as its pages carry kPageMmio and so take the store slow path anyway.
+//
+// There are no interrupts. A device that has to act later asks for a
+// poll at a retired count through deadline(), and CPU::run() stops the
+// engine there, at an instruction boundary, to call poll(). A device
+// whose write() returns true is polled right after that store's
+// instruction, which is where deadlines it sets start from.
+class Device {
+public:
+    static constexpr uint64_t kNever = UINT64_MAX;
+
+private:
+    Byte *page_ = nullptr;
+
+protected:
+    void set(uint32_t offset, Register value) {
+        std::memcpy(page_ + offset, &value, sizeof(value));
+    }
+
+public:
+    virtual ~Device() = default;
+
+    // Called by DeviceBus::attach(); stores the registers.
+    void map(Byte *page) {
+        page_ = page;
+        refresh();
+    }
+
+    // A guest store of value to the word-aligned register at offset.
+    virtual bool write(DeviceHost &host, uint32_t offset, Register value) = 0;
+    virtual void poll(DeviceHost &) {}
+    virtual uint64_t deadline() const {
+        return kNever;
+    }
+    // Stores every readable register into the page again.
+    virtual void refresh() = 0;
+};
+
+// timer, uart, or dma, which serves file; nullptr (and reports why)
+// for anything else or a file that cannot be read.
+std::unique_ptr<Device> make_device(const std::string &name, const std::filesystem::path &file);
+
+// The devices of one CPU, each on a page of its own.
+class DeviceBus {
+private:
+    struct Mapping {
+        uint32_t page;
+        std::unique_ptr<Device> device;
+    };
+
+    std::vector<Mapping> devices_;
+
+public:
+    bool empty() const {
+        return devices_.empty();
+    }
+
+    // base must be page aligned and not hold another device.
+    bool attach(std::unique_ptr<Device> device, Byte *page, Address base);
+
+    Device *at(Address addr) const;
+
+    // Routes a guest store; true if the store asks for a poll. Stores
+    // that are not word aligned, or that straddle a device page, are
+    // dropped.
+    bool write(DeviceHost &host, Address addr, Register value);
+    void poll(DeviceHost &host);
+    uint64_t deadline() const;
+    // After a host-side store over [addr, addr + size), which device
+    // registers ignore.
+    void refresh(Address addr, size_t size);
+};
+
+} // namespace Sim
+
+#endif // DEVICES_HPP_
@@ -0,0 +1,179 @@
+#include "guest_memory.hpp"
+
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+namespace Sim {
+
+namespace {
+
+// With vm.overcommit_memory=2 the kernel ignores MAP_NORESERVE and
+// charges the whole reservation against the commit limit.
+std::string reserve_error(int error) {
+    std::string text = "GuestMemory: cannot reserve the guest address space: ";
+    text += std::strerror(error);
+    std::ifstream policy("/proc/sys/vm/overcommit_memory");
+    int mode = 0;
+    if (policy >> mode && mode == 2) {
+        text += " (vm.overcommit_memory is 2: each CPU needs 4 GiB of commit charge)";
+    }
+    return text;
+}
+
+} // namespace
+
+GuestMemory::GuestMemory()
+    : mapping_(nullptr),
+    base_(nullptr),
+    flags_(nullptr),
+    flagged_(false),
+    tracked_(false)
+{
+    void *mem = mmap(nullptr, mapping_bytes(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error(reserve_error(errno));
+    }
+    mapping_ = static_cast<Byte*>(mem);
+    flags_ = mapping_;
+    base_ = mapping_ + kFlagsBytes;
+}
+
+GuestMemory::~GuestMemory() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_bytes());
+    }
+}
+
+size_t GuestMemory::map_file(int fd, Address base, size_t size, size_t offset) {
+    size &= ~(kPageSize - 1);
+    if ((base & (kPageSize - 1)) != 0 || (offset & (kPageSize - 1)) != 0 || size == 0
+        || static_cast<uint64_t>(base) + size > kSpaceBytes) {
+        return 0;
+    }
+
+    void *mem = mmap(base_ + base, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(offset));
+    if (mem == MAP_FAILED) {
+        return 0;
+    }
+    files_.push_back({base, size});
+    return size;
+}
+
+void GuestMemory::set_flags(Address addr, size_t size, uint8_t flags) {
+    if (size == 0) {
+        return;
+    }
+    __atomic_store_n(&flagged_, true, __ATOMIC_RELAXED);
+    uint64_t first = addr >> kPageShift;
+    uint64_t last = (static_cast<uint64_t>(addr) + size - 1) >> kPageShift;
+    for (uint64_t page = first; page <= last && page < kPageCount; ++page) {
+        __atomic_fetch_or(&flags_[page], flags, __ATOMIC_RELAXED);
+    }
+}
+
+void GuestMemory::clear_flags(uint8_t flags) {
+    if (!flagged_) {
+        return;
+    }
+    const uint8_t keep = static_cast<uint8_t>(~flags);
+    for (size_t page = 0; page < kPageCount; ++page) {
+        if (flags_[page] != 0) {
+            flags_[page] &= keep;
+        }
+    }
+}
+
+void GuestMemory::clear() {
+    // MADV_DONTNEED would re-read file-backed pages from the file, so
+    // put anonymous memory back under them first.
+    for (const FileMapping &file : files_) {
+        void *mem = mmap(base_ + file.base, file.size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::runtime_error("GuestMemory: cannot unmap a file image");
+        }
+    }
+    files_.clear();
+
+    madvise(mapping_, mapping_bytes(), MADV_DONTNEED);
+    flagged_ = false;
+
+    untrack();
+}
+
+void GuestMemory::track() {
+    originals_.clear();
+    dirty_.clear();
+    for (size_t page = 0; page < kPageCount; ++page) {
+        flags_[page] |= kPageTracked;
+    }
+    flagged_ = true;
+    tracked_ = true;
+}
+
+void GuestMemory::untrack() {
+    clear_flags(kPageTracked);
+    tracked_ = false;
+    originals_.clear();
+    dirty_.clear();
+}
+
+void GuestMemory::save_original(Address addr) {
+    const uint64_t first = addr >> kPageShift;
+    const uint64_t last = (static_cast<uint64_t>(addr) + sizeof(Register) - 1) >> kPageShift;
+    for (uint64_t page = first; page <= last; ++page) {
+        if ((flags_[page] & kPageTracked) == 0) {
+            continue;
+        }
+        flags_[page] &= static_cast<uint8_t>(~kPageTracked);
+        dirty_.push_back(static_cast<uint32_t>(page));
+
+        // A page rewound before already has its baseline copy.
+        std::unique_ptr<Byte[]> &original = originals_[static_cast<uint32_t>(page)];
+        if (original == nullptr) {
+            original.reset(new Byte[kPageSize]);
+            std::memcpy(original.get(), base_ + (page << kPageShift), kPageSize);
+        }
+    }
+}
+
+std::vector<uint32_t> GuestMemory::rewind() {
+    std::vector<uint32_t> pages;
+    pages.swap(dirty_);
+    for (uint32_t page : pages) {
+        std::memcpy(base_ + (static_cast<uint64_t>(page) << kPageShift), originals_[page].get(), kPageSize);
+        flags_[page] |= kPageTracked;
+    }
+    return pages;
+}
+
+std::vector<uint32_t> GuestMemory::used_pages() const {
+    // Resident pages are the only committed ones; pages of a file
+    // mapping read as the file even before they are touched.
+    std::vector<unsigned char> resident(kPageCount);
+    std::vector<uint32_t> pages;
+    if (mincore(base_, kPageCount * kPageSize, resident.data()) != 0) {
+        return pages;
+    }
+    for (const FileMapping &file : files_) {
+        const uint64_t first = file.base >> kPageShift;
+        for (uint64_t page = first; page < first + (file.size >> kPageShift); ++page) {
+            resident[page] |= 1;
+        }
+    }
+    for (size_t page = 0; page < kPageCount; ++page) {
+        if ((resident[page] & 1) != 0) {
+            pages.push_back(static_cast<uint32_t>(page));
+        }
+    }
+    return pages;
+}
+
+} // namespace Sim
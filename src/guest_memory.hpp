@@ -0,0 +1,139 @@
+#ifndef GUEST_MEMORY_HPP_
+#define GUEST_MEMORY_HPP_
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace Sim {
+
+// Per-page attributes. A store to a page with any flag set takes the
+// slow path in CPU::write.
+enum PageFlag : uint8_t {
+    kPageCode = 0x01,       // holds predecoded instructions
+    kPageTracked = 0x02,    // unchanged since track()/rewind(); copy before writing
+    kPageMmio = 0x04        // device registers: stores go to the device (see devices.hpp)
+};
+
+// The whole 32-bit guest address space, reserved up front with
+// MAP_NORESERVE. The kernel commits and zero-fills pages on first
+// touch, so memory use follows the pages the guest actually uses and
+// accesses never reallocate. One spare page after the top keeps
+// unaligned word accesses at 0xFFFFFFFD.. in bounds, so no access
+// needs a range check.
+//
+// The page flag table sits right below the guest space in the same
+// mapping, at a fixed negative offset from data().
+class GuestMemory {
+public:
+    static constexpr uint64_t kSpaceBytes = 1ull << 32;
+    static constexpr unsigned kPageShift = 12;
+    static constexpr size_t kPageSize = size_t{1} << kPageShift;
+    static constexpr size_t kPageCount = static_cast<size_t>(kSpaceBytes >> kPageShift) + 1;
+    static constexpr size_t kFlagsBytes = (kPageCount + kPageSize - 1) & ~(kPageSize - 1);
+
+private:
+    struct FileMapping {
+        Address base;
+        size_t size;
+    };
+
+    Byte *mapping_;
+    Byte *base_;
+    uint8_t *flags_;
+    bool flagged_;      // some page flag was set since the last clear()
+    bool tracked_;
+    std::vector<FileMapping> files_;
+
+    // Dirty tracking: the contents every written page had at track()
+    // time, and the pages written since then or since the last rewind.
+    std::unordered_map<uint32_t, std::unique_ptr<Byte[]>> originals_;
+    std::vector<uint32_t> dirty_;
+
+    static size_t mapping_bytes() {
+        return kFlagsBytes + kSpaceBytes + kPageSize;
+    }
+
+public:
+    GuestMemory();
+    ~GuestMemory();
+
+    GuestMemory(const GuestMemory &) = delete;
+    GuestMemory &operator=(const GuestMemory &) = delete;
+
+    Byte *data() {
+        return base_;
+    }
+
+    const Byte *data() const {
+        return base_;
+    }
+
+    Register load32(Address addr) const {
+        Register word = 0;
+        std::memcpy(&word, base_ + addr, sizeof(word));
+        return word;
+    }
+
+    void store32(Address addr, Register value) {
+        std::memcpy(base_ + addr, &value, sizeof(value));
+    }
+
+    // Flags of every page the word at addr touches. Harts of a Machine
+    // set flags concurrently, hence the (relaxed) atomic loads.
+    uint8_t flags_of_word(Address addr) const {
+        return static_cast<uint8_t>(
+            __atomic_load_n(&flags_[addr >> kPageShift], __ATOMIC_RELAXED)
+            | __atomic_load_n(&flags_[(static_cast<uint64_t>(addr) + sizeof(Register) - 1) >> kPageShift],
+                              __ATOMIC_RELAXED));
+    }
+
+    // Maps the whole pages among size bytes of fd from offset (page
+    // aligned) at guest address base as a private copy-on-write mapping and returns how
+    // many bytes it mapped (0 if base is not page aligned). Pages are
+    // read from the file on first touch and copied only when written.
+    // A partial last page is left to the caller, so bytes already in
+    // that page are not clobbered.
+    size_t map_file(int fd, Address base, size_t size, size_t offset = 0);
+
+    // Safe to call from several threads at once; clear_flags is not.
+    void set_flags(Address addr, size_t size, uint8_t flags);
+    void clear_flags(uint8_t flags);
+
+    // Drops every committed page and file mapping; the space reads as
+    // zero again. Also stops dirty tracking.
+    void clear();
+
+    // Takes the current contents as the baseline for rewind(). Costs one
+    // pass over the page flag table; nothing is copied until a page is
+    // first written.
+    void track();
+
+    bool tracking() const {
+        return tracked_;
+    }
+
+    // Stops tracking and forgets the baseline.
+    void untrack();
+
+    // Called before a store to the word at addr while tracking: keeps a
+    // copy of each of its pages not written since the baseline.
+    void save_original(Address addr);
+
+    // Copies the baseline back into the pages written since track() or
+    // the last rewind() and returns their page numbers.
+    std::vector<uint32_t> rewind();
+
+    // Pages that may hold non-zero bytes: committed pages and file
+    // mappings. Pages that read as zero may still be listed.
+    std::vector<uint32_t> used_pages() const;
+};
+
+} // namespace Sim
+
+#endif // GUEST_MEMORY_HPP_
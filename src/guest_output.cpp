@@ -0,0 +1,72 @@
+#include "guest_output.hpp"
+
+#include <charconv>
+#include <cstring>
+
+namespace Sim {
+
+constexpr size_t GuestOutput::kCapacity;
+
+void GuestOutput::drain(const char *data, size_t size) {
+    if (lock_ != nullptr) {
+        std::lock_guard<std::mutex> lock(*lock_);
+        stream_->write(data, static_cast<std::streamsize>(size));
+    } else {
+        stream_->write(data, static_cast<std::streamsize>(size));
+    }
+}
+
+char *GuestOutput::reserve(size_t size) {
+    if (buffer_ == nullptr) {
+        buffer_ = std::make_unique<char[]>(kCapacity);
+    }
+    if (size > kCapacity - used_) {
+        flush();
+    }
+    return buffer_.get() + used_;
+}
+
+void GuestOutput::write(const void *data, size_t size) {
+    if (size > kCapacity) {
+        flush();
+        drain(static_cast<const char*>(data), size);
+        return;
+    }
+    std::memcpy(reserve(size), data, size);
+    used_ += size;
+}
+
+void GuestOutput::word(Register value) {
+    if (raw_) {
+        std::memcpy(reserve(sizeof(value)), &value, sizeof(value));
+        used_ += sizeof(value);
+        return;
+    }
+    constexpr size_t kLongest = 11;     // "4294967295\n"
+    char *at = reserve(kLongest);
+    char *end = std::to_chars(at, at + kLongest, value).ptr;
+    *end++ = '\n';
+    used_ += static_cast<size_t>(end - at);
+}
+
+void GuestOutput::words(const void *data, size_t count) {
+    const auto *bytes = static_cast<const unsigned char*>(data);
+    if (raw_) {
+        write(bytes, count * sizeof(Register));
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        Register value = 0;
+        std::memcpy(&value, bytes + i * sizeof(Register), sizeof(value));
+        word(value);
+    }
+}
+
+void GuestOutput::flush() {
+    if (used_ != 0) {
+        drain(buffer_.get(), used_);
+        used_ = 0;
+    }
+}
+
+} // namespace Sim
@@ -0,0 +1,82 @@
+#ifndef GUEST_OUTPUT_HPP_
+#define GUEST_OUTPUT_HPP_
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+namespace Sim {
+
+// What a guest prints, gathered in a buffer and handed to the stream a
+// buffer at a time rather than a value at a time. Text mode prints
+// words as decimal lines; raw mode writes their four bytes as they sit
+// in guest memory. A word, or the bytes of one write(), reaches the
+// stream in one piece.
+class GuestOutput {
+public:
+    static constexpr size_t kCapacity = 64 * 1024;
+
+private:
+    std::ostream *stream_;
+    std::mutex *lock_ = nullptr;
+    std::unique_ptr<char[]> buffer_;    // allocated on first use
+    size_t used_ = 0;
+    bool raw_ = false;
+
+    void drain(const char *data, size_t size);
+    // Room for size more bytes, flushing first if need be.
+    char *reserve(size_t size);
+
+public:
+    explicit GuestOutput(std::ostream &stream)
+        : stream_(&stream)
+    {}
+
+    GuestOutput(const GuestOutput &) = delete;
+    GuestOutput &operator=(const GuestOutput &) = delete;
+
+    // Flushes what is buffered for the old stream first.
+    void set_stream(std::ostream &stream) {
+        flush();
+        stream_ = &stream;
+    }
+
+    std::ostream &stream() const {
+        return *stream_;
+    }
+
+    // Held while writing to the stream, when it is shared between
+    // threads; nullptr for none.
+    void set_lock(std::mutex *lock) {
+        lock_ = lock;
+    }
+
+    std::mutex *lock() const {
+        return lock_;
+    }
+
+    void set_raw(bool raw) {
+        raw_ = raw;
+    }
+
+    bool raw() const {
+        return raw_;
+    }
+
+    void write(const void *data, size_t size);
+
+    void word(Register value);
+
+    // Words read from memory at data, which need not be aligned.
+    void words(const void *data, size_t count);
+
+    void flush();
+};
+
+} // namespace Sim
+
+#endif // GUEST_OUTPUT_HPP_
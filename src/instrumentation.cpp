@@ -0,0 +1,63 @@
+#include "instrumentation.hpp"
+#include "isa.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Sim {
+
+namespace {
+
+constexpr size_t kReportedPairs = 8;
+
+} // namespace
+
+const char *kind_name(DecodedInstr kind) {
+    return describe(kind).mnemonic;
+}
+
+void CountingInstrumentation::report(std::ostream &out) const {
+    out << "----- PROFILE -----\n";
+    out << std::left;
+    out << std::setw(12) << "retired" << retired << "\n";
+    out << std::setw(12) << "blocks" << blocks << "\n";
+    out << std::setw(12) << "loads" << loads << "\n";
+    out << std::setw(12) << "stores" << stores << "\n";
+    out << std::setw(12) << "taken" << taken << "\n";
+    out << std::setw(12) << "not-taken" << not_taken << "\n";
+    out << std::setw(12) << "dispatches" << dispatches << "\n";
+    for (size_t kind = 0; kind < kKinds; ++kind) {
+        if (by_kind[kind] != 0) {
+            out << std::setw(12) << kind_name(static_cast<DecodedInstr>(kind)) << by_kind[kind] << "\n";
+        }
+    }
+
+    // The most frequent adjacent pairs.
+    std::vector<std::pair<uint64_t, std::pair<size_t, size_t>>> ranked;
+    for (size_t first = 0; first < kKinds; ++first) {
+        for (size_t second = 0; second < kKinds; ++second) {
+            if (pairs[first][second] != 0) {
+                ranked.push_back({pairs[first][second], {first, second}});
+            }
+        }
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+        return a.first > b.first;
+    });
+    if (ranked.size() > kReportedPairs) {
+        ranked.resize(kReportedPairs);
+    }
+    for (const auto &entry : ranked) {
+        std::string name = std::string(kind_name(static_cast<DecodedInstr>(entry.second.first))) + "+"
+            + kind_name(static_cast<DecodedInstr>(entry.second.second));
+        out << std::setw(12) << name << " " << entry.first << "\n";
+    }
+    out << std::right;
+    out << "----- END OF PROFILE -----\n";
+}
+
+} // namespace Sim
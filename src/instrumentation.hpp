@@ -0,0 +1,93 @@
+#ifndef INSTRUMENTATION_HPP_
+#define INSTRUMENTATION_HPP_
+
+#include "config.hpp"
+#include "block_cache.hpp"
+#include "instructions.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+namespace Sim {
+
+// Instrumentation policies for CPU::run(policy) and CPU::step(policy).
+// The interpreter calls the hooks inline, so a policy whose hooks are
+// empty costs nothing: the plain run()/step() use NullInstrumentation
+// and compile to the same loop as before. A policy provides:
+//
+//   kEnabled                          false skips the address arithmetic below
+//   on_block(const BasicBlock &)      a block is entered
+//   on_load(const DecodedOp &, Address)   before a word is loaded
+//   on_store(const DecodedOp &, Address)  before each word is stored
+//   on_retire(const DecodedOp &, Address next_pc)   after an op completes
+struct NullInstrumentation {
+    static constexpr bool kEnabled = false;
+
+    void on_block(const BasicBlock &) {}
+    void on_load(const DecodedOp &, Address) {}
+    void on_store(const DecodedOp &, Address) {}
+    void on_retire(const DecodedOp &, Address) {}
+};
+
+// Per-opcode, branch and memory counters for --profile. pairs counts
+// adjacent opcodes within a block, the input for choosing fusion rules
+// (see CPU::fuse); dispatches is how many handler calls the block
+// engine makes for the same instructions once they are fused.
+struct CountingInstrumentation {
+    static constexpr bool kEnabled = true;
+    static constexpr size_t kKinds = static_cast<size_t>(DecodedInstr::unknown) + 1;
+
+    uint64_t retired = 0;
+    uint64_t blocks = 0;
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+    uint64_t taken = 0;
+    uint64_t not_taken = 0;
+    uint64_t dispatches = 0;
+    uint64_t by_kind[kKinds] = {};
+    uint64_t pairs[kKinds][kKinds] = {};
+
+    size_t previous = kKinds;   // kind of the last op in this block, if any
+
+    void on_block(const BasicBlock &) {
+        ++blocks;
+        previous = kKinds;
+    }
+
+    void on_load(const DecodedOp &, Address) {
+        ++loads;
+    }
+
+    void on_store(const DecodedOp &, Address) {
+        ++stores;
+    }
+
+    void on_retire(const DecodedOp &op, Address next_pc) {
+        const size_t kind = static_cast<size_t>(op.kind);
+        ++retired;
+        ++by_kind[kind];
+        if (previous != kKinds) {
+            ++pairs[previous][kind];
+        }
+        previous = kind;
+        if (op.width != 0) {
+            ++dispatches;
+        }
+        if (op.kind == DecodedInstr::beq || op.kind == DecodedInstr::bne) {
+            if (next_pc == op.target && op.target != op.next) {
+                ++taken;
+            } else {
+                ++not_taken;
+            }
+        }
+    }
+
+    void report(std::ostream &out) const;
+};
+
+const char *kind_name(DecodedInstr kind);
+
+} // namespace Sim
+
+#endif // INSTRUMENTATION_HPP_
@@ -0,0 +1,209 @@
+#ifndef ISA_HPP_
+#define ISA_HPP_
+
+#include "config.hpp"
+#include "instructions.hpp"
+#include "block_cache.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace Sim {
+
+// Operand layouts. f21, f16 and f11 are the 5-bit fields at bits
+// 25..21, 20..16 and 15..11.
+enum class Format : uint8_t {
+    none,       // unknown instruction, no operands
+    jump,       // target = (pc & 0xF0000000) | index26 << 2
+    system,     // imm = 18-bit code in bits 23..6
+    rrr,        // rs = f21, rt = f16, rd = f11
+    drr,        // rd = f21, rs = f16, rt = f11
+    dr,         // rd = f21, rs = f16
+    dri,        // rd = f21, rs = f16, imm = f11
+    imm16s,     // rs = f21, rt = f16, imm = sign-extended bits 15..0
+    mem,        // rs = f21 (base), rt = f16, imm = bits 15..0
+    pair,       // rs = f21 (base), rt = f16, rd = f11, imm = bits 10..0
+    branch      // rs = f21, rt = f16, target = pc + 4 * sign-extended bits 15..0
+};
+
+constexpr size_t kFormats = static_cast<size_t>(Format::branch) + 1;
+
+// What an instruction does beyond computing a value.
+enum InstrEffect : uint8_t {
+    kEffectNone    = 0,
+    kEffectControl = 0x01,  // may change the pc or halt; ends a basic block
+    kEffectLoad    = 0x02,
+    kEffectStore   = 0x04
+};
+
+constexpr uint8_t kSpecialOpcode = 0;   // the instruction is selected by funct
+constexpr int8_t kNoFunct = -1;
+
+struct InstrDesc {
+    DecodedInstr kind;
+    const char *name;       // assembler method, e.g. "and_"
+    const char *mnemonic;
+    uint8_t opcode;         // bits 31..26
+    int8_t funct;           // bits 5..0 if opcode is kSpecialOpcode, else kNoFunct
+    Format format;
+    uint8_t effects;        // InstrEffect bits
+};
+
+// The instruction set, in DecodedInstr order. Decode tables, field
+// extraction and src/asm/isa_tables.rb (via tools/isa_gen.cpp) are all
+// derived from this table.
+constexpr InstrDesc kIsa[] = {
+    {DecodedInstr::j,       "j",       "j",       0b1001'11, kNoFunct,  Format::jump,   kEffectControl},
+    {DecodedInstr::syscall, "syscall", "syscall", 0b0000'00, 0b1111'10, Format::system, kEffectControl},
+    {DecodedInstr::stp,     "stp",     "stp",     0b0010'00, kNoFunct,  Format::pair,   kEffectStore},
+    {DecodedInstr::rori,    "rori",    "rori",    0b1110'11, kNoFunct,  Format::dri,    kEffectNone},
+    {DecodedInstr::slti,    "slti",    "slti",    0b0101'10, kNoFunct,  Format::imm16s, kEffectNone},
+    {DecodedInstr::st,      "st",      "st",      0b0000'11, kNoFunct,  Format::mem,    kEffectStore},
+    {DecodedInstr::bdep,    "bdep",    "bdep",    0b0000'00, 0b1110'10, Format::drr,    kEffectNone},
+    {DecodedInstr::cls,     "cls",     "cls",     0b0000'00, 0b1110'01, Format::dr,     kEffectNone},
+    {DecodedInstr::add,     "add",     "add",     0b0000'00, 0b1010'11, Format::rrr,    kEffectNone},
+    {DecodedInstr::bne,     "bne",     "bne",     0b1001'00, kNoFunct,  Format::branch, kEffectControl},
+    {DecodedInstr::beq,     "beq",     "beq",     0b0000'10, kNoFunct,  Format::branch, kEffectControl},
+    {DecodedInstr::ld,      "ld",      "ld",      0b0110'10, kNoFunct,  Format::mem,    kEffectLoad},
+    {DecodedInstr::and_,    "and_",    "and",     0b0000'00, 0b1011'01, Format::rrr,    kEffectNone},
+    {DecodedInstr::ssat,    "ssat",    "ssat",    0b0011'11, kNoFunct,  Format::dri,    kEffectNone},
+};
+
+constexpr size_t kInstrKinds = static_cast<size_t>(DecodedInstr::unknown) + 1;
+constexpr InstrDesc kUnknownInstr = {
+    DecodedInstr::unknown, "unknown", "unknown", 0, kNoFunct, Format::none, kEffectControl
+};
+
+constexpr uint32_t opcode_of(Instruction instr) {
+    return (instr >> 26) & 0x3F;
+}
+
+constexpr uint32_t funct_of(Instruction instr) {
+    return instr & 0x3F;
+}
+
+namespace isa_detail {
+
+constexpr bool is_consistent() {
+    if (sizeof(kIsa) / sizeof(kIsa[0]) + 1 != kInstrKinds) {
+        return false;
+    }
+    bool used[128] = {};
+    for (size_t i = 0; i < sizeof(kIsa) / sizeof(kIsa[0]); ++i) {
+        const InstrDesc &d = kIsa[i];
+        if (static_cast<size_t>(d.kind) != i || d.opcode > 0x3F || d.funct > 0x3F
+            || (d.opcode == kSpecialOpcode) != (d.funct != kNoFunct)) {
+            return false;
+        }
+        const size_t slot = d.opcode == kSpecialOpcode ? 64 + static_cast<size_t>(d.funct) : d.opcode;
+        if (used[slot]) {
+            return false;
+        }
+        used[slot] = true;
+    }
+    return true;
+}
+
+// Entries 0..63 are indexed by opcode, 64..127 by funct for the
+// special opcode.
+constexpr std::array<DecodedInstr, 128> make_decode_table() {
+    std::array<DecodedInstr, 128> table{};
+    for (size_t i = 0; i < table.size(); ++i) {
+        table[i] = DecodedInstr::unknown;
+    }
+    for (const InstrDesc &d : kIsa) {
+        table[d.opcode == kSpecialOpcode ? 64 + static_cast<size_t>(d.funct) : d.opcode] = d.kind;
+    }
+    return table;
+}
+
+} // namespace isa_detail
+
+static_assert(isa_detail::is_consistent(),
+              "kIsa must list every DecodedInstr in order, with unique encodings");
+
+constexpr std::array<DecodedInstr, 128> kDecodeTable = isa_detail::make_decode_table();
+
+// One table load: the opcode picks the entry unless it is the special
+// opcode, in which case the funct does.
+constexpr DecodedInstr decode_kind(Instruction instr) {
+    const uint32_t opcode = opcode_of(instr);
+    return kDecodeTable[opcode != kSpecialOpcode ? opcode : 64 + funct_of(instr)];
+}
+
+constexpr const InstrDesc &describe(DecodedInstr kind) {
+    return kind == DecodedInstr::unknown ? kUnknownInstr : kIsa[static_cast<size_t>(kind)];
+}
+
+constexpr bool ends_block(DecodedInstr kind) {
+    return (describe(kind).effects & kEffectControl) != 0;
+}
+
+// Fills in the operand fields of op for format F.
+template <Format F>
+void extract_fields(Instruction instr, DecodedOp &op) {
+    const Register_idx f21 = (instr >> 21) & 0x1F;
+    const Register_idx f16 = (instr >> 16) & 0x1F;
+    const Register_idx f11 = (instr >> 11) & 0x1F;
+    const Register imm16s = static_cast<Register>(static_cast<int32_t>(static_cast<int16_t>(instr & 0xFFFF)));
+
+    if constexpr (F == Format::jump) {
+        op.target = (op.pc & 0xF000'0000) | ((instr & 0x03FF'FFFF) << 2);
+    } else if constexpr (F == Format::system) {
+        op.imm = (instr >> 6) & 0x0003'FFFF;
+    } else if constexpr (F == Format::rrr) {
+        op.rs = f21;
+        op.rt = f16;
+        op.rd = f11;
+    } else if constexpr (F == Format::drr) {
+        op.rd = f21;
+        op.rs = f16;
+        op.rt = f11;
+    } else if constexpr (F == Format::dr) {
+        op.rd = f21;
+        op.rs = f16;
+    } else if constexpr (F == Format::dri) {
+        op.rd = f21;
+        op.rs = f16;
+        op.imm = f11;
+    } else if constexpr (F == Format::imm16s) {
+        op.rs = f21;
+        op.rt = f16;
+        op.imm = imm16s;
+    } else if constexpr (F == Format::mem) {
+        op.rs = f21;
+        op.rt = f16;
+        op.imm = instr & 0xFFFF;
+    } else if constexpr (F == Format::pair) {
+        op.rs = f21;
+        op.rt = f16;
+        op.rd = f11;
+        op.imm = instr & 0x07FF;
+    } else if constexpr (F == Format::branch) {
+        op.rs = f21;
+        op.rt = f16;
+        op.target = op.pc + (imm16s << 2);
+    }
+}
+
+using FieldExtractor = void (*)(Instruction, DecodedOp &);
+
+// Indexed by Format.
+constexpr FieldExtractor kFieldExtractors[kFormats] = {
+    &extract_fields<Format::none>,
+    &extract_fields<Format::jump>,
+    &extract_fields<Format::system>,
+    &extract_fields<Format::rrr>,
+    &extract_fields<Format::drr>,
+    &extract_fields<Format::dr>,
+    &extract_fields<Format::dri>,
+    &extract_fields<Format::imm16s>,
+    &extract_fields<Format::mem>,
+    &extract_fields<Format::pair>,
+    &extract_fields<Format::branch>,
+};
+
+} // namespace Sim
+
+#endif // ISA_HPP_
@@ -0,0 +1,676 @@
+#include "jit.hpp"
+#include "cpu.hpp"
+#include "guest_memory.hpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+namespace Sim {
+
+namespace {
+
+enum HostReg : uint8_t {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+enum Cond : uint8_t {
+    kAE = 0x3, kE = 0x4, kNE = 0x5, kA = 0x7, kL = 0xC, kG = 0xF
+};
+
+// Host registers guest registers may live in inside a block. Every
+// helper call writes them back and reloads them, so caller-saved ones
+// are as good as callee-saved ones here.
+constexpr HostReg kAllocatable[] = {RBP, R12, R13, RSI, RDI, R8, R9, R10, R11};
+
+// rbx holds the JitContext, r15 the guest register file and r14 the
+// base of guest memory.
+constexpr HostReg kCtx = RBX;
+constexpr HostReg kRegs = R15;
+constexpr HostReg kMem = R14;
+
+constexpr int32_t kOffRegs = static_cast<int32_t>(offsetof(JitContext, regs));
+constexpr int32_t kOffMem = static_cast<int32_t>(offsetof(JitContext, mem));
+constexpr int32_t kOffRetired = static_cast<int32_t>(offsetof(JitContext, retired));
+constexpr int32_t kOffLimit = static_cast<int32_t>(offsetof(JitContext, limit));
+constexpr int32_t kOffCpu = static_cast<int32_t>(offsetof(JitContext, cpu));
+constexpr int32_t kOffPc = static_cast<int32_t>(offsetof(JitContext, pc));
+
+class Emitter {
+private:
+    uint8_t *p_;
+
+    void rex(bool w, uint8_t reg, uint8_t rm) {
+        uint8_t prefix = static_cast<uint8_t>(0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0));
+        if (prefix != 0x40) {
+            byte(prefix);
+        }
+    }
+
+    void rex_sib(uint8_t reg, uint8_t index, uint8_t base) {
+        uint8_t prefix = static_cast<uint8_t>(0x40 | ((reg & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0));
+        if (prefix != 0x40) {
+            byte(prefix);
+        }
+    }
+
+    // opcode with a [base + index + disp32] ModRM/SIB.
+    void rm_sib(uint8_t opcode, uint8_t reg, uint8_t base, uint8_t index, int32_t disp) {
+        rex_sib(reg, index, base);
+        byte(opcode);
+        byte(static_cast<uint8_t>(0x84 | ((reg & 7) << 3)));
+        byte(static_cast<uint8_t>(((index & 7) << 3) | (base & 7)));
+        u32(static_cast<uint32_t>(disp));
+    }
+
+    // opcode with a register-direct ModRM.
+    void rr(uint8_t opcode, uint8_t reg, uint8_t rm, bool w = false) {
+        rex(w, reg, rm);
+        byte(opcode);
+        byte(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+    }
+
+    // opcode with a [base + disp32] ModRM; base is never rsp/r12.
+    void rm(uint8_t opcode, uint8_t reg, uint8_t base, int32_t disp, bool w = false) {
+        rex(w, reg, base);
+        byte(opcode);
+        byte(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+        u32(static_cast<uint32_t>(disp));
+    }
+
+public:
+    explicit Emitter(uint8_t *p)
+        : p_(p)
+    {}
+
+    uint8_t *here() const {
+        return p_;
+    }
+
+    void byte(uint8_t b) {
+        *p_++ = b;
+    }
+
+    void u32(uint32_t v) {
+        std::memcpy(p_, &v, sizeof(v));
+        p_ += sizeof(v);
+    }
+
+    void u64(uint64_t v) {
+        std::memcpy(p_, &v, sizeof(v));
+        p_ += sizeof(v);
+    }
+
+    static void patch(uint8_t *site, const uint8_t *target) {
+        int32_t rel = static_cast<int32_t>(target - (site + 4));
+        std::memcpy(site, &rel, sizeof(rel));
+    }
+
+    void mov32(uint8_t dst, uint8_t src)                       { rr(0x89, src, dst); }
+    void load32(uint8_t dst, uint8_t base, int32_t disp)       { rm(0x8B, dst, base, disp); }
+    void store32(uint8_t base, int32_t disp, uint8_t src)      { rm(0x89, src, base, disp); }
+    void alu32(uint8_t op, uint8_t dst, uint8_t src)           { rr(op, dst, src); }
+    void alu32(uint8_t op, uint8_t dst, uint8_t base, int32_t disp) { rm(op, dst, base, disp); }
+    void load64(uint8_t dst, uint8_t base, int32_t disp)       { rm(0x8B, dst, base, disp, true); }
+    void cmp64(uint8_t reg, uint8_t base, int32_t disp)        { rm(0x3B, reg, base, disp, true); }
+    void mov64(uint8_t dst, uint8_t src)                       { rr(0x89, src, dst, true); }
+    void test32(uint8_t a, uint8_t b)                          { rr(0x85, b, a); }
+
+    void mov_imm32(uint8_t dst, uint32_t imm) {
+        rex(false, 0, dst);
+        byte(static_cast<uint8_t>(0xB8 + (dst & 7)));
+        u32(imm);
+    }
+
+    void mov_imm64(uint8_t dst, uint64_t imm) {
+        rex(true, 0, dst);
+        byte(static_cast<uint8_t>(0xB8 + (dst & 7)));
+        u64(imm);
+    }
+
+    void load32(uint8_t dst, uint8_t base, uint8_t index)     { rm_sib(0x8B, dst, base, index, 0); }
+    void store32(uint8_t base, uint8_t index, uint8_t src)    { rm_sib(0x89, src, base, index, 0); }
+
+    void cmp_byte_imm8(uint8_t base, uint8_t index, int32_t disp, uint8_t imm) {
+        rm_sib(0x80, 7, base, index, disp);
+        byte(imm);
+    }
+
+    void add_imm32(uint8_t reg, uint32_t imm) {
+        rr(0x81, 0, reg);
+        u32(imm);
+    }
+
+    void and_imm32(uint8_t reg, uint32_t imm) {
+        rr(0x81, 4, reg);
+        u32(imm);
+    }
+
+    void shr_imm(uint8_t reg, uint8_t n) {
+        rr(0xC1, 5, reg);
+        byte(n);
+    }
+
+    void cmp_imm32(uint8_t reg, uint32_t imm) {
+        rr(0x81, 7, reg);
+        u32(imm);
+    }
+
+    void ror_imm(uint8_t reg, uint8_t n) {
+        rr(0xC1, 1, reg);
+        byte(n);
+    }
+
+    void shr64_imm(uint8_t reg, uint8_t n) {
+        rr(0xC1, 5, reg, true);
+        byte(n);
+    }
+
+    void setl_zx_eax() {
+        byte(0x0F); byte(0x9C); byte(0xC0);     // setl al
+        byte(0x0F); byte(0xB6); byte(0xC0);     // movzx eax, al
+    }
+
+    void cmov(Cond cc, uint8_t dst, uint8_t src) {
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(static_cast<uint8_t>(0x40 + cc));
+        byte(static_cast<uint8_t>(0xC0 | ((dst & 7) << 3) | (src & 7)));
+    }
+
+    void add_mem64_imm32(uint8_t base, int32_t disp, uint32_t imm) {
+        rm(0x81, 0, base, disp, true);
+        u32(imm);
+    }
+
+    void store_imm32(uint8_t base, int32_t disp, uint32_t imm) {
+        rm(0xC7, 0, base, disp);
+        u32(imm);
+    }
+
+    // Returns the rel32 field to patch.
+    uint8_t *jcc(Cond cc) {
+        byte(0x0F);
+        byte(static_cast<uint8_t>(0x80 + cc));
+        uint8_t *site = p_;
+        u32(0);
+        return site;
+    }
+
+    uint8_t *jmp() {
+        byte(0xE9);
+        uint8_t *site = p_;
+        u32(0);
+        return site;
+    }
+
+    void call(uint8_t reg)  { rr(0xFF, 2, reg); }
+    void jmp(uint8_t reg)   { rr(0xFF, 4, reg); }
+    void ret()              { byte(0xC3); }
+
+    void push(uint8_t reg) {
+        rex(false, 0, reg);
+        byte(static_cast<uint8_t>(0x50 + (reg & 7)));
+    }
+
+    void pop(uint8_t reg) {
+        rex(false, 0, reg);
+        byte(static_cast<uint8_t>(0x58 + (reg & 7)));
+    }
+
+    void sub_rsp(uint8_t n) { byte(0x48); byte(0x83); byte(0xEC); byte(n); }
+    void add_rsp(uint8_t n) { byte(0x48); byte(0x83); byte(0xC4); byte(n); }
+};
+
+constexpr uint8_t kOpAdd = 0x03;
+constexpr uint8_t kOpAnd = 0x23;
+constexpr uint8_t kOpCmp = 0x3B;
+
+int32_t reg_disp(Register_idx g) {
+    return static_cast<int32_t>(g * sizeof(Register));
+}
+
+} // namespace
+
+class JitTranslator {
+private:
+    Jit &jit_;
+    const BasicBlock &block_;
+    Emitter e_;
+    int host_of_[kNumberOfRegisters];
+    uint32_t dirty_;
+
+    bool native(const DecodedOp &op) const {
+        switch (op.kind) {
+            case DecodedInstr::add:
+            case DecodedInstr::and_:
+            case DecodedInstr::slti:
+            case DecodedInstr::rori:
+            case DecodedInstr::ssat:
+            case DecodedInstr::j:
+            case DecodedInstr::beq:
+            case DecodedInstr::bne:
+                return true;
+            case DecodedInstr::ld:
+            case DecodedInstr::st:
+                return (op.imm & 0x3u) == 0;
+            default:
+                return false;
+        }
+    }
+
+    void allocate() {
+        uint32_t uses[kNumberOfRegisters] = {};
+        for (const DecodedOp &op : block_.ops) {
+            if (!native(op)) {
+                continue;
+            }
+            ++uses[op.rd];
+            ++uses[op.rs];
+            ++uses[op.rt];
+        }
+
+        for (int &h : host_of_) {
+            h = -1;
+        }
+        for (HostReg host : kAllocatable) {
+            Register_idx best = 0;
+            uint32_t best_uses = 0;
+            for (Register_idx g = 0; g < kNumberOfRegisters; ++g) {
+                if (host_of_[g] < 0 && uses[g] > best_uses) {
+                    best = g;
+                    best_uses = uses[g];
+                }
+            }
+            if (best_uses == 0) {
+                break;
+            }
+            host_of_[best] = host;
+        }
+    }
+
+    void reload() {
+        for (Register_idx g = 0; g < kNumberOfRegisters; ++g) {
+            if (host_of_[g] >= 0) {
+                e_.load32(static_cast<uint8_t>(host_of_[g]), kRegs, reg_disp(g));
+            }
+        }
+    }
+
+    void writeback() {
+        for (Register_idx g = 0; g < kNumberOfRegisters; ++g) {
+            if ((dirty_ >> g) & 1u) {
+                e_.store32(kRegs, reg_disp(g), static_cast<uint8_t>(host_of_[g]));
+            }
+        }
+        dirty_ = 0;
+    }
+
+    void load(uint8_t dst, Register_idx g) {
+        if (host_of_[g] >= 0) {
+            e_.mov32(dst, static_cast<uint8_t>(host_of_[g]));
+        } else {
+            e_.load32(dst, kRegs, reg_disp(g));
+        }
+    }
+
+    void alu(uint8_t opcode, uint8_t dst, Register_idx g) {
+        if (host_of_[g] >= 0) {
+            e_.alu32(opcode, dst, static_cast<uint8_t>(host_of_[g]));
+        } else {
+            e_.alu32(opcode, dst, kRegs, reg_disp(g));
+        }
+    }
+
+    void store(Register_idx g, uint8_t src) {
+        if (host_of_[g] >= 0) {
+            e_.mov32(static_cast<uint8_t>(host_of_[g]), src);
+            dirty_ |= 1u << g;
+        } else {
+            e_.store32(kRegs, reg_disp(g), src);
+        }
+    }
+
+    // Leaves with the next pc in eax; used after helper calls.
+    void exit_dynamic(uint64_t count) {
+        e_.store32(kCtx, kOffPc, RAX);
+        e_.add_mem64_imm32(kCtx, kOffRetired, static_cast<uint32_t>(count));
+        Emitter::patch(e_.jmp(), jit_.epilogue_);
+    }
+
+    // Leaves towards a known target: straight into its translation once
+    // there is one, otherwise back to the dispatcher.
+    void exit_chained(Address target, uint64_t count) {
+        e_.add_mem64_imm32(kCtx, kOffRetired, static_cast<uint32_t>(count));
+        e_.load64(RAX, kCtx, kOffRetired);
+        e_.cmp64(RAX, kCtx, kOffLimit);
+        uint8_t *over_budget = e_.jcc(kAE);
+        uint8_t *chain = e_.jmp();
+
+        Emitter::patch(over_budget, e_.here());
+        Emitter::patch(chain, e_.here());
+        e_.store_imm32(kCtx, kOffPc, target);
+        Emitter::patch(e_.jmp(), jit_.epilogue_);
+
+        const uint8_t *entry = jit_.lookup(target);
+        if (entry != nullptr) {
+            Emitter::patch(chain, entry);
+        } else {
+            jit_.pending_links_[target].push_back(chain);
+        }
+    }
+
+    void emit_fallback(const DecodedOp &op, uint64_t count, bool terminator) {
+        writeback();
+        e_.load64(RDI, kCtx, kOffCpu);
+        e_.mov_imm64(RSI, reinterpret_cast<uint64_t>(&op));
+        e_.mov_imm64(RAX, reinterpret_cast<uint64_t>(&Jit::fallback));
+        e_.call(RAX);
+
+        if (terminator) {
+            exit_dynamic(count);
+            return;
+        }
+
+        // High half of the result flags a halt or a code invalidation.
+        e_.mov64(RDX, RAX);
+        e_.shr64_imm(RDX, 32);
+        e_.test32(RDX, RDX);
+        uint8_t *go_on = e_.jcc(kE);
+        exit_dynamic(count);
+        Emitter::patch(go_on, e_.here());
+        reload();
+    }
+
+    // Guest address regs[rs] + imm in eax, zero-extended into rax.
+    void effective_address(const DecodedOp &op) {
+        load(RAX, op.rs);
+        if (op.imm != 0) {
+            e_.add_imm32(RAX, op.imm);
+        }
+    }
+
+    void emit_ld(const DecodedOp &op, uint64_t count) {
+        if ((op.imm & 0x3u) != 0) {
+            emit_fallback(op, count, false);
+            return;
+        }
+        effective_address(op);
+        e_.load32(RAX, kMem, RAX);
+        store(op.rt, RAX);
+    }
+
+    // Stores go straight to guest memory unless the word touches a
+    // flagged page (or straddles one), in which case exec_st takes over.
+    void emit_st(const DecodedOp &op, uint64_t count) {
+        if ((op.imm & 0x3u) != 0) {
+            emit_fallback(op, count, false);
+            return;
+        }
+        effective_address(op);
+        e_.mov32(RCX, RAX);
+        e_.and_imm32(RCX, static_cast<uint32_t>(GuestMemory::kPageSize - 1));
+        e_.cmp_imm32(RCX, static_cast<uint32_t>(GuestMemory::kPageSize - sizeof(Register)));
+        uint8_t *straddles = e_.jcc(kA);
+        e_.mov32(RCX, RAX);
+        e_.shr_imm(RCX, GuestMemory::kPageShift);
+        e_.cmp_byte_imm8(kMem, RCX, -static_cast<int32_t>(GuestMemory::kFlagsBytes), 0);
+        uint8_t *flagged = e_.jcc(kNE);
+        load(RDX, op.rt);
+        e_.store32(kMem, RAX, RDX);
+        uint8_t *done = e_.jmp();
+
+        Emitter::patch(straddles, e_.here());
+        Emitter::patch(flagged, e_.here());
+        const uint32_t dirty = dirty_;
+        emit_fallback(op, count, false);
+        dirty_ = dirty;
+        Emitter::patch(done, e_.here());
+    }
+
+    void emit_branch(const DecodedOp &op, uint64_t count, Cond not_taken) {
+        writeback();
+        load(RAX, op.rs);
+        alu(kOpCmp, RAX, op.rt);
+        uint8_t *skip = e_.jcc(not_taken);
+        exit_chained(op.target, count);
+        Emitter::patch(skip, e_.here());
+        exit_chained(op.next, count);
+    }
+
+    void emit_ssat(const DecodedOp &op) {
+        const Register N = op.imm & 0x1Fu;
+        load(RAX, op.rs);
+        if (N != 0) {
+            const int64_t minv = -(1LL << (N - 1));
+            const int64_t maxv = (1LL << (N - 1)) - 1;
+            e_.mov_imm32(RCX, static_cast<uint32_t>(static_cast<int32_t>(minv)));
+            e_.alu32(kOpCmp, RAX, RCX);
+            e_.cmov(kL, RAX, RCX);
+            e_.mov_imm32(RCX, static_cast<uint32_t>(static_cast<int32_t>(maxv)));
+            e_.alu32(kOpCmp, RAX, RCX);
+            e_.cmov(kG, RAX, RCX);
+        }
+        store(op.rd, RAX);
+    }
+
+public:
+    JitTranslator(Jit &jit, const BasicBlock &block, uint8_t *out)
+        : jit_(jit),
+        block_(block),
+        e_(out),
+        host_of_(),
+        dirty_(0)
+    {}
+
+    uint8_t *end() const {
+        return e_.here();
+    }
+
+    const uint8_t *run() {
+        const uint8_t *entry = e_.here();
+        allocate();
+        reload();
+
+        uint64_t count = 0;
+        for (const DecodedOp &op : block_.ops) {
+            ++count;
+            switch (op.kind) {
+                case DecodedInstr::add:
+                    load(RAX, op.rs);
+                    alu(kOpAdd, RAX, op.rt);
+                    store(op.rd, RAX);
+                    break;
+                case DecodedInstr::and_:
+                    load(RAX, op.rs);
+                    alu(kOpAnd, RAX, op.rt);
+                    store(op.rd, RAX);
+                    break;
+                case DecodedInstr::slti:
+                    load(RAX, op.rs);
+                    e_.cmp_imm32(RAX, op.imm);
+                    e_.setl_zx_eax();
+                    store(op.rt, RAX);
+                    break;
+                case DecodedInstr::rori:
+                    load(RAX, op.rs);
+                    if ((op.imm & 0x1Fu) != 0) {
+                        e_.ror_imm(RAX, static_cast<uint8_t>(op.imm & 0x1Fu));
+                    }
+                    store(op.rd, RAX);
+                    break;
+                case DecodedInstr::ssat:
+                    emit_ssat(op);
+                    break;
+                case DecodedInstr::j:
+                    writeback();
+                    exit_chained(op.target, count);
+                    return entry;
+                case DecodedInstr::beq:
+                    emit_branch(op, count, kNE);
+                    return entry;
+                case DecodedInstr::bne:
+                    emit_branch(op, count, kE);
+                    return entry;
+                case DecodedInstr::syscall:
+                case DecodedInstr::unknown:
+                    emit_fallback(op, count, true);
+                    return entry;
+                case DecodedInstr::ld:
+                    emit_ld(op, count);
+                    break;
+                case DecodedInstr::st:
+                    emit_st(op, count);
+                    break;
+                case DecodedInstr::stp:
+                case DecodedInstr::bdep:
+                case DecodedInstr::cls:
+                    emit_fallback(op, count, false);
+                    break;
+            }
+        }
+
+        // Block was cut at kMaxBlockOps: fall through to the next one.
+        writeback();
+        exit_chained(block_.end, count);
+        return entry;
+    }
+};
+
+Jit::Jit()
+    : code_(nullptr),
+    used_(0),
+    tail_start_(0),
+    trampoline_(nullptr),
+    epilogue_(nullptr),
+    generation_(0)
+{
+#if defined(__x86_64__)
+    void *mem = mmap(nullptr, kCodeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+    code_ = static_cast<uint8_t*>(mem);
+    emit_trampoline();
+    if (!protect(kCodeBytes, PROT_READ | PROT_EXEC)) {
+        munmap(code_, kCodeBytes);
+        code_ = nullptr;
+    }
+#endif
+}
+
+Jit::~Jit() {
+    if (code_ != nullptr) {
+        munmap(code_, kCodeBytes);
+    }
+}
+
+void Jit::emit_trampoline() {
+    Emitter e(code_);
+
+    // void trampoline(JitContext *ctx /* rdi */, const uint8_t *entry /* rsi */)
+    trampoline_ = reinterpret_cast<Trampoline>(e.here());
+    e.push(RBX);
+    e.push(RBP);
+    e.push(R12);
+    e.push(R13);
+    e.push(R14);
+    e.push(R15);
+    e.sub_rsp(8);               // keep calls from blocks 16-byte aligned
+    e.mov64(kCtx, RDI);
+    e.load64(kRegs, kCtx, kOffRegs);
+    e.load64(kMem, kCtx, kOffMem);
+    e.jmp(RSI);
+
+    epilogue_ = e.here();
+    e.add_rsp(8);
+    e.pop(R15);
+    e.pop(R14);
+    e.pop(R13);
+    e.pop(R12);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.ret();
+
+    used_ = static_cast<size_t>(e.here() - code_);
+    tail_start_ = used_;
+}
+
+void Jit::sync(uint64_t generation) {
+    if (generation != generation_) {
+        flush();
+        generation_ = generation;
+    }
+}
+
+void Jit::flush() {
+    entries_.clear();
+    pending_links_.clear();
+    used_ = tail_start_;
+}
+
+void Jit::link(Address target, const uint8_t *entry) {
+    auto it = pending_links_.find(target);
+    if (it == pending_links_.end()) {
+        return;
+    }
+    for (uint8_t *site : it->second) {
+        Emitter::patch(site, entry);
+    }
+    pending_links_.erase(it);
+}
+
+bool Jit::protect(size_t size, int prot) {
+    if (mprotect(code_, size, prot) != 0) {
+        std::cerr << "jit: mprotect failed\n";
+        return false;
+    }
+    return true;
+}
+
+// The buffer is never writable and executable at once: only while a
+// block is translated is the part in use (which link() may patch) plus
+// room for the new block writable, and nothing runs meanwhile.
+bool Jit::translate(const BasicBlock &block) {
+    if (code_ == nullptr) {
+        return false;
+    }
+    if (kCodeBytes - used_ < kMaxBlockCode) {
+        flush();
+    }
+
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t open = (used_ + kMaxBlockCode + page - 1) / page * page;
+    if (!protect(open, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    JitTranslator translator(*this, block, code_ + used_);
+    const uint8_t *entry = translator.run();
+    used_ = static_cast<size_t>(translator.end() - code_);
+    used_ = (used_ + 15) & ~static_cast<size_t>(15);
+    link(block.start, entry);
+    if (!protect(open, PROT_READ | PROT_EXEC)) {
+        // Nothing may run from the buffer until it is executable again.
+        flush();
+        return false;
+    }
+
+    entries_[block.start] = entry;
+    return true;
+}
+
+uint64_t Jit::fallback(CPU *cpu, const DecodedOp *op) {
+    const uint64_t generation = cpu->blocks_.generation();
+    Address next_pc = op->next;
+
+    (cpu->*op->handler)(*op, next_pc);
+
+    bool stop = cpu->halted_ || generation != cpu->blocks_.generation();
+    return static_cast<uint64_t>(next_pc) | (static_cast<uint64_t>(stop) << 32);
+}
+
+} // namespace Sim
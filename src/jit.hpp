@@ -0,0 +1,93 @@
+#ifndef JIT_HPP_
+#define JIT_HPP_
+
+#include "config.hpp"
+#include "block_cache.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace Sim {
+
+class CPU;
+
+// State shared between the dispatcher and translated code. Translated
+// blocks address it through a fixed host register, so keep it a plain
+// struct with stable offsets.
+struct JitContext {
+    Register *regs;
+    Byte *mem;          // GuestMemory::data()
+    uint64_t retired;
+    uint64_t limit;     // chained exits return once retired reaches this
+    CPU *cpu;
+    Address pc;         // next guest pc, written on every exit
+};
+
+// Tiered x86-64 translator: blocks run in the interpreter until they
+// have executed kHotThreshold times, then get translated into an
+// executable buffer, which is never writable while it can run. Exits
+// with a static target are patched into direct jumps once the target
+// is translated too. Anything the translator does not handle natively
+// calls back into the exec_* handlers.
+class Jit {
+public:
+    static constexpr uint32_t kHotThreshold = 16;
+
+private:
+    static constexpr size_t kCodeBytes = 32u << 20;
+    static constexpr size_t kMaxBlockCode = 32u << 10;
+
+    using Trampoline = void (*)(JitContext *ctx, const uint8_t *entry);
+
+    uint8_t *code_;
+    size_t used_;
+    size_t tail_start_;     // first byte after the trampoline/epilogue
+    Trampoline trampoline_;
+    const uint8_t *epilogue_;
+
+    std::unordered_map<Address, const uint8_t*> entries_;
+    std::unordered_map<Address, std::vector<uint8_t*>> pending_links_;
+    uint64_t generation_;
+
+    void emit_trampoline();
+    // mprotect()s the first size bytes of the buffer.
+    bool protect(size_t size, int prot);
+    void link(Address target, const uint8_t *entry);
+
+    static uint64_t fallback(CPU *cpu, const DecodedOp *op);
+
+public:
+    Jit();
+    ~Jit();
+
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    bool ready() const {
+        return code_ != nullptr;
+    }
+
+    // Drops every translation when the block cache has changed since
+    // the last call, so no stale code or chained jump survives.
+    void sync(uint64_t generation);
+    void flush();
+
+    const uint8_t *lookup(Address pc) const {
+        auto it = entries_.find(pc);
+        return it == entries_.end() ? nullptr : it->second;
+    }
+
+    bool translate(const BasicBlock &block);
+
+    void enter(JitContext &ctx, const uint8_t *entry) const {
+        trampoline_(&ctx, entry);
+    }
+
+    friend class JitTranslator;
+};
+
+} // namespace Sim
+
+#endif // JIT_HPP_
@@ -0,0 +1,381 @@
+#include "lockstep.hpp"
+#include "instructions.hpp"
+
+#include <algorithm>
+
+namespace Sim {
+
+#if defined(__GNUC__)
+
+template <size_t Lanes>
+void Lockstep<Lanes>::run(CPU *const *cpus, size_t count) {
+    blocks_.clear();
+
+    for (size_t lane = 0; lane < Lanes; ++lane) {
+        CPU *cpu = lane < count ? cpus[lane] : nullptr;
+        cpus_[lane] = cpu;
+        live_[lane] = cpu != nullptr && !cpu->halted_;
+        pc_[lane] = cpu != nullptr ? cpu->pc_ : 0;
+        retired_[lane] = cpu != nullptr ? cpu->retired_ : 0;
+        idle_[lane] = 0;
+    }
+    live_count_ = 0;
+    for (size_t lane = 0; lane < Lanes; ++lane) {
+        live_count_ += live_[lane] ? 1 : 0;
+    }
+    for (size_t r = 0; r < kNumberOfRegisters; ++r) {
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            regs_[r][lane] = cpus_[lane] != nullptr ? cpus_[lane]->regs_[r] : 0;
+        }
+    }
+
+    Vec active = {};
+    Address pc = 0;
+    bool converged = false;     // every live lane is at pc, as in active
+
+    for (;;) {
+        if (!converged) {
+            bool any = false;
+            for (size_t lane = 0; lane < Lanes; ++lane) {
+                if (live_[lane] && (!any || pc_[lane] < pc)) {
+                    pc = pc_[lane];
+                    any = true;
+                }
+            }
+            if (!any) {
+                break;
+            }
+
+            for (size_t lane = 0; lane < Lanes; ++lane) {
+                if (!live_[lane]) {
+                    continue;
+                }
+                if (pc_[lane] == pc) {
+                    idle_[lane] = 0;
+                } else if (++idle_[lane] > kMaxIdle) {
+                    leave(lane);
+                }
+            }
+        }
+
+        // Building the block may hand back lanes that see other code.
+        const size_t live_before = live_count_;
+        const BasicBlock *block = block_at(pc);
+
+        if (!converged || live_count_ != live_before) {
+            active = Vec{};
+            converged = true;
+            for (size_t lane = 0; lane < Lanes; ++lane) {
+                if (!live_[lane]) {
+                    continue;
+                }
+                if (pc_[lane] == pc) {
+                    active[lane] = ~0u;
+                } else {
+                    converged = false;
+                }
+            }
+            if (none(active)) {
+                converged = false;
+                continue;
+            }
+        }
+
+        if (converged) {
+            converged = exec_block<false>(*block, active, pc);
+        } else {
+            exec_block<true>(*block, active, pc);
+        }
+    }
+
+    // Lanes handed back run alone from where they left off.
+    for (size_t lane = 0; lane < count; ++lane) {
+        if (!cpus_[lane]->halted_) {
+            cpus_[lane]->run();
+        } else {
+            cpus_[lane]->flush_output();
+        }
+    }
+}
+
+template <size_t Lanes>
+const BasicBlock *Lockstep<Lanes>::block_at(Address pc) {
+    BasicBlock *cached = blocks_.lookup(pc);
+    if (cached != nullptr) {
+        return cached;
+    }
+
+    size_t leader = 0;
+    while (!live_[leader]) {
+        ++leader;
+    }
+    std::unique_ptr<BasicBlock> block = cpus_[leader]->decode_block(pc);
+
+    // Only lanes holding the same instructions may share the decode.
+    const size_t bytes = block->ops.size() * kInstructionBytes;
+    for (size_t lane = leader + 1; lane < Lanes; ++lane) {
+        if (!live_[lane]) {
+            continue;
+        }
+        GuestMemory &memory = cpus_[lane]->memory_;
+        for (const DecodedOp &op : block->ops) {
+            if (memory.load32(op.pc) != op.raw) {
+                leave(lane);
+                break;
+            }
+        }
+        if (live_[lane]) {
+            memory.set_flags(pc, bytes, kPageCode);
+        }
+    }
+
+    return &blocks_.insert(std::move(block));
+}
+
+template <size_t Lanes>
+template <bool Masked>
+bool Lockstep<Lanes>::exec_block(const BasicBlock &block, const Vec &active, Address &pc) {
+    Vec m = active;
+    Vec next = {};
+    Vec leaving = {};
+    bool converged = !Masked;
+
+    // Without Masked every live lane is active, and the registers of
+    // lanes that are not live no longer matter.
+    auto assign = [&](Register_idx rd, const Vec &value) {
+        if (Masked) {
+            regs_[rd] = (value & m) | (regs_[rd] & ~m);
+        } else {
+            regs_[rd] = value;
+        }
+    };
+
+    const size_t count = block.ops.size();
+    for (size_t i = 0; i < count; ++i) {
+        const DecodedOp &op = block.ops[i];
+        bool has_next = false;   // next holds per-lane targets for this op
+        bool any_leaving = false;
+
+        switch (op.kind) {
+            case DecodedInstr::add:
+                assign(op.rd, regs_[op.rs] + regs_[op.rt]);
+                break;
+            case DecodedInstr::and_:
+                assign(op.rd, regs_[op.rs] & regs_[op.rt]);
+                break;
+            case DecodedInstr::rori: {
+                const Register n = op.imm & 0x1Fu;
+                const Vec v = regs_[op.rs];
+                assign(op.rd, n == 0 ? v : (v >> n) | (v << (kNumberOfBits - n)));
+                break;
+            }
+            case DecodedInstr::slti:
+                assign(op.rt, reinterpret_cast<Vec>(reinterpret_cast<SVec>(regs_[op.rs])
+                    < static_cast<int32_t>(op.imm)) & 1u);
+                break;
+            case DecodedInstr::ssat: {
+                const Register n = op.imm & 0x1Fu;
+                if (n == 0) {
+                    assign(op.rd, regs_[op.rs]);
+                    break;
+                }
+                const int32_t minv = static_cast<int32_t>(-(1LL << (n - 1)));
+                const int32_t maxv = static_cast<int32_t>((1LL << (n - 1)) - 1);
+                SVec v = reinterpret_cast<SVec>(regs_[op.rs]);
+                SVec below = v < minv;
+                v = (below & minv) | (~below & v);
+                SVec above = v > maxv;
+                v = (above & maxv) | (~above & v);
+                assign(op.rd, reinterpret_cast<Vec>(v));
+                break;
+            }
+            case DecodedInstr::cls: {
+                Vec value = {};
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    if (m[lane] != 0) {
+                        value[lane] = cpus_[lane]->cls_emulate(regs_[op.rs][lane]);
+                    }
+                }
+                assign(op.rd, value);
+                break;
+            }
+            case DecodedInstr::bdep: {
+                Vec value = {};
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    if (m[lane] != 0) {
+                        value[lane] = cpus_[lane]->pdep_emulate(regs_[op.rs][lane], regs_[op.rt][lane]);
+                    }
+                }
+                assign(op.rd, value);
+                break;
+            }
+            case DecodedInstr::j:
+                next = Vec{} + op.target;
+                has_next = true;
+                break;
+            case DecodedInstr::beq: {
+                Vec taken = reinterpret_cast<Vec>(regs_[op.rs] == regs_[op.rt]);
+                next = (taken & op.target) | (~taken & op.next);
+                has_next = true;
+                break;
+            }
+            case DecodedInstr::bne: {
+                Vec taken = reinterpret_cast<Vec>(regs_[op.rs] != regs_[op.rt]);
+                next = (taken & op.target) | (~taken & op.next);
+                has_next = true;
+                break;
+            }
+            case DecodedInstr::ld:
+                if ((op.imm & 0x3u) != 0) {
+                    goto scalar;
+                }
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    if (m[lane] != 0) {
+                        regs_[op.rt][lane] = cpus_[lane]->memory_.load32(regs_[op.rs][lane] + op.imm);
+                    }
+                }
+                break;
+            case DecodedInstr::st:
+                if ((op.imm & 0x3u) != 0) {
+                    goto scalar;
+                }
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    if (m[lane] != 0) {
+                        const Address addr = regs_[op.rs][lane] + op.imm;
+                        if (stores_to_code(lane, addr)) {
+                            leaving[lane] = ~0u;
+                            any_leaving = true;
+                        }
+                        cpus_[lane]->write(addr, regs_[op.rt][lane]);
+                    }
+                }
+                break;
+            default:
+            scalar:
+                next = Vec{} + op.next;
+                has_next = true;
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    if (m[lane] != 0) {
+                        Address next_pc = op.next;
+                        if (exec_scalar(lane, op, next_pc)) {
+                            leaving[lane] = ~0u;
+                            any_leaving = true;
+                        }
+                        next[lane] = next_pc;
+                    }
+                }
+                break;
+        }
+
+        if (any_leaving) {
+            for (size_t lane = 0; lane < Lanes; ++lane) {
+                if (leaving[lane] != 0) {
+                    pc_[lane] = has_next ? next[lane] : op.next;
+                    retired_[lane] += i + 1;
+                    m[lane] = 0;
+                    leaving[lane] = 0;
+                    leave(lane);
+                }
+            }
+            if (none(m)) {
+                return false;
+            }
+            converged = false;
+        }
+
+        if (i + 1 == count) {
+            if (!has_next) {
+                next = Vec{} + op.next;
+            }
+            for (size_t lane = 0; lane < Lanes; ++lane) {
+                if (m[lane] != 0) {
+                    pc_[lane] = next[lane];
+                    retired_[lane] += count;
+                }
+            }
+            if (converged) {
+                // Still together if every lane goes to the same place.
+                pc = next[0];
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    if (m[lane] != 0) {
+                        pc = next[lane];
+                        break;
+                    }
+                }
+                converged = none((next ^ pc) & m);
+            }
+        }
+    }
+    return converged;
+}
+
+template <size_t Lanes>
+bool Lockstep<Lanes>::exec_scalar(size_t lane, const DecodedOp &op, Address &next_pc) {
+    CPU &cpu = *cpus_[lane];
+    for (size_t r = 0; r < kNumberOfRegisters; ++r) {
+        cpu.regs_[r] = regs_[r][lane];
+    }
+
+    bool code = false;
+    if (op.kind == DecodedInstr::stp) {
+        const Address addr = cpu.regs_[op.rs] + op.imm;
+        code = stores_to_code(lane, addr) || stores_to_code(lane, addr + kInstructionBytes);
+    } else if (op.kind == DecodedInstr::syscall) {
+        // These store [x1, x1 + x2) through the lane's CPU, which drops
+        // only its own blocks, not the ones every lane shares.
+        switch (static_cast<Syscall>(op.imm)) {
+            case Syscall::read:
+            case Syscall::memcpy:
+            case Syscall::memset: {
+                const uint64_t size = std::min<uint64_t>(cpu.regs_[2], GuestMemory::kSpaceBytes - cpu.regs_[1]);
+                code = size != 0 && blocks_.overlaps(cpu.regs_[1], size);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    cpu.pc_ = op.pc;
+    (cpu.*op.handler)(op, next_pc);
+
+    for (size_t r = 0; r < kNumberOfRegisters; ++r) {
+        regs_[r][lane] = cpu.regs_[r];
+    }
+    return cpu.halted_ || code;
+}
+
+template <size_t Lanes>
+bool Lockstep<Lanes>::stores_to_code(size_t lane, Address addr) const {
+    return (cpus_[lane]->memory_.flags_of_word(addr) & kPageCode) != 0
+        && blocks_.overlaps(addr, sizeof(Register));
+}
+
+template <size_t Lanes>
+void Lockstep<Lanes>::leave(size_t lane) {
+    CPU &cpu = *cpus_[lane];
+    for (size_t r = 0; r < kNumberOfRegisters; ++r) {
+        cpu.regs_[r] = regs_[r][lane];
+    }
+    cpu.pc_ = pc_[lane];
+    cpu.retired_ = retired_[lane];
+    live_[lane] = false;
+    --live_count_;
+}
+
+#else
+
+template <size_t Lanes>
+void Lockstep<Lanes>::run(CPU *const *cpus, size_t count) {
+    // No vector extensions: run the lanes one after another.
+    for (size_t lane = 0; lane < count; ++lane) {
+        cpus[lane]->run();
+    }
+}
+
+#endif
+
+template class Lockstep<8>;
+template class Lockstep<16>;
+
+} // namespace Sim
@@ -0,0 +1,91 @@
+#ifndef LOCKSTEP_HPP_
+#define LOCKSTEP_HPP_
+
+#include "config.hpp"
+#include "block_cache.hpp"
+#include "cpu.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Sim {
+
+#if defined(__GNUC__)
+template <size_t Lanes> struct LaneVector;
+
+template <> struct LaneVector<8> {
+    typedef uint32_t Unsigned __attribute__((vector_size(32)));
+    typedef int32_t Signed __attribute__((vector_size(32)));
+};
+
+template <> struct LaneVector<16> {
+    typedef uint32_t Unsigned __attribute__((vector_size(64)));
+    typedef int32_t Signed __attribute__((vector_size(64)));
+};
+#endif
+
+// Runs up to Lanes CPUs that share a program in lockstep. Registers are
+// kept structure-of-arrays, one vector per guest register, so each
+// decoded instruction is dispatched once for all lanes and the ALU ops
+// become host vector operations (SSE2 by default; AVX2/AVX-512 when the
+// compiler is allowed to use them).
+//
+// Each step runs the block at the lowest pc any lane is waiting at, for
+// the lanes waiting there; the rest are masked off. Loops reconverge on
+// their own this way. A lane that stays masked off for kMaxIdle steps,
+// stores into code, or finds different code than the others at a new
+// block is handed back to its CPU, which then runs it to completion with
+// its own engine. Every lane ends in exactly the state its CPU would
+// have reached running alone.
+//
+// Memory and syscalls stay per lane: every lane owns its CPU's guest
+// memory and output stream.
+template <size_t Lanes>
+class Lockstep {
+public:
+    static constexpr uint32_t kMaxIdle = 64;
+
+#if defined(__GNUC__)
+private:
+    using Vec = typename LaneVector<Lanes>::Unsigned;
+    using SVec = typename LaneVector<Lanes>::Signed;
+
+    CPU *cpus_[Lanes];
+    Vec regs_[kNumberOfRegisters];
+    Address pc_[Lanes];
+    uint64_t retired_[Lanes];
+    uint32_t idle_[Lanes];
+    bool live_[Lanes];
+    size_t live_count_;
+    BlockCache blocks_;
+
+    const BasicBlock *block_at(Address pc);
+    template <bool Masked>
+    // Runs block for the lanes in active. Returns whether all of them
+    // are still live and have moved on to the same pc, stored in pc.
+    bool exec_block(const BasicBlock &block, const Vec &active, Address &pc);
+    bool exec_scalar(size_t lane, const DecodedOp &op, Address &next_pc);
+    bool stores_to_code(size_t lane, Address addr) const;
+    void leave(size_t lane);
+
+    static bool none(const Vec &v) {
+        Register any = 0;
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            any |= v[lane];
+        }
+        return any == 0;
+    }
+#endif
+
+public:
+    // Runs the given CPUs (count <= Lanes), each already reset, loaded
+    // and pointed at its entry, until every one of them has halted.
+    void run(CPU *const *cpus, size_t count);
+};
+
+extern template class Lockstep<8>;
+extern template class Lockstep<16>;
+
+} // namespace Sim
+
+#endif // LOCKSTEP_HPP_
@@ -0,0 +1,112 @@
+#include "machine.hpp"
+
+#include <cstring>
+#include <iostream>
+
+namespace Sim {
+
+Machine::Machine(CPU &boot, size_t max_harts)
+    : boot_(boot),
+    max_harts_(max_harts == 0 ? 1 : max_harts),
+    running_(0),
+    waiting_(0),
+    barrier_generation_(0),
+    code_stores_(0)
+{}
+
+Machine::~Machine() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        all_halted_.wait(lock, [this] { return running_ == 0; });
+    }
+    for (std::thread &thread : threads_) {
+        thread.join();
+    }
+    boot_.machine_ = nullptr;
+    boot_.output_.set_lock(nullptr);
+}
+
+void Machine::run() {
+    boot_.machine_ = this;
+    boot_.hart_id_ = 0;
+    boot_.code_stores_seen_ = code_stores();
+    boot_.output_.set_lock(&output_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++running_;
+    }
+    run_hart(boot_);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    all_halted_.wait(lock, [this] { return running_ == 0; });
+}
+
+size_t Machine::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return harts_.size() + 1;
+}
+
+void Machine::run_hart(CPU &cpu) {
+    cpu.run();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    --running_;
+    // The harts still in a barrier may have been waiting for this one.
+    if (waiting_ != 0 && waiting_ == running_) {
+        release_barrier();
+    }
+    if (running_ == 0) {
+        all_halted_.notify_all();
+    }
+}
+
+Register Machine::spawn(CPU &parent, Address entry) {
+    // What the parent printed comes before anything the new hart does.
+    parent.output_.flush();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (harts_.size() + 1 >= max_harts_) {
+        return kNoHart;
+    }
+
+    const Register id = static_cast<Register>(harts_.size() + 1);
+    auto cpu = std::make_unique<CPU>(parent.shared_memory_);
+    std::memcpy(cpu->regs_, parent.regs_, sizeof(cpu->regs_));
+    cpu->regs_[0] = 0;
+    cpu->pc_ = entry;
+    cpu->halted_ = false;
+    cpu->retired_ = 0;
+    cpu->engine_ = parent.engine_;
+    cpu->output_.set_stream(parent.output_.stream());
+    cpu->output_.set_lock(&output_mutex_);
+    cpu->output_.set_raw(parent.output_.raw());
+    cpu->in_ = parent.in_;
+    cpu->diag_ = parent.diag_;
+    cpu->machine_ = this;
+    cpu->hart_id_ = id;
+    cpu->code_stores_seen_ = code_stores();
+
+    // A new hart has to reach the barriers the others are waiting in.
+    ++running_;
+    harts_.push_back(std::move(cpu));
+    threads_.emplace_back(&Machine::run_hart, this, std::ref(*harts_.back()));
+    return id;
+}
+
+void Machine::barrier() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t generation = barrier_generation_;
+    if (++waiting_ == running_) {
+        release_barrier();
+        return;
+    }
+    barrier_done_.wait(lock, [this, generation] { return barrier_generation_ != generation; });
+}
+
+void Machine::release_barrier() {
+    waiting_ = 0;
+    ++barrier_generation_;
+    barrier_done_.notify_all();
+}
+
+} // namespace Sim
@@ -0,0 +1,98 @@
+#ifndef MACHINE_HPP_
+#define MACHINE_HPP_
+
+#include "config.hpp"
+#include "cpu.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sim {
+
+// Several harts sharing one guest address space, each running on its
+// own host thread. The program starts on hart 0, a CPU set up as usual,
+// and further harts come from the spawn syscall (see Syscall).
+//
+// Memory model, for every engine:
+//  - an aligned ld or st is single-copy atomic: other harts see all of
+//    the word or none of it. stp is two such stores, not one.
+//  - between synchronisation points a hart's accesses may become
+//    visible to other harts in any order, and may race; nothing orders
+//    one hart's ld against another's st.
+//  - barrier is a full fence: everything a hart did before a barrier
+//    happens before everything any hart does after it. spawn is a
+//    release: the new hart sees everything its parent did before.
+//  - instruction fetch: code stored by another hart is only
+//    guaranteed to be seen after a barrier.
+//
+// A hart that faults or halts stops alone; the others carry on, and
+// barriers stop waiting for it. Snapshots, tracing and profiling are
+// single-hart features and are not supported on a Machine.
+class Machine {
+private:
+    CPU &boot_;
+    size_t max_harts_;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<CPU>> harts_;     // spawned; hart i + 1
+    std::vector<std::thread> threads_;
+    std::condition_variable barrier_done_;
+    std::condition_variable all_halted_;
+    size_t running_;
+    size_t waiting_;                // running harts inside barrier()
+    uint64_t barrier_generation_;
+
+    std::atomic<uint64_t> code_stores_;
+
+    std::mutex output_mutex_;   // held by harts flushing their output
+    std::mutex input_mutex_;    // held by a hart in the read syscall
+
+    void run_hart(CPU &cpu);
+    void release_barrier();
+
+    // Called by CPU::exec_syscall and CPU::write.
+    Register spawn(CPU &parent, Address entry);
+    void barrier();
+    void code_stored() {
+        code_stores_.fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t code_stores() const {
+        return code_stores_.load(std::memory_order_relaxed);
+    }
+
+    friend class CPU;
+
+public:
+    // boot is hart 0, loaded and ready to run. Every hart shares its
+    // output and input; each hart buffers its own output, and flushes
+    // it at barriers and spawns.
+    Machine(CPU &boot, size_t max_harts);
+
+    // Waits for every hart to halt.
+    ~Machine();
+
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+    // Runs hart 0 on the calling thread, and returns once every hart
+    // has halted.
+    void run();
+
+    // Harts started so far, hart 0 included.
+    size_t size();
+
+    // Hart id's CPU; only safe to look at once run() has returned.
+    const CPU &hart(size_t id) const {
+        return id == 0 ? boot_ : *harts_[id - 1];
+    }
+};
+
+} // namespace Sim
+
+#endif // MACHINE_HPP_
@@ -0,0 +1,83 @@
+#include "profiler.hpp"
+
+#include <ostream>
+#include <string>
+#include <utility>
+
+namespace Sim {
+
+namespace {
+
+// The return address of the outermost frame, which never returns.
+constexpr Address kNoReturn = 0xFFFF'FFFF;
+
+} // namespace
+
+StackProfiler::StackProfiler(SymbolTable symbols, uint64_t period)
+    : symbols_(std::move(symbols)),
+    period_(period == 0 ? kDefaultPeriod : period),
+    countdown_(period_)
+{}
+
+void StackProfiler::enter(Address pc) {
+    if (stack_.empty()) {
+        stack_.push_back(Frame{symbols_.find(pc), kNoReturn});
+    }
+    const bool jumped = jumped_;
+    jumped_ = false;
+
+    for (size_t depth = stack_.size(); depth-- > 1;) {
+        if (stack_[depth].return_to == pc) {
+            stack_.resize(depth);
+            return;
+        }
+    }
+    if (!jumped) {
+        return;
+    }
+
+    const uint32_t callee = symbols_.starting_at(pc);
+    if (callee == SymbolTable::kNone) {
+        return;
+    }
+    for (size_t depth = stack_.size(); depth-- > 0;) {
+        if (stack_[depth].symbol == callee) {
+            stack_.resize(depth + 1);
+            return;
+        }
+    }
+    if (stack_.size() < kMaxDepth) {
+        stack_.push_back(Frame{callee, static_cast<Address>(jump_pc_ + kInstructionBytes)});
+    }
+}
+
+void StackProfiler::sample(Address pc) {
+    countdown_ = period_;
+    ++taken_;
+
+    scratch_.clear();
+    for (const Frame &frame : stack_) {
+        scratch_.push_back(frame.symbol);
+    }
+    const uint32_t leaf = symbols_.find(pc);
+    if (scratch_.empty() || scratch_.back() != leaf) {
+        scratch_.push_back(leaf);
+    }
+    ++samples_[scratch_];
+}
+
+void StackProfiler::write(std::ostream &out) const {
+    for (const auto &entry : samples_) {
+        bool first = true;
+        for (uint32_t symbol : entry.first) {
+            if (!first) {
+                out << ";";
+            }
+            first = false;
+            out << (symbol == SymbolTable::kNone ? std::string("[unknown]") : symbols_[symbol].name);
+        }
+        out << " " << entry.second << "\n";
+    }
+}
+
+} // namespace Sim
@@ -0,0 +1,85 @@
+#ifndef PROFILER_HPP_
+#define PROFILER_HPP_
+
+#include "config.hpp"
+#include "block_cache.hpp"
+#include "instructions.hpp"
+#include "symbols.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <vector>
+
+namespace Sim {
+
+// Instrumentation policy for --profile-stacks: every period retired
+// instructions it records the guest's call stack as labels of a
+// SymbolTable, for collapsed-stack output that flamegraph tools read.
+//
+// The ISA has no call instruction, so calls are inferred from the usual
+// convention: a j to a label calls it, and the call returns once control
+// reaches the instruction after that j again, by a j or a branch. A j to
+// a label already on the stack unwinds to it, so loops closed by j do
+// not grow the stack. The leaf of each sample is the label the sampled
+// pc falls under, when that is not the routine on top of the stack.
+class StackProfiler {
+public:
+    static constexpr bool kEnabled = false;
+    static constexpr uint64_t kDefaultPeriod = 997;
+    static constexpr size_t kMaxDepth = 128;
+
+private:
+    struct Frame {
+        uint32_t symbol;
+        Address return_to;
+    };
+
+    SymbolTable symbols_;
+    uint64_t period_;
+    uint64_t countdown_;
+    uint64_t taken_ = 0;
+    std::vector<Frame> stack_;
+    bool jumped_ = false;       // the last block ended in a j
+    Address jump_pc_ = 0;
+    std::map<std::vector<uint32_t>, uint64_t> samples_;
+    std::vector<uint32_t> scratch_;
+
+    // Updates the stack on entering a block at pc.
+    void enter(Address pc);
+    void sample(Address pc);
+
+public:
+    StackProfiler(SymbolTable symbols, uint64_t period = kDefaultPeriod);
+
+    void on_block(const BasicBlock &block) {
+        if (jumped_ || stack_.empty() || block.start == stack_.back().return_to) {
+            enter(block.start);
+        }
+    }
+
+    void on_load(const DecodedOp &, Address) {}
+    void on_store(const DecodedOp &, Address) {}
+
+    void on_retire(const DecodedOp &op, Address) {
+        if (op.kind == DecodedInstr::j) {
+            jumped_ = true;
+            jump_pc_ = op.pc;
+        }
+        if (--countdown_ == 0) {
+            sample(op.pc);
+        }
+    }
+
+    uint64_t samples() const {
+        return taken_;
+    }
+
+    // One "outer;...;leaf count" line per distinct stack.
+    void write(std::ostream &out) const;
+};
+
+} // namespace Sim
+
+#endif // PROFILER_HPP_
@@ -0,0 +1,110 @@
+#include "program_image.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+namespace Sim {
+
+namespace {
+
+// Copies size bytes of fd into a sealed in-memory file; -1 on failure.
+// CPUs map the copy, not the file itself: a file truncated on disk
+// would fault the run with SIGBUS, and one rewritten in place would
+// change pages the guest has not touched yet.
+int sealed_copy(int fd, size_t size) {
+    int copy = memfd_create("toy_image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (copy < 0) {
+        return -1;
+    }
+    void *mem = ftruncate(copy, static_cast<off_t>(size)) == 0
+        ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, copy, 0)
+        : MAP_FAILED;
+    if (mem == MAP_FAILED) {
+        close(copy);
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, static_cast<Byte*>(mem) + done, size - done, static_cast<off_t>(done));
+        if (n <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    munmap(mem, size);
+    if (done != size || fcntl(copy, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        close(copy);
+        return -1;
+    }
+    return copy;
+}
+
+} // namespace
+
+ProgramImage::~ProgramImage() {
+    close(fd_);
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::open(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "CPU: Error in load program - cannot open file: " << path << "\n";
+        return nullptr;
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        std::cerr << "CPU: Error in load programm - wrong file size (" << st.st_size << ").\n";
+        close(fd);
+        return nullptr;
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    int copy = sealed_copy(fd, size);
+    close(fd);
+    if (copy < 0) {
+        std::cerr << "CPU: Error in load program - cannot read file: " << path << "\n";
+        return nullptr;
+    }
+    return std::shared_ptr<const ProgramImage>(new ProgramImage(copy, size, path));
+}
+
+bool ProgramImage::load_into(GuestMemory &memory, Address base) const {
+    if (static_cast<uint64_t>(base) + size_ > GuestMemory::kSpaceBytes) {
+        std::cerr << "CPU: Error in load program - image does not fit at 0x" << std::hex << base << std::dec << "\n";
+        return false;
+    }
+
+    // Whole pages of a page-aligned image are mapped copy-on-write from
+    // the sealed copy; whatever is left has to be copied in. pread keeps no file offset,
+    // so concurrent loads do not interfere.
+    size_t done = memory.map_file(fd_, base, size_);
+    while (done < size_) {
+        ssize_t n = pread(fd_, memory.data() + base + done, size_ - done, static_cast<off_t>(done));
+        if (n <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+
+    if (done != size_) {
+        std::cerr << "CPU: Error in load program - cannot read file: " << path_ << "\n";
+        return false;
+    }
+    return true;
+}
+
+uint64_t program_hash(const Byte *bytes, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+} // namespace Sim
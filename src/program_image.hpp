@@ -0,0 +1,59 @@
+#ifndef PROGRAM_IMAGE_HPP_
+#define PROGRAM_IMAGE_HPP_
+
+#include "config.hpp"
+#include "guest_memory.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+namespace Sim {
+
+// A program or data file read once, into a sealed in-memory copy, and
+// placed into any number of guest memories. Whole pages of the copy are
+// mapped copy-on-write, so every CPU loading the same image shares them
+// until it writes them, and changing the file afterwards affects no
+// run. The image itself is never modified and load_into() may be
+// called from several threads at once.
+class ProgramImage {
+private:
+    int fd_;
+    size_t size_;
+    std::filesystem::path path_;
+
+    ProgramImage(int fd, size_t size, const std::filesystem::path &path)
+        : fd_(fd),
+        size_(size),
+        path_(path)
+    {}
+
+public:
+    ~ProgramImage();
+
+    ProgramImage(const ProgramImage &) = delete;
+    ProgramImage &operator=(const ProgramImage &) = delete;
+
+    // Returns nullptr (and reports why) if the file cannot be opened or
+    // read, or is empty.
+    static std::shared_ptr<const ProgramImage> open(const std::filesystem::path &path);
+
+    bool load_into(GuestMemory &memory, Address base) const;
+
+    size_t size() const {
+        return size_;
+    }
+
+    const std::filesystem::path &path() const {
+        return path_;
+    }
+};
+
+// 64-bit FNV-1a of a program's bytes; names programs in the job server
+// and assembled sources in the --asm cache.
+uint64_t program_hash(const Byte *bytes, size_t size);
+
+} // namespace Sim
+
+#endif // PROGRAM_IMAGE_HPP_
@@ -0,0 +1,129 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+
+namespace Sim {
+
+Scheduler::Scheduler(size_t threads, uint64_t quantum)
+    : quantum_(quantum == 0 ? kDefaultQuantum : quantum),
+    pending_(0),
+    pass_(0),
+    sequence_(0),
+    slices_(0),
+    preemptions_(0),
+    stopping_(false)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back(&Scheduler::work, this);
+    }
+}
+
+Scheduler::~Scheduler() {
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &thread : threads_) {
+        thread.join();
+    }
+}
+
+void Scheduler::spawn(GuestJob job) {
+    auto context = std::make_unique<Context>();
+    context->job = std::move(job);
+    context->job.priority = std::min(context->job.priority, GuestJob::kPriorities - 1);
+    context->cpu = nullptr;
+    context->end = UINT64_MAX;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        context->pass = pass_;
+        context->sequence = sequence_++;
+        ++pending_;
+        ready_.push_back(std::move(context));
+        std::push_heap(ready_.begin(), ready_.end(), Later());
+    }
+    wake_.notify_one();
+}
+
+bool Scheduler::slice(Context &context) {
+    if (context.cpu == nullptr) {
+        context.cpu = context.job.start();
+        if (context.cpu == nullptr) {
+            return true;
+        }
+        const uint64_t retired = context.cpu->get_retired();
+        if (context.job.budget != 0 && context.job.budget < UINT64_MAX - retired) {
+            context.end = retired + context.job.budget;
+        }
+    }
+
+    CPU &cpu = *context.cpu;
+    const uint64_t before = cpu.get_retired();
+    cpu.run_for(std::min(quantum_, context.end - before));
+    if (cpu.is_halted() || cpu.get_retired() >= context.end) {
+        context.job.finish(cpu);
+        return true;
+    }
+
+    const uint64_t ran = std::max<uint64_t>(cpu.get_retired() - before, 1);
+    context.pass += ran << (GuestJob::kPriorities - 1 - context.job.priority);
+    return false;
+}
+
+void Scheduler::work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        wake_.wait(lock, [this] { return stopping_ || !ready_.empty(); });
+        if (ready_.empty()) {
+            return;
+        }
+        std::pop_heap(ready_.begin(), ready_.end(), Later());
+        std::unique_ptr<Context> context = std::move(ready_.back());
+        ready_.pop_back();
+        pass_ = std::max(pass_, context->pass);
+        ++slices_;
+        lock.unlock();
+
+        const bool done = slice(*context);
+        if (done) {
+            // The job's callbacks may own a lot; free them unlocked.
+            context.reset();
+        }
+
+        lock.lock();
+        if (!done) {
+            ++preemptions_;
+            ready_.push_back(std::move(context));
+            std::push_heap(ready_.begin(), ready_.end(), Later());
+        } else if (--pending_ == 0) {
+            idle_.notify_all();
+        }
+    }
+}
+
+void Scheduler::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+}
+
+uint64_t Scheduler::slices() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return slices_;
+}
+
+uint64_t Scheduler::preemptions() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return preemptions_;
+}
+
+} // namespace Sim
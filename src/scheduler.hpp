@@ -0,0 +1,123 @@
+#ifndef SCHEDULER_HPP_
+#define SCHEDULER_HPP_
+
+#include "config.hpp"
+#include "cpu.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sim {
+
+// A guest to run under the Scheduler.
+struct GuestJob {
+    static constexpr unsigned kPriorities = 8;
+    static constexpr unsigned kDefaultPriority = 3;
+
+    // Runs on a worker before the first slice and returns the CPU to
+    // run, or nullptr if the job cannot start (finish is not called).
+    std::function<CPU*()> start;
+    // Runs on the worker of the last slice once the guest has halted
+    // or used its budget; the CPU is the caller's again from then on.
+    std::function<void(CPU &cpu)> finish;
+    uint64_t budget = 0;                    // instructions; 0: until halted
+    unsigned priority = kDefaultPriority;   // 0 .. kPriorities - 1
+};
+
+// Runs any number of guests on a fixed set of host threads, one
+// quantum of instructions at a time, so a guest that runs long or never
+// halts only ever holds a thread for a quantum.
+//
+// Guests are picked by stride scheduling: each has a pass that grows by
+// the instructions it retires divided by its weight, and the guest with
+// the lowest pass runs next. Each priority step doubles the weight, and
+// so the share of the threads a guest gets while others are waiting. A
+// new guest starts at the pass of the guest dispatched last and wins
+// ties, which puts it at the front of the queue without letting it make
+// up for time it was not waiting. Runnable guests sit in one queue
+// shared by all threads, so a guest resumes on whichever thread frees
+// up first.
+class Scheduler {
+public:
+    static constexpr uint64_t kDefaultQuantum = 100000;
+
+private:
+    struct Context {
+        GuestJob job;
+        CPU *cpu;
+        uint64_t end;       // retired count at which the budget is used up
+        uint64_t pass;
+        uint64_t sequence;  // order of spawning
+    };
+
+    // Ties in pass go to guests that have not run yet, then to the
+    // oldest.
+    struct Later {
+        bool operator()(const std::unique_ptr<Context> &a, const std::unique_ptr<Context> &b) const {
+            if (a->pass != b->pass) {
+                return a->pass > b->pass;
+            }
+            if ((a->cpu == nullptr) != (b->cpu == nullptr)) {
+                return a->cpu != nullptr;
+            }
+            return a->sequence > b->sequence;
+        }
+    };
+
+    uint64_t quantum_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::vector<std::unique_ptr<Context>> ready_;   // heap on Later
+    size_t pending_;        // spawned and not finished yet
+    uint64_t pass_;         // pass of the guest dispatched last
+    uint64_t sequence_;
+    uint64_t slices_;
+    uint64_t preemptions_;
+    bool stopping_;
+
+    void work();
+    // Runs one slice of context; true once the guest is done.
+    bool slice(Context &context);
+
+public:
+    // 0 threads means one per hardware thread; quantum is in guest
+    // instructions.
+    explicit Scheduler(size_t threads = 0, uint64_t quantum = kDefaultQuantum);
+
+    // Runs every spawned guest to the end before joining the threads.
+    ~Scheduler();
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    size_t size() const {
+        return threads_.size();
+    }
+
+    uint64_t quantum() const {
+        return quantum_;
+    }
+
+    void spawn(GuestJob job);
+
+    // Blocks until every spawned guest has finished.
+    void wait_idle();
+
+    // Slices run so far, and how many of them ended with the guest
+    // still running and put back in the queue.
+    uint64_t slices();
+    uint64_t preemptions();
+};
+
+} // namespace Sim
+
+#endif // SCHEDULER_HPP_
@@ -0,0 +1,636 @@
+#include "server.hpp"
+#include "cli.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace Sim {
+
+namespace {
+
+// Longest request line; a hex program takes two characters per byte.
+constexpr size_t kMaxLineBytes = 64u << 20;
+constexpr size_t kReadChunk = 64u << 10;
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t micros(Clock::duration d) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+}
+
+bool decode_hex(const std::string &text, std::vector<Byte> &bytes) {
+    if (text.empty() || text.size() % 2 != 0) {
+        return false;
+    }
+    bytes.resize(text.size() / 2);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        const char *pair = text.data() + 2 * i;
+        if (std::from_chars(pair, pair + 2, bytes[i], kBaseOfNumSys16).ptr != pair + 2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string hash_text(uint64_t hash) {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+    return text;
+}
+
+bool parse_hash(const std::string &text, uint64_t &hash) {
+    return text.size() == 16
+        && std::from_chars(text.data(), text.data() + text.size(), hash, kBaseOfNumSys16).ptr
+            == text.data() + text.size();
+}
+
+bool parse_count(const std::string &text, uint64_t &value) {
+    return !text.empty()
+        && std::from_chars(text.data(), text.data() + text.size(), value, kBaseOfNumSys10).ptr
+            == text.data() + text.size();
+}
+
+bool parse_engine(const std::string &name, Engine &engine) {
+    if (name == "block") {
+        engine = Engine::block;
+    } else if (name == "threaded") {
+        engine = Engine::threaded;
+    } else if (name == "jit") {
+        engine = Engine::jit;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *status_name(const CPU &cpu) {
+    if (!cpu.is_halted()) {
+        return "budget";
+    }
+    switch (cpu.get_fault()) {
+        case Fault::misaligned_access:
+            return "misaligned_access";
+        case Fault::unknown_instruction:
+            return "unknown_instruction";
+        case Fault::unknown_syscall:
+            return "unknown_syscall";
+        case Fault::none:
+            break;
+    }
+    return "halted";
+}
+
+std::string error_reply(const std::string &id, const std::string &error) {
+    std::string text = "{";
+    if (!id.empty()) {
+        text += "\"id\":";
+        append_json_string(text, id);
+        text += ',';
+    }
+    text += "\"error\":";
+    append_json_string(text, error);
+    text += '}';
+    return text;
+}
+
+} // namespace
+
+//------------------ latency histogram ----------------
+void LatencyHistogram::add(uint64_t us) {
+    size_t bucket = 0;
+    while (bucket + 1 < kBuckets && (us >> bucket) != 0) {
+        ++bucket;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (us > seen && !max_.compare_exchange_weak(seen, us, std::memory_order_relaxed)) {
+    }
+}
+
+LatencyHistogram::Counts LatencyHistogram::counts() const {
+    Counts counts{};
+    for (size_t i = 0; i < kBuckets; ++i) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+uint64_t LatencyHistogram::percentile(const Counts &counts, double p) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    const double wanted = p * static_cast<double>(total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        seen += counts[i];
+        if (static_cast<double>(seen) >= wanted) {
+            return i == 0 ? 0 : (uint64_t{1} << i) - 1;
+        }
+    }
+    return (uint64_t{1} << (kBuckets - 1)) - 1;
+}
+
+//------------------ server state ---------------------
+class Server::Connection {
+private:
+    int fd_;
+    std::mutex mutex_;
+
+public:
+    explicit Connection(int fd)
+        : fd_(fd)
+    {}
+
+    ~Connection() {
+        close(fd_);
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    // Writes line and a newline; false once the peer has gone.
+    bool send(const std::string &line) {
+        std::string text = line + '\n';
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t n = ::send(fd_, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Ends reading but lets queued results still go out.
+    void stop_reading() {
+        ::shutdown(fd_, SHUT_RD);
+    }
+};
+
+struct Server::Job {
+    std::shared_ptr<Connection> connection;
+    std::shared_ptr<const ServedProgram> program;
+    std::string id;
+    Engine engine;
+    uint64_t budget;    // 0: run until halted
+    unsigned priority;
+    std::vector<std::pair<Register_idx, Register>> registers;
+    Clock::time_point queued;
+
+    // Set once the job gets its first slice.
+    Clock::time_point started;
+    Warm warm;
+    std::ostringstream output;
+    std::ostringstream diagnostics;
+};
+
+// Counter values at a connection's previous stats request.
+struct Server::Totals {
+    Clock::time_point at;
+    uint64_t jobs = 0;
+    uint64_t instructions = 0;
+    LatencyHistogram::Counts queue{};
+    LatencyHistogram::Counts run{};
+};
+
+Server::Server(ServerOptions options)
+    : options_(std::move(options)),
+    listen_fd_(-1),
+    wake_fd_{-1, -1},
+    stopping_(false),
+    readers_(0),
+    started_(Clock::now())
+{
+    if (options_.cache == 0) {
+        options_.cache = 1;
+    }
+}
+
+Server::~Server() {
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+    }
+    for (int fd : wake_fd_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+//------------------ programs -------------------------
+std::shared_ptr<const ServedProgram> Server::store(std::vector<Byte> bytes, std::string &error) {
+    const uint64_t hash = program_hash(bytes.data(), bytes.size());
+    std::lock_guard<std::mutex> lock(programs_mutex_);
+
+    auto it = program_index_.find(hash);
+    if (it != program_index_.end()) {
+        if ((*it->second)->bytes != bytes) {
+            error = "hash collision with a stored program";
+            return nullptr;
+        }
+        programs_.splice(programs_.begin(), programs_, it->second);
+        return programs_.front();
+    }
+
+    programs_.push_front(std::make_shared<const ServedProgram>(ServedProgram{hash, std::move(bytes)}));
+    program_index_[hash] = programs_.begin();
+    if (programs_.size() > options_.cache) {
+        program_index_.erase(programs_.back()->hash);
+        programs_.pop_back();
+    }
+    return programs_.front();
+}
+
+std::shared_ptr<const ServedProgram> Server::find(uint64_t hash) {
+    std::lock_guard<std::mutex> lock(programs_mutex_);
+    auto it = program_index_.find(hash);
+    if (it == program_index_.end()) {
+        return nullptr;
+    }
+    programs_.splice(programs_.begin(), programs_, it->second);
+    return programs_.front();
+}
+
+//------------------ requests -------------------------
+void Server::serve(std::shared_ptr<Connection> connection) {
+    Totals last;
+    last.at = started_;
+
+    std::string buffer;
+    std::vector<char> chunk(kReadChunk);
+    for (;;) {
+        ssize_t n = recv(connection->fd(), chunk.data(), chunk.size(), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        buffer.append(chunk.data(), static_cast<size_t>(n));
+
+        size_t begin = 0;
+        for (size_t end; (end = buffer.find('\n', begin)) != std::string::npos; begin = end + 1) {
+            std::string line = buffer.substr(begin, end - begin);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            handle(connection, line, last);
+        }
+        buffer.erase(0, begin);
+
+        if (buffer.size() > kMaxLineBytes) {
+            connection->send(error_reply("", "request line too long"));
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (--readers_ == 0) {
+        readers_done_.notify_all();
+    }
+}
+
+void Server::handle(const std::shared_ptr<Connection> &connection, const std::string &line, Totals &last) {
+    std::istringstream tokens(line);
+    std::string command;
+    if (!(tokens >> command) || command[0] == '#') {
+        return;
+    }
+
+    if (command == "run") {
+        submit(connection, tokens);
+    } else if (command == "load") {
+        std::string hex;
+        std::vector<Byte> bytes;
+        std::string error = "bad hex program";
+        std::shared_ptr<const ServedProgram> program;
+        if (tokens >> hex && decode_hex(hex, bytes)) {
+            program = store(std::move(bytes), error);
+        }
+        if (program == nullptr) {
+            errors_.fetch_add(1, std::memory_order_relaxed);
+            connection->send(error_reply("", error));
+            return;
+        }
+        connection->send("{\"loaded\":\"" + hash_text(program->hash)
+                         + "\",\"bytes\":" + std::to_string(program->bytes.size()) + "}");
+    } else if (command == "stats") {
+        connection->send(stats(last));
+    } else if (command == "shutdown") {
+        connection->send("{\"shutdown\":true}");
+        stop();
+    } else {
+        errors_.fetch_add(1, std::memory_order_relaxed);
+        connection->send(error_reply("", "unknown request: " + command));
+    }
+}
+
+void Server::submit(const std::shared_ptr<Connection> &connection, std::istream &tokens) {
+    auto job = std::make_shared<Job>();
+    job->connection = connection;
+    job->engine = options_.engine;
+    job->budget = 0;
+    job->priority = GuestJob::kDefaultPriority;
+
+    std::string error;
+    std::string token;
+    while (error.empty() && tokens >> token) {
+        if (token.rfind("id=", 0) == 0) {
+            job->id = token.substr(3);
+        } else if (token.rfind("program=hex:", 0) == 0) {
+            std::vector<Byte> bytes;
+            if (!decode_hex(token.substr(12), bytes)) {
+                error = "bad hex program";
+            } else {
+                job->program = store(std::move(bytes), error);
+            }
+        } else if (token.rfind("program=", 0) == 0) {
+            uint64_t hash = 0;
+            if (!parse_hash(token.substr(8), hash)) {
+                error = "bad program hash: " + token.substr(8);
+            } else if ((job->program = find(hash)) == nullptr) {
+                error = "unknown program: " + token.substr(8);
+            }
+        } else if (token.rfind("engine=", 0) == 0) {
+            if (!parse_engine(token.substr(7), job->engine)) {
+                error = "unknown engine: " + token.substr(7);
+            }
+        } else if (token.rfind("budget=", 0) == 0) {
+            if (!parse_count(token.substr(7), job->budget)) {
+                error = "bad budget: " + token.substr(7);
+            }
+        } else if (token.rfind("priority=", 0) == 0) {
+            uint64_t priority = 0;
+            if (!parse_count(token.substr(9), priority) || priority >= GuestJob::kPriorities) {
+                error = "bad priority: " + token.substr(9);
+            } else {
+                job->priority = static_cast<unsigned>(priority);
+            }
+        } else {
+            Register_idx idx = 0;
+            Register value = 0;
+            if (parse_register_assignment(token, idx, value, error)) {
+                job->registers.emplace_back(idx, value);
+            }
+        }
+    }
+    if (error.empty() && job->program == nullptr) {
+        error = "no program given";
+    }
+    if (!error.empty()) {
+        errors_.fetch_add(1, std::memory_order_relaxed);
+        connection->send(error_reply(job->id, error));
+        return;
+    }
+
+    job->queued = Clock::now();
+    queued_.fetch_add(1, std::memory_order_relaxed);
+    GuestJob guest;
+    guest.start = [this, job] { return start(*job); };
+    guest.finish = [this, job](CPU &) { finish(*job); };
+    guest.budget = job->budget;
+    guest.priority = job->priority;
+    scheduler_->spawn(std::move(guest));
+}
+
+CPU *Server::start(Job &job) {
+    job.started = Clock::now();
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+
+    // Take an idle CPU that has the program loaded, if there is one. Match
+    // the stored program itself, not its hash: a program evicted and stored
+    // again, or one whose hash collides, is a different object.
+    {
+        std::lock_guard<std::mutex> lock(warm_mutex_);
+        auto warm = std::find_if(warm_.begin(), warm_.end(),
+                                 [&job](const Warm &w) { return w.program == job.program; });
+        if (warm != warm_.end()) {
+            job.warm = std::move(*warm);
+            warm_.erase(warm);
+        }
+    }
+
+    if (job.warm.cpu != nullptr) {
+        job.warm.cpu->set_diagnostics(job.diagnostics);
+        if (job.warm.cpu->restore(job.warm.start)) {
+            warm_hits_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            job.warm.cpu.reset();
+        }
+    }
+    if (job.warm.cpu == nullptr) {
+        job.warm.program = job.program;
+        job.warm.cpu = std::make_unique<CPU>();
+        job.warm.cpu->reset();
+        job.warm.cpu->set_diagnostics(job.diagnostics);
+        if (!job.warm.cpu->load_buffer(job.program->bytes.data(), job.program->bytes.size())) {
+            errors_.fetch_add(1, std::memory_order_relaxed);
+            job.connection->send(error_reply(job.id, "cannot load program"));
+            return nullptr;
+        }
+        job.warm.start = job.warm.cpu->snapshot();
+    }
+
+    CPU &cpu = *job.warm.cpu;
+    cpu.set_output(job.output);
+    cpu.set_engine(job.engine);
+    for (const auto &reg : job.registers) {
+        cpu.set_register(reg.first, reg.second);
+    }
+    return &cpu;
+}
+
+void Server::finish(Job &job) {
+    const Clock::time_point end = Clock::now();
+    CPU &cpu = *job.warm.cpu;
+
+    const uint64_t queue_us = micros(job.started - job.queued);
+    const uint64_t run_us = micros(end - job.started);
+    queue_latency_.add(queue_us);
+    run_latency_.add(run_us);
+    jobs_.fetch_add(1, std::memory_order_relaxed);
+    instructions_.fetch_add(cpu.get_retired(), std::memory_order_relaxed);
+
+    std::string text = "{\"id\":";
+    append_json_string(text, job.id);
+    text += std::string(",\"status\":\"") + status_name(cpu)
+        + "\",\"retired\":" + std::to_string(cpu.get_retired())
+        + ",\"pc\":" + std::to_string(cpu.get_fault() != Fault::none ? cpu.get_fault_pc() : cpu.get_PC())
+        + ",\"regs\":[";
+    for (Register_idx i = 0; i < kNumberOfRegisters; ++i) {
+        if (i != 0) {
+            text += ',';
+        }
+        text += std::to_string(cpu.get_register(i));
+    }
+    text += "],\"output\":";
+    append_json_string(text, job.output.str());
+    if (!job.diagnostics.str().empty()) {
+        text += ",\"diagnostics\":";
+        append_json_string(text, job.diagnostics.str());
+    }
+    text += ",\"queue_us\":" + std::to_string(queue_us) + ",\"run_us\":" + std::to_string(run_us) + "}";
+
+    // Leave the CPU for the next job of this program before replying,
+    // as a client may send that job as soon as it reads the reply.
+    {
+        std::lock_guard<std::mutex> lock(warm_mutex_);
+        warm_.push_front(std::move(job.warm));
+        if (warm_.size() > options_.cache * scheduler_->size()) {
+            warm_.pop_back();
+        }
+    }
+    job.connection->send(text);
+}
+
+std::string Server::stats(Totals &last) {
+    Totals now;
+    now.at = Clock::now();
+    now.jobs = jobs_.load(std::memory_order_relaxed);
+    now.instructions = instructions_.load(std::memory_order_relaxed);
+    now.queue = queue_latency_.counts();
+    now.run = run_latency_.counts();
+
+    LatencyHistogram::Counts queue{};
+    LatencyHistogram::Counts run{};
+    for (size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+        queue[i] = now.queue[i] - last.queue[i];
+        run[i] = now.run[i] - last.run[i];
+    }
+    const double interval = std::chrono::duration<double>(now.at - last.at).count();
+    const double seconds = interval > 0 ? interval : 1;
+
+    size_t programs = 0;
+    {
+        std::lock_guard<std::mutex> lock(programs_mutex_);
+        programs = programs_.size();
+    }
+
+    std::ostringstream out;
+    out << "{\"uptime_s\":" << std::chrono::duration<double>(now.at - started_).count()
+        << ",\"jobs\":" << now.jobs
+        << ",\"errors\":" << errors_.load(std::memory_order_relaxed)
+        << ",\"instructions\":" << now.instructions
+        << ",\"queued\":" << queued_.load(std::memory_order_relaxed)
+        << ",\"programs\":" << programs
+        << ",\"warm_hits\":" << warm_hits_.load(std::memory_order_relaxed)
+        << ",\"preemptions\":" << scheduler_->preemptions()
+        << ",\"interval_s\":" << interval
+        << ",\"jobs_per_s\":" << static_cast<double>(now.jobs - last.jobs) / seconds
+        << ",\"mips\":" << static_cast<double>(now.instructions - last.instructions) / seconds / 1e6
+        << ",\"queue_us_p50\":" << LatencyHistogram::percentile(queue, 0.5)
+        << ",\"queue_us_p99\":" << LatencyHistogram::percentile(queue, 0.99)
+        << ",\"queue_us_max\":" << queue_latency_.max()
+        << ",\"run_us_p50\":" << LatencyHistogram::percentile(run, 0.5)
+        << ",\"run_us_p99\":" << LatencyHistogram::percentile(run, 0.99)
+        << ",\"run_us_max\":" << run_latency_.max()
+        << "}";
+    last = now;
+    return out.str();
+}
+
+//------------------ socket ---------------------------
+void Server::stop() {
+    if (!stopping_.exchange(true)) {
+        const char wake = 1;
+        (void)!write(wake_fd_[1], &wake, 1);
+    }
+}
+
+bool Server::run() {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (options_.socket_path.empty() || options_.socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "server: bad socket path: " << options_.socket_path << "\n";
+        return false;
+    }
+    std::memcpy(address.sun_path, options_.socket_path.c_str(), options_.socket_path.size() + 1);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0 || pipe2(wake_fd_, O_CLOEXEC) != 0) {
+        std::cerr << "server: cannot create socket: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    // A socket file left by an earlier server would make bind fail.
+    unlink(options_.socket_path.c_str());
+    if (bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+        || listen(listen_fd_, SOMAXCONN) != 0) {
+        std::cerr << "server: cannot listen on " << options_.socket_path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    scheduler_ = std::make_unique<Scheduler>(options_.threads, options_.quantum);
+    started_ = Clock::now();
+
+    while (!stopping_) {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fd_[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "server: poll failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        if ((fds[0].revents & POLLIN) == 0) {
+            continue;
+        }
+
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        auto connection = std::make_shared<Connection>(fd);
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        connections_.erase(std::remove_if(connections_.begin(), connections_.end(),
+                                          [](const std::weak_ptr<Connection> &c) { return c.expired(); }),
+                           connections_.end());
+        connections_.push_back(connection);
+        ++readers_;
+        std::thread(&Server::serve, this, std::move(connection)).detach();
+    }
+
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(options_.socket_path.c_str());
+
+    {
+        std::unique_lock<std::mutex> lock(connections_mutex_);
+        for (const std::weak_ptr<Connection> &weak : connections_) {
+            if (std::shared_ptr<Connection> connection = weak.lock()) {
+                connection->stop_reading();
+            }
+        }
+        readers_done_.wait(lock, [this] { return readers_ == 0; });
+    }
+    // Jobs still running use scheduler_ as they finish.
+    scheduler_->wait_idle();
+    scheduler_.reset();
+    warm_.clear();
+    return true;
+}
+
+} // namespace Sim
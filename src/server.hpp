@@ -0,0 +1,159 @@
+#ifndef SERVER_HPP_
+#define SERVER_HPP_
+
+#include "config.hpp"
+#include "cpu.hpp"
+#include "scheduler.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Sim {
+
+struct ServerOptions {
+    std::string socket_path;
+    Engine engine = Engine::block;  // for jobs that do not pick one
+    size_t threads = 0;             // 0: one per hardware thread
+    size_t cache = 16;              // programs kept; warm CPUs kept per thread
+    uint64_t quantum = Scheduler::kDefaultQuantum;  // instructions per time slice
+};
+
+// A program submitted to the server, named by the FNV-1a hash of its
+// bytes.
+struct ServedProgram {
+    uint64_t hash;
+    std::vector<Byte> bytes;
+};
+
+// Log2 buckets of microsecond latencies: bucket b holds values below
+// 2^b, so percentiles are reported as bucket upper bounds.
+class LatencyHistogram {
+public:
+    static constexpr size_t kBuckets = 40;
+    using Counts = std::array<uint64_t, kBuckets>;
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+    std::atomic<uint64_t> max_{0};
+
+public:
+    void add(uint64_t us);
+    Counts counts() const;
+
+    uint64_t max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    // Smallest bucket bound covering fraction p of counts; 0 if empty.
+    static uint64_t percentile(const Counts &counts, double p);
+};
+
+// Long-running job server on a Unix stream socket. Finished jobs leave
+// their CPU behind, loaded and predecoded, with a snapshot to rewind
+// to, so a later job of the same program costs a restore of the pages
+// the previous one wrote plus the run itself. Jobs run under a
+// Scheduler in time slices, so short jobs are not stuck behind long
+// ones; priority=N gives a job a larger (higher N) or smaller share.
+//
+// Requests are lines of whitespace-separated tokens:
+//
+//   load HEX                   store a program; replies {"loaded":"HASH","bytes":N}
+//   run [id=ID] program=HASH|hex:HEX [engine=E] [budget=N] [priority=0-7] [xN=V ...]
+//   stats                      throughput and latency since the last stats
+//                              request on this connection
+//   shutdown                   finish queued jobs and exit
+//
+// Programs load at address 0 and start there. Results are JSON lines,
+// streamed back in completion order, so clients tag runs with id=:
+//
+//   {"id":"7","status":"halted","retired":42,"pc":28,"regs":[...],
+//    "output":"144\n","queue_us":3,"run_us":11}
+//
+// queue_us runs up to the job's first time slice and run_us from there
+// to the end, including any time it was preempted.
+//
+// status is halted, budget, misaligned_access, unknown_instruction or
+// unknown_syscall. A request that cannot be served gets {"id":...,
+// "error":"..."}.
+class Server {
+private:
+    class Connection;
+    struct Job;
+    struct Totals;
+
+    // An idle CPU with program loaded and a snapshot of that state.
+    struct Warm {
+        std::shared_ptr<const ServedProgram> program;
+        std::unique_ptr<CPU> cpu;
+        Snapshot start;
+    };
+
+    ServerOptions options_;
+    int listen_fd_;
+    int wake_fd_[2];
+    std::atomic<bool> stopping_;
+
+    // Program bytes, least recently used at the back.
+    std::mutex programs_mutex_;
+    std::list<std::shared_ptr<const ServedProgram>> programs_;
+    std::unordered_map<uint64_t, std::list<std::shared_ptr<const ServedProgram>>::iterator> program_index_;
+
+    // Reader threads are detached; run() waits for readers_ to drop to
+    // zero before returning.
+    std::mutex connections_mutex_;
+    std::condition_variable readers_done_;
+    std::vector<std::weak_ptr<Connection>> connections_;
+    size_t readers_;
+
+    std::chrono::steady_clock::time_point started_;
+    std::atomic<uint64_t> jobs_{0};
+    std::atomic<uint64_t> errors_{0};
+    std::atomic<uint64_t> instructions_{0};
+    std::atomic<uint64_t> warm_hits_{0};
+    std::atomic<uint64_t> queued_{0};
+    LatencyHistogram queue_latency_;
+    LatencyHistogram run_latency_;
+
+    // Most recently used first.
+    std::mutex warm_mutex_;
+    std::list<Warm> warm_;
+
+    std::unique_ptr<Scheduler> scheduler_;
+
+    std::shared_ptr<const ServedProgram> store(std::vector<Byte> bytes, std::string &error);
+    std::shared_ptr<const ServedProgram> find(uint64_t hash);
+
+    void serve(std::shared_ptr<Connection> connection);
+    void handle(const std::shared_ptr<Connection> &connection, const std::string &line, Totals &last);
+    void submit(const std::shared_ptr<Connection> &connection, std::istream &tokens);
+    CPU *start(Job &job);
+    void finish(Job &job);
+    std::string stats(Totals &last);
+    void stop();
+
+public:
+    explicit Server(ServerOptions options);
+    ~Server();
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    // Serves until a shutdown request; false if the socket cannot be
+    // set up.
+    bool run();
+};
+
+} // namespace Sim
+
+#endif // SERVER_HPP_
@@ -1,79 +1,517 @@
 #include "simulator.hpp"
+#include "assembler.hpp"
 #include "config.hpp"
+#include "batch.hpp"
+#include "cli.hpp"
+#include "code_cache.hpp"
+#include "server.hpp"
 
 #include <iostream>
+#include <fstream>
 #include <filesystem>
 #include <string>
 #include <charconv>
+#include <utility>
+#include <vector>
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <program.bin>\n x1=N";
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <program.bin> [--engine=block|threaded|jit]"
+                  << " [--base=ADDR] [--entry=ADDR] [--image=FILE@ADDR ...]"
+                  << " [--asm [--asm-cache=DIR]] [--code-cache[=DIR]] [--aot=FILE] [--device=NAME[:FILE]@ADDR ...] [--resume] [--save-snapshot=FILE] [--profile] [--trace=FILE] [--harts=N] [--output=FILE] [--raw-output]"
+                  << " [--profile-stacks=FILE [--symbols=FILE] [--sample-period=N]] [--timing[=SPEC]]"
+                  << " [--batch=FILE|- [--threads=N] [--lanes=8|16]] [x1=N ...]\n"
+                  << "       " << argv[0] << " --serve=SOCKET [--engine=E] [--threads=N] [--cache=N] [--quantum=N]\n";
         return 1;
     }
 
-    std::filesystem::path program_path = argv[1];
-
-    Sim::Simulator simulator;
-
-    if (!simulator.load_program(program_path.string())) {
-        std::cerr << "Failed to load program: " << program_path << "\n";
-        return 1;
+    std::string first = argv[1];
+    std::string serve_path;
+    std::filesystem::path program_path;
+    if (first.rfind("--serve=", 0) == 0) {
+        serve_path = first.substr(std::string("--serve=").size());
+        if (serve_path.empty()) {
+            std::cerr << "Empty path in argument: " << first << "\n";
+            return 1;
+        }
+    } else {
+        program_path = first;
     }
 
+    Sim::Engine engine = Sim::Engine::block;
+    Sim::Address base = 0;
+    Sim::Address entry = 0;
+    bool has_entry = false;
+    std::vector<std::pair<std::string, Sim::Address>> images;
+    struct DeviceSpec {
+        std::string name;
+        std::filesystem::path file;
+        Sim::Address base;
+    };
+    std::vector<DeviceSpec> devices;
+    std::vector<std::pair<Sim::Register_idx, Sim::Register>> registers;
+    std::string batch_path;
+    std::string save_path;
+    std::string trace_path;
+    bool resume = false;
+    bool profile = false;
+    bool raw_output = false;
+    std::string output_path;
+    std::string stacks_path;
+    std::filesystem::path symbols_path;
+    uint64_t sample_period = Sim::StackProfiler::kDefaultPeriod;
+    bool timing = false;
+    Sim::TimingConfig timing_config;
+    bool assembly = false;
+    std::filesystem::path asm_cache;
+    bool code_cache = false;
+    std::filesystem::path aot_path;
+    std::filesystem::path code_cache_dir;
+    size_t threads = 0;
+    size_t lanes = 1;
+    size_t cache = 16;
+    size_t harts = 1;
+    uint64_t quantum = Sim::Scheduler::kDefaultQuantum;
+
     for (int i = 2; i < argc; ++i) {
         std::string arguments = argv[i];
 
-        size_t eq_pos = arguments.find('=');
-        if (eq_pos == std::string::npos
-            || eq_pos < 2
-            || (arguments[0] != 'x' && arguments[0] != 'X')) {
-            std::cerr << "Invalid register argument: " << arguments << ". Expected format: x1=N\n";
+        if (!serve_path.empty() && arguments.rfind("--engine=", 0) != 0 && arguments.rfind("--threads=", 0) != 0
+            && arguments.rfind("--cache=", 0) != 0 && arguments.rfind("--quantum=", 0) != 0) {
+            std::cerr << "--serve only takes --engine, --threads, --cache and --quantum: " << arguments << "\n";
+            return 1;
+        }
+
+        if (arguments.rfind("--base=", 0) == 0) {
+            if (!Sim::parse_address(arguments.substr(std::string("--base=").size()), base)) {
+                std::cerr << "Bad address in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--entry=", 0) == 0) {
+            if (!Sim::parse_address(arguments.substr(std::string("--entry=").size()), entry)) {
+                std::cerr << "Bad address in argument: " << arguments << "\n";
+                return 1;
+            }
+            has_entry = true;
+            continue;
+        }
+
+        if (arguments.rfind("--image=", 0) == 0) {
+            std::string spec = arguments.substr(std::string("--image=").size());
+            size_t at_pos = spec.rfind('@');
+            Sim::Address image_base = 0;
+            if (at_pos == std::string::npos || at_pos == 0
+                || !Sim::parse_address(spec.substr(at_pos + 1), image_base)) {
+                std::cerr << "Invalid image argument: " << arguments << ". Expected format: --image=FILE@ADDR\n";
+                return 1;
+            }
+            images.emplace_back(spec.substr(0, at_pos), image_base);
+            continue;
+        }
+
+        if (arguments.rfind("--device=", 0) == 0) {
+            std::string spec = arguments.substr(std::string("--device=").size());
+            size_t at_pos = spec.rfind('@');
+            Sim::Address device_base = 0;
+            if (at_pos == std::string::npos || at_pos == 0
+                || !Sim::parse_address(spec.substr(at_pos + 1), device_base)) {
+                std::cerr << "Invalid device argument: " << arguments << ". Expected format: --device=NAME[:FILE]@ADDR\n";
+                return 1;
+            }
+            spec.resize(at_pos);
+            size_t colon = spec.find(':');
+            devices.push_back(DeviceSpec{spec.substr(0, colon),
+                                         colon == std::string::npos ? "" : spec.substr(colon + 1), device_base});
+            continue;
+        }
+
+        if (arguments.rfind("--engine=", 0) == 0) {
+            std::string name = arguments.substr(std::string("--engine=").size());
+            if (name == "block") {
+                engine = Sim::Engine::block;
+            } else if (name == "threaded") {
+                engine = Sim::Engine::threaded;
+            } else if (name == "jit") {
+                engine = Sim::Engine::jit;
+            } else {
+                std::cerr << "Unknown engine: " << name << ". Expected block, threaded or jit\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--batch=", 0) == 0) {
+            batch_path = arguments.substr(std::string("--batch=").size());
+            if (batch_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments == "--profile") {
+            profile = true;
+            continue;
+        }
+
+        if (arguments.rfind("--output=", 0) == 0) {
+            output_path = arguments.substr(std::string("--output=").size());
+            if (output_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments == "--raw-output") {
+            raw_output = true;
+            continue;
+        }
+
+        if (arguments == "--timing") {
+            timing = true;
+            continue;
+        }
+
+        if (arguments.rfind("--timing=", 0) == 0) {
+            std::string error;
+            if (!Sim::parse_timing_config(arguments.substr(std::string("--timing=").size()), timing_config, error)) {
+                std::cerr << error << "\n";
+                return 1;
+            }
+            timing = true;
+            continue;
+        }
+
+        if (arguments.rfind("--profile-stacks=", 0) == 0) {
+            stacks_path = arguments.substr(std::string("--profile-stacks=").size());
+            if (stacks_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--symbols=", 0) == 0) {
+            symbols_path = arguments.substr(std::string("--symbols=").size());
+            if (symbols_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--sample-period=", 0) == 0) {
+            std::string count = arguments.substr(std::string("--sample-period=").size());
+            std::from_chars_result rc = std::from_chars(count.data(), count.data() + count.size(), sample_period);
+            if (rc.ec != std::errc() || rc.ptr != count.data() + count.size() || sample_period == 0) {
+                std::cerr << "Bad number in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--trace=", 0) == 0) {
+            trace_path = arguments.substr(std::string("--trace=").size());
+            if (trace_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments == "--asm") {
+            assembly = true;
+            continue;
+        }
+
+        if (arguments.rfind("--asm-cache=", 0) == 0) {
+            asm_cache = arguments.substr(std::string("--asm-cache=").size());
+            if (asm_cache.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments == "--code-cache") {
+            code_cache = true;
+            continue;
+        }
+
+        if (arguments.rfind("--code-cache=", 0) == 0) {
+            code_cache_dir = arguments.substr(std::string("--code-cache=").size());
+            if (code_cache_dir.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            code_cache = true;
+            continue;
+        }
+
+        if (arguments.rfind("--aot=", 0) == 0) {
+            aot_path = arguments.substr(std::string("--aot=").size());
+            if (aot_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments == "--resume") {
+            resume = true;
+            continue;
+        }
+
+        if (arguments.rfind("--save-snapshot=", 0) == 0) {
+            save_path = arguments.substr(std::string("--save-snapshot=").size());
+            if (save_path.empty()) {
+                std::cerr << "Empty path in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--threads=", 0) == 0) {
+            std::string count = arguments.substr(std::string("--threads=").size());
+            std::from_chars_result rc = std::from_chars(count.data(), count.data() + count.size(), threads);
+            if (rc.ec != std::errc() || rc.ptr != count.data() + count.size()) {
+                std::cerr << "Bad number in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--cache=", 0) == 0) {
+            std::string count = arguments.substr(std::string("--cache=").size());
+            std::from_chars_result rc = std::from_chars(count.data(), count.data() + count.size(), cache);
+            if (rc.ec != std::errc() || rc.ptr != count.data() + count.size() || cache == 0) {
+                std::cerr << "Bad number in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--quantum=", 0) == 0) {
+            std::string count = arguments.substr(std::string("--quantum=").size());
+            std::from_chars_result rc = std::from_chars(count.data(), count.data() + count.size(), quantum);
+            if (rc.ec != std::errc() || rc.ptr != count.data() + count.size() || quantum == 0) {
+                std::cerr << "Bad number in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--harts=", 0) == 0) {
+            std::string count = arguments.substr(std::string("--harts=").size());
+            std::from_chars_result rc = std::from_chars(count.data(), count.data() + count.size(), harts);
+            if (rc.ec != std::errc() || rc.ptr != count.data() + count.size() || harts == 0) {
+                std::cerr << "Bad number in argument: " << arguments << "\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (arguments.rfind("--lanes=", 0) == 0) {
+            std::string count = arguments.substr(std::string("--lanes=").size());
+            if (count == "1" || count == "8" || count == "16") {
+                lanes = std::stoul(count);
+            } else {
+                std::cerr << "Unsupported lane count: " << count << ". Expected 1, 8 or 16\n";
+                return 1;
+            }
+            continue;
+        }
+
+        Sim::Register_idx reg_idx = 0;
+        Sim::Register value = 0;
+        std::string error;
+        if (!Sim::parse_register_assignment(arguments, reg_idx, value, error)) {
+            std::cerr << error << "\n";
             return 1;
         }
+        registers.emplace_back(reg_idx, value);
+    }
 
-        std::string reg_str = arguments.substr(1, eq_pos - 1);
+    if (!serve_path.empty()) {
+        Sim::ServerOptions options;
+        options.socket_path = serve_path;
+        options.engine = engine;
+        options.threads = threads;
+        options.cache = cache;
+        options.quantum = quantum;
+        Sim::Server server(options);
+        return server.run() ? 0 : 1;
+    }
 
-        size_t reg_idx = 0;
-        char* reg_first = reg_str.data();
-        char* reg_last = reg_str.data() + reg_str.size();
+    if (!trace_path.empty() && (profile || !batch_path.empty())) {
+        std::cerr << "--trace cannot be combined with --profile or --batch\n";
+        return 1;
+    }
+
+    if (timing && (profile || !trace_path.empty() || !stacks_path.empty() || !batch_path.empty() || harts > 1)) {
+        std::cerr << "--timing cannot be combined with --profile, --trace, --profile-stacks, --batch or --harts\n";
+        return 1;
+    }
+
+    if (!stacks_path.empty() && (profile || !trace_path.empty() || !batch_path.empty() || resume || harts > 1)) {
+        std::cerr << "--profile-stacks cannot be combined with --profile, --trace, --batch, --resume or --harts\n";
+        return 1;
+    }
 
-        std::from_chars_result rc_reg = std::from_chars(reg_first, reg_last, reg_idx, Sim::kBaseOfNumSys10);
-        if (rc_reg.ec != std::errc()) {
-            std::cerr << "Invalid register numder in: " << arguments << "\n";
+    if ((raw_output || !output_path.empty()) && !batch_path.empty()) {
+        std::cerr << "--output and --raw-output cannot be combined with --batch\n";
+        return 1;
+    }
+
+    if (code_cache && (resume || !batch_path.empty())) {
+        std::cerr << "--code-cache cannot be combined with --resume or --batch\n";
+        return 1;
+    }
+
+    if (!aot_path.empty() && (profile || !trace_path.empty() || timing || !stacks_path.empty()
+                              || !batch_path.empty() || harts > 1)) {
+        std::cerr << "--aot cannot be combined with --profile, --trace, --timing, --profile-stacks, --batch or --harts\n";
+        return 1;
+    }
+
+    if (!devices.empty() && (!trace_path.empty() || !batch_path.empty() || harts > 1 || resume || !save_path.empty())) {
+        std::cerr << "--device cannot be combined with --trace, --batch, --harts, --resume or --save-snapshot\n";
+        return 1;
+    }
+
+    if (harts > 1 && (profile || !trace_path.empty() || !batch_path.empty() || !save_path.empty())) {
+        std::cerr << "--harts cannot be combined with --profile, --trace, --batch or --save-snapshot\n";
+        return 1;
+    }
+
+    const std::filesystem::path source_path = program_path;
+    if (assembly) {
+        if (resume) {
+            std::cerr << "--asm cannot be combined with --resume\n";
+            return 1;
+        }
+        // From here on the program is the cached binary.
+        program_path = Sim::assemble_cached(program_path, asm_cache.empty() ? Sim::default_asm_cache_dir() : asm_cache);
+        if (program_path.empty()) {
+            return 1;
+        }
+    }
+
+    if (!batch_path.empty()) {
+        Sim::BatchOptions options;
+        options.engine = engine;
+        options.base = base;
+        options.resume = resume;
+        if (has_entry) {
+            options.entry = entry;
+        } else if (!resume) {
+            options.entry = base;
+        }
+        options.threads = threads;
+        options.lanes = lanes;
+        options.registers = registers;
+
+        std::shared_ptr<const Sim::ProgramImage> program = Sim::ProgramImage::open(program_path);
+        if (program == nullptr) {
+            std::cerr << "Failed to load program: " << program_path << "\n";
             return 1;
         }
-        if (static_cast<Sim::Register>(reg_idx) >= Sim::kNumberOfRegisters) {
-            std::cerr << "Register index out of range (0.." << (Sim::kNumberOfRegisters - 1) << "): " << reg_idx << "\n";
+        for (const auto &image : images) {
+            std::shared_ptr<const Sim::ProgramImage> data = Sim::ProgramImage::open(image.first);
+            if (data == nullptr) {
+                std::cerr << "Failed to load image: " << image.first << "\n";
+                return 1;
+            }
+            options.images.emplace_back(data, image.second);
+        }
+
+        Sim::BatchRunner runner(program, options);
+        if (batch_path == "-") {
+            return runner.run(std::cin, std::cout) ? 0 : 1;
+        }
+        std::ifstream input(batch_path);
+        if (!input) {
+            std::cerr << "Cannot open batch file: " << batch_path << "\n";
             return 1;
         }
+        return runner.run(input, std::cout) ? 0 : 1;
+    }
 
-        std::string val_str = arguments.substr(eq_pos + 1);
-        if (val_str.empty()) {
-            std::cerr << "Empty value in argument: " << arguments << "\n";
+    Sim::Simulator simulator;
+    simulator.set_engine(engine);
+    simulator.set_profile(profile);
+    simulator.set_harts(harts);
+    simulator.set_raw_output(raw_output);
+    if (timing) {
+        simulator.set_timing(timing_config);
+    }
+    if (code_cache) {
+        simulator.set_code_cache(code_cache_dir.empty() ? Sim::default_code_cache_dir() : code_cache_dir);
+    }
+
+    if (resume) {
+        if (!simulator.resume(program_path.string())) {
+            std::cerr << "Failed to resume snapshot: " << program_path << "\n";
             return 1;
         }
+    } else if (!simulator.load_program(program_path.string(), base)) {
+        std::cerr << "Failed to load program: " << program_path << "\n";
+        return 1;
+    }
 
-        size_t val_val = 0;
-        std::from_chars_result rc_val;
-        if (val_str.size() > 2 && (val_str[0] == '0')
-            && (val_str[1] == 'x'
-            || val_str[1] == 'X')) {
-            rc_val = std::from_chars(val_str.data() + 2, val_str.data() + val_str.size(), val_val, Sim::kBaseOfNumSys16);
-        } else {
-            rc_val = std::from_chars(val_str.data(), val_str.data() + val_str.size(), val_val, Sim::kBaseOfNumSys10);
+    for (const auto &image : images) {
+        if (!simulator.load_image(image.first, image.second)) {
+            std::cerr << "Failed to load image: " << image.first << "\n";
+            return 1;
         }
-        if (rc_val.ec != std::errc()) {
-            std::cerr << "Bad number in argument: " << arguments << "\n";
+    }
+
+    for (const auto &reg : registers) {
+        simulator.set_register(reg.first, reg.second);
+    }
+
+    if (has_entry) {
+        simulator.set_pc(entry);
+    }
+
+    for (const auto &device : devices) {
+        if (!simulator.add_device(device.name, device.file, device.base)) {
+            std::cerr << "Failed to attach device: " << device.name << "\n";
             return 1;
         }
+    }
+
+    if (!aot_path.empty() && !simulator.set_aot(aot_path)) {
+        return 1;
+    }
+
+    if (!output_path.empty() && !simulator.set_output(output_path)) {
+        return 1;
+    }
+
+    if (!stacks_path.empty()
+        && !simulator.set_stack_profile(stacks_path, symbols_path.empty() ? Sim::symbol_path(program_path) : symbols_path,
+                                        base, sample_period)) {
+        return 1;
+    }
 
-        Sim::Register value = static_cast<uint32_t>(val_val & 0xFFFFFFFF);
-        simulator.set_register(reg_idx, value);
+    if (!trace_path.empty() && !simulator.set_trace(trace_path)) {
+        return 1;
     }
 
-    std::cout << "Starting simulation for '" << program_path << "'...\n";
-    simulator.run();
+    std::cout << "Starting simulation for '" << source_path << "'...\n";
+    bool traced = simulator.run();
     simulator.dump_final_state();
+    if (!traced) {
+        return 1;
+    }
+
+    if (!save_path.empty() && !simulator.save_snapshot(save_path)) {
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
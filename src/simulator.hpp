@@ -3,34 +3,169 @@
 
 #include "config.hpp"
 #include "cpu.hpp"
+#include "machine.hpp"
+#include "profiler.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
 
 namespace Sim {
 
 class Simulator {
 private:
     CPU cpu_;
-    Register entry_point_;
+    Address entry_point_;
+    bool profile_;
+    CountingInstrumentation counters_;
+    std::unique_ptr<TraceWriter> trace_;
+    std::filesystem::path code_cache_dir_;
+    size_t harts_;
+    std::unique_ptr<Machine> machine_;
+    std::ofstream output_file_;
+    std::unique_ptr<StackProfiler> stacks_;
+    std::string stacks_path_;
+    std::unique_ptr<TimingModel> timing_;
 
 public:
     Simulator()
         : cpu_(),
-        entry_point_(0)
+        entry_point_(0),
+        profile_(false),
+        harts_(1)
     {
         cpu_.reset();
+        cpu_.set_input(std::cin);
     }
 
     ~Simulator() = default;
 
-    bool load_program(const std::string &file_path) {
-        return cpu_.load_program(file_path, 0);
+    // Loads the program image at base; execution starts there unless
+    // set_pc() picks another entry point.
+    bool load_program(const std::string &file_path, Address base = 0) {
+        std::shared_ptr<const ProgramImage> image = ProgramImage::open(file_path);
+        if (image == nullptr || !cpu_.load_program(*image, base)) {
+            return false;
+        }
+        if (!code_cache_dir_.empty()) {
+            cpu_.use_code_cache(code_cache_dir_, base, image->size());
+        }
+        entry_point_ = base;
+        return true;
+    }
+
+    // Reuses decoded blocks of the program across runs through files
+    // in dir; set before load_program().
+    void set_code_cache(const std::filesystem::path &dir) {
+        code_cache_dir_ = dir;
+    }
+
+    // Runs what the module at path (see tools/toy_aot.cpp) translated
+    // of the program natively; set after loading every image.
+    bool set_aot(const std::filesystem::path &path) {
+        return cpu_.use_aot(path);
+    }
+
+    // Maps the device name (see make_device()) at the page at base; set
+    // after loading every image.
+    bool add_device(const std::string &name, const std::filesystem::path &file, Address base) {
+        return cpu_.attach_device(make_device(name, file), base);
+    }
+
+    // Places an extra data image in guest memory.
+    bool load_image(const std::string &file_path, Address base) {
+        return cpu_.load_program(file_path, base);
+    }
+
+    // Continues from a snapshot file instead of loading a program; the
+    // entry point is the pc it was saved at.
+    bool resume(const std::string &file_path) {
+        if (!cpu_.load_snapshot(file_path)) {
+            return false;
+        }
+        cpu_.resume();
+        entry_point_ = cpu_.get_PC();
+        return true;
+    }
+
+    bool save_snapshot(const std::string &file_path) const {
+        return cpu_.save_snapshot(file_path);
     }
 
     void set_register(Register index, uint32_t value) {
         cpu_.set_register(index, value);
     }
 
+    void set_engine(Engine engine) {
+        cpu_.set_engine(engine);
+    }
+
+    // Counts instructions, branches and memory accesses during run();
+    // slower, as it always uses the block engine.
+    void set_profile(bool profile) {
+        profile_ = profile;
+    }
+
+    // Samples the program's call stack every period instructions during
+    // run(), as labels from symbols_path for a program at base, and
+    // writes the stacks to file_path in collapsed form. Like profiling,
+    // it uses the block engine.
+    bool set_stack_profile(const std::string &file_path, const std::filesystem::path &symbols_path,
+                           Address base, uint64_t period) {
+        SymbolTable symbols;
+        if (!symbols.load(symbols_path, base)) {
+            return false;
+        }
+        stacks_ = std::make_unique<StackProfiler>(std::move(symbols), period);
+        stacks_path_ = file_path;
+        return true;
+    }
+
+    // Counts the cycles run() would take on the core config describes;
+    // like profiling, it uses the block engine.
+    void set_timing(const TimingConfig &config) {
+        timing_ = std::make_unique<TimingModel>(config);
+    }
+
+    // Writes a record per retired instruction to file_path during run();
+    // like profiling, it uses the block engine.
+    bool set_trace(const std::string &file_path) {
+        try {
+            trace_ = std::make_unique<TraceWriter>(file_path);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Sends what the program prints to file_path instead of stdout.
+    bool set_output(const std::string &file_path) {
+        output_file_.open(file_path, std::ios::binary | std::ios::trunc);
+        if (!output_file_) {
+            std::cerr << "Cannot open output file: " << file_path << "\n";
+            return false;
+        }
+        cpu_.set_output(output_file_);
+        return true;
+    }
+
+    // Prints words as raw bytes rather than decimal lines.
+    void set_raw_output(bool raw) {
+        cpu_.set_raw_output(raw);
+    }
+
+    // Lets the program spawn harts, up to harts of them in all; more
+    // than one runs it on a Machine.
+    void set_harts(size_t harts) {
+        harts_ = harts;
+    }
+
     void set_pc(Address address) {
-        cpu_.set_PC(address);
+        entry_point_ = address;
     }
 
     void write_memory(Address addr, uint32_t value) {
@@ -41,13 +176,58 @@ public:
         cpu_.write(addr, value);
     }
 
-    void run() {
-        cpu_.run();
+    // False if the trace or stack profile could not be written.
+    bool run() {
+        cpu_.set_PC(entry_point_);
+        bool traced = true;
+        if (trace_) {
+            TraceInstrumentation tracer(cpu_, *trace_);
+            cpu_.run(tracer);
+            traced = trace_->close();
+        } else if (profile_) {
+            cpu_.run(counters_);
+        } else if (timing_ != nullptr) {
+            cpu_.run(*timing_);
+        } else if (stacks_ != nullptr) {
+            cpu_.run(*stacks_);
+            std::ofstream out(stacks_path_, std::ios::trunc);
+            stacks_->write(out);
+            out.close();
+            if (!out) {
+                std::cerr << "Cannot write stack profile: " << stacks_path_ << "\n";
+                traced = false;
+            }
+        } else if (harts_ > 1) {
+            machine_ = std::make_unique<Machine>(cpu_, harts_);
+            machine_->run();
+        } else {
+            cpu_.run();
+        }
+        // A cache file that cannot be written only costs the next run.
+        cpu_.save_code_cache();
+        return traced;
     }
 
     void dump_final_state() const {
         std::cout << "\n--- Simulation Finished ---\n";
         cpu_.dump_regs();
+        if (machine_ != nullptr) {
+            for (size_t id = 0; id < machine_->size(); ++id) {
+                const CPU &hart = machine_->hart(id);
+                std::cout << "hart " << id << ": pc = 0x" << std::hex << hart.get_PC() << std::dec
+                          << ", " << hart.get_retired() << " retired"
+                          << (hart.get_fault() != Fault::none ? ", faulted" : "") << "\n";
+            }
+        }
+        if (profile_) {
+            counters_.report(std::cout);
+        }
+        if (timing_ != nullptr) {
+            timing_->report(std::cout);
+        }
+        if (stacks_ != nullptr) {
+            std::cout << stacks_->samples() << " stack samples written to " << stacks_path_ << "\n";
+        }
     }
 };
 
@@ -0,0 +1,161 @@
+#include "snapshot.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace Sim {
+
+constexpr char SnapshotHeader::kMagic[8];
+
+namespace {
+
+constexpr uint32_t kGuestPages = static_cast<uint32_t>(GuestMemory::kSpaceBytes >> GuestMemory::kPageShift);
+
+size_t data_offset(size_t page_count) {
+    size_t table_end = sizeof(SnapshotHeader) + page_count * sizeof(uint32_t);
+    return (table_end + GuestMemory::kPageSize - 1) & ~(GuestMemory::kPageSize - 1);
+}
+
+bool is_zero_page(const Byte *page) {
+    static const Byte zero[GuestMemory::kPageSize] = {};
+    return std::memcmp(page, zero, GuestMemory::kPageSize) == 0;
+}
+
+bool read_all(int fd, void *buffer, size_t size, size_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, static_cast<Byte*>(buffer) + done, size - done, static_cast<off_t>(offset + done));
+        if (n <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+bool write_snapshot_file(const std::filesystem::path &path, const Snapshot &state,
+                         const GuestMemory &memory) {
+    std::vector<uint32_t> pages;
+    for (uint32_t page : memory.used_pages()) {
+        if (page < kGuestPages
+            && !is_zero_page(memory.data() + (static_cast<uint64_t>(page) << GuestMemory::kPageShift))) {
+            pages.push_back(page);
+        }
+    }
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SnapshotHeader::kMagic, sizeof(header.magic));
+    header.version = SnapshotHeader::kVersion;
+    header.page_count = static_cast<uint32_t>(pages.size());
+    header.pc = state.pc;
+    header.halted = state.halted ? 1 : 0;
+    header.retired = state.retired;
+    std::memcpy(header.regs, state.regs, sizeof(header.regs));
+
+    // Written under a private name and renamed: a resumed run maps its
+    // pages from the file it may be saving over.
+    const std::filesystem::path partial = path.string() + "." + std::to_string(getpid());
+    std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "snapshot: cannot create file: " << path << "\n";
+        return false;
+    }
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(pages.data()),
+              static_cast<std::streamsize>(pages.size() * sizeof(uint32_t)));
+    const std::vector<char> padding(data_offset(pages.size()) - sizeof(header) - pages.size() * sizeof(uint32_t));
+    out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+    for (uint32_t page : pages) {
+        out.write(reinterpret_cast<const char*>(memory.data() + (static_cast<uint64_t>(page) << GuestMemory::kPageShift)),
+                  GuestMemory::kPageSize);
+    }
+
+    out.close();
+    std::error_code ec;
+    if (!out) {
+        std::filesystem::remove(partial, ec);
+        std::cerr << "snapshot: cannot write file: " << path << "\n";
+        return false;
+    }
+    std::filesystem::rename(partial, path, ec);
+    if (ec) {
+        std::filesystem::remove(partial, ec);
+        std::cerr << "snapshot: cannot write file: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool read_snapshot_file(const std::filesystem::path &path, Snapshot &state, GuestMemory &memory) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "snapshot: cannot open file: " << path << "\n";
+        return false;
+    }
+
+    struct stat st{};
+    SnapshotHeader header{};
+    if (fstat(fd, &st) != 0 || !read_all(fd, &header, sizeof(header), 0)
+        || std::memcmp(header.magic, SnapshotHeader::kMagic, sizeof(header.magic)) != 0
+        || header.version != SnapshotHeader::kVersion) {
+        std::cerr << "snapshot: not a snapshot file: " << path << "\n";
+        close(fd);
+        return false;
+    }
+
+    const size_t count = header.page_count;
+    const size_t offset = data_offset(count);
+    std::vector<uint32_t> pages(count);
+    if (static_cast<uint64_t>(st.st_size) < offset + count * GuestMemory::kPageSize
+        || !read_all(fd, pages.data(), count * sizeof(uint32_t), sizeof(header))) {
+        std::cerr << "snapshot: truncated file: " << path << "\n";
+        close(fd);
+        return false;
+    }
+
+    // Runs of consecutive pages are consecutive in the file too, so
+    // each run is a single mapping.
+    size_t first = 0;
+    while (first < count) {
+        size_t last = first;
+        while (last + 1 < count && pages[last + 1] == pages[last] + 1) {
+            ++last;
+        }
+        if (pages[last] >= kGuestPages || (first > 0 && pages[first] <= pages[first - 1])) {
+            std::cerr << "snapshot: bad page table in: " << path << "\n";
+            close(fd);
+            return false;
+        }
+
+        const size_t bytes = (last - first + 1) * GuestMemory::kPageSize;
+        const Address base = static_cast<Address>(static_cast<uint64_t>(pages[first]) << GuestMemory::kPageShift);
+        if (memory.map_file(fd, base, bytes, offset + first * GuestMemory::kPageSize) != bytes) {
+            std::cerr << "snapshot: cannot map pages of: " << path << "\n";
+            close(fd);
+            return false;
+        }
+        first = last + 1;
+    }
+    close(fd);
+
+    state.pc = header.pc;
+    state.halted = header.halted != 0;
+    state.retired = header.retired;
+    std::memcpy(state.regs, header.regs, sizeof(state.regs));
+    state.epoch = 0;
+    return true;
+}
+
+} // namespace Sim
@@ -0,0 +1,54 @@
+#ifndef SNAPSHOT_HPP_
+#define SNAPSHOT_HPP_
+
+#include "config.hpp"
+#include "guest_memory.hpp"
+
+#include <cstdint>
+#include <filesystem>
+
+namespace Sim {
+
+// Architectural state captured by CPU::snapshot(). Guest memory is not
+// copied: from the snapshot on, the CPU keeps the original of each page
+// the first time it is written, and CPU::restore() copies back only
+// those pages.
+struct Snapshot {
+    Address pc = 0;
+    bool halted = false;
+    uint64_t retired = 0;
+    Register regs[kNumberOfRegisters] = {};
+    uint64_t epoch = 0;     // memory baseline this snapshot belongs to
+};
+
+// On-disk snapshot: a header with the registers, the numbers of the
+// non-zero pages, then those pages at page-aligned offsets so that
+// loading can map them copy-on-write instead of reading them.
+//
+//   0      SnapshotHeader
+//   ...    uint32_t page numbers, ascending
+//   4K*n   page contents, in the same order
+//
+// Fields are in host byte order.
+struct SnapshotHeader {
+    static constexpr char kMagic[8] = {'T', 'O', 'Y', 'S', 'N', 'A', 'P', '\0'};
+    static constexpr uint32_t kVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t page_count;
+    uint32_t pc;
+    uint32_t halted;
+    uint64_t retired;
+    Register regs[kNumberOfRegisters];
+};
+
+bool write_snapshot_file(const std::filesystem::path &path, const Snapshot &state,
+                         const GuestMemory &memory);
+
+// Maps the pages of the file into memory, which should be clear.
+bool read_snapshot_file(const std::filesystem::path &path, Snapshot &state, GuestMemory &memory);
+
+} // namespace Sim
+
+#endif // SNAPSHOT_HPP_
@@ -0,0 +1,86 @@
+#include "symbols.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace Sim {
+
+constexpr uint32_t SymbolTable::kNone;
+
+bool SymbolTable::load(const std::filesystem::path &path, Address base) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "symbols: cannot open file: " << path << "\n";
+        return false;
+    }
+
+    std::vector<Symbol> symbols;
+    size_t number = 0;
+    for (std::string line; std::getline(in, line);) {
+        ++number;
+        if (line.empty()) {
+            continue;
+        }
+        std::istringstream fields(line);
+        uint64_t address = 0;
+        std::string name;
+        if (!(fields >> std::hex >> address >> name) || address > UINT32_MAX) {
+            std::cerr << "symbols: " << path.string() << ": line " << number << " is malformed\n";
+            return false;
+        }
+        symbols.push_back(Symbol{static_cast<Address>(address + base), name});
+    }
+
+    std::stable_sort(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) {
+        return a.address < b.address;
+    });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) {
+        return a.address == b.address;
+    }), symbols.end());
+    symbols_ = std::move(symbols);
+    return true;
+}
+
+bool SymbolTable::write(const std::filesystem::path &path, const std::vector<Symbol> &symbols) {
+    std::vector<Symbol> sorted = symbols;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Symbol &a, const Symbol &b) {
+        return a.address < b.address;
+    });
+
+    std::ofstream out(path, std::ios::trunc);
+    for (const Symbol &symbol : sorted) {
+        char address[16];
+        std::snprintf(address, sizeof(address), "%08x", symbol.address);
+        out << address << " " << symbol.name << "\n";
+    }
+    out.close();
+    if (!out) {
+        std::cerr << "symbols: cannot write file: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+uint32_t SymbolTable::find(Address pc) const {
+    auto it = std::upper_bound(symbols_.begin(), symbols_.end(), pc,
+        [](Address at, const Symbol &symbol) { return at < symbol.address; });
+    if (it == symbols_.begin()) {
+        return kNone;
+    }
+    return static_cast<uint32_t>(it - symbols_.begin() - 1);
+}
+
+uint32_t SymbolTable::starting_at(Address pc) const {
+    const uint32_t index = find(pc);
+    return index != kNone && symbols_[index].address == pc ? index : kNone;
+}
+
+std::filesystem::path symbol_path(const std::filesystem::path &program) {
+    std::filesystem::path path = program;
+    return path.replace_extension(".sym");
+}
+
+} // namespace Sim
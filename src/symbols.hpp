@@ -0,0 +1,59 @@
+#ifndef SYMBOLS_HPP_
+#define SYMBOLS_HPP_
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace Sim {
+
+// A label of an assembled program.
+struct Symbol {
+    Address address;
+    std::string name;
+};
+
+// The labels of a program, read from the .sym file the assemblers write
+// next to the .bin: a "<hex address> <name>" line per label, in address
+// order. Where several labels share an address the first one names it.
+class SymbolTable {
+public:
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+private:
+    std::vector<Symbol> symbols_;   // by address, one per address
+
+public:
+    // Symbols of a program loaded at base. Reports why and returns false
+    // if the file cannot be read or a line is malformed.
+    bool load(const std::filesystem::path &path, Address base = 0);
+
+    // Writes symbols, given in definition order, as a .sym file.
+    static bool write(const std::filesystem::path &path, const std::vector<Symbol> &symbols);
+
+    // The symbol pc falls under, the last one at or below it.
+    uint32_t find(Address pc) const;
+
+    // The symbol that starts at pc.
+    uint32_t starting_at(Address pc) const;
+
+    const Symbol &operator[](uint32_t index) const {
+        return symbols_[index];
+    }
+
+    size_t size() const {
+        return symbols_.size();
+    }
+};
+
+// The .sym file next to a program: its path with the extension
+// replaced.
+std::filesystem::path symbol_path(const std::filesystem::path &program);
+
+} // namespace Sim
+
+#endif // SYMBOLS_HPP_
@@ -0,0 +1,109 @@
+#include "thread_pool.hpp"
+
+namespace Sim {
+
+ThreadPool::ThreadPool(size_t threads)
+    : queued_(0),
+    pending_(0),
+    next_queue_(0),
+    stopping_(false)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    for (size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(Task task) {
+    size_t target = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        target = next_queue_;
+        next_queue_ = (next_queue_ + 1) % queues_.size();
+        ++pending_;
+        // Counted before the push so queued_ never drops below zero;
+        // a worker that wakes early just retries until the task lands.
+        queued_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Queue &queue = *queues_[target];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+bool ThreadPool::take(size_t self, Task &task) {
+    const size_t count = queues_.size();
+    for (size_t i = 0; i < count; ++i) {
+        Queue &queue = *queues_[(self + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t self) {
+    for (;;) {
+        Task task;
+        if (!take(self, task)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this] {
+                return stopping_ || queued_.load(std::memory_order_relaxed) != 0;
+            });
+            if (stopping_ && queued_.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+
+        task(self);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--pending_ == 0) {
+            idle_.notify_all();
+        }
+    }
+}
+
+void ThreadPool::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+}
+
+} // namespace Sim
@@ -0,0 +1,68 @@
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sim {
+
+// Fixed set of worker threads, each with its own task deque. submit()
+// deals tasks round-robin; a worker takes from the front of its own
+// deque and, once that is empty, steals from the back of the others,
+// so a few long jobs do not leave the remaining threads idle. Tasks
+// get the index of the worker running them, which callers use to keep
+// per-thread state (such as one CPU per worker) without locking.
+class ThreadPool {
+public:
+    using Task = std::function<void(size_t worker)>;
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::atomic<size_t> queued_;    // tasks sitting in a deque
+    size_t pending_;                // submitted and not finished yet
+    size_t next_queue_;
+    bool stopping_;
+
+    bool take(size_t self, Task &task);
+    void work(size_t self);
+
+public:
+    // 0 threads means one per hardware thread.
+    explicit ThreadPool(size_t threads = 0);
+
+    // Finishes every submitted task before joining the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const {
+        return workers_.size();
+    }
+
+    void submit(Task task);
+
+    // Blocks until every submitted task has finished.
+    void wait_idle();
+};
+
+} // namespace Sim
+
+#endif // THREAD_POOL_HPP_
@@ -0,0 +1,164 @@
+#include "timing.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+namespace Sim {
+
+namespace {
+
+bool is_power_of_two(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+unsigned log2_of(uint32_t value) {
+    unsigned shift = 0;
+    while ((1u << shift) < value) {
+        ++shift;
+    }
+    return shift;
+}
+
+// A decimal number, times 1024 with a k suffix if allowed.
+bool parse_number(const std::string &text, uint32_t &out, bool sized) {
+    std::string digits = text;
+    uint32_t scale = 1;
+    if (sized && !digits.empty() && (digits.back() == 'k' || digits.back() == 'K')) {
+        digits.pop_back();
+        scale = 1024;
+    }
+    uint32_t value = 0;
+    std::from_chars_result rc = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    if (digits.empty() || rc.ec != std::errc() || rc.ptr != digits.data() + digits.size()
+        || value > UINT32_MAX / scale) {
+        return false;
+    }
+    out = value * scale;
+    return true;
+}
+
+std::vector<std::string> split(const std::string &text, char separator) {
+    std::vector<std::string> fields;
+    std::istringstream in(text);
+    for (std::string field; std::getline(in, field, separator);) {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+bool parse_cache(const std::string &text, CacheConfig &cache) {
+    const std::vector<std::string> fields = split(text, ':');
+    if (fields.empty() || fields.size() > 4 || !parse_number(fields[0], cache.size, true)
+        || (fields.size() > 1 && !parse_number(fields[1], cache.ways, false))
+        || (fields.size() > 2 && !parse_number(fields[2], cache.line, false))
+        || (fields.size() > 3 && !parse_number(fields[3], cache.miss_penalty, false))) {
+        return false;
+    }
+    return is_power_of_two(cache.size) && is_power_of_two(cache.ways) && is_power_of_two(cache.line)
+        && cache.line >= sizeof(Register) && cache.size >= cache.ways * cache.line;
+}
+
+double ratio(uint64_t part, uint64_t whole) {
+    return whole == 0 ? 0.0 : static_cast<double>(part) / static_cast<double>(whole);
+}
+
+} // namespace
+
+bool parse_timing_config(const std::string &spec, TimingConfig &config, std::string &error) {
+    for (const std::string &item : split(spec, ',')) {
+        const size_t equals = item.find('=');
+        if (equals == std::string::npos) {
+            error = "bad timing parameter: " + item;
+            return false;
+        }
+        const std::string key = item.substr(0, equals);
+        const std::string value = item.substr(equals + 1);
+        bool ok = false;
+        if (key == "stages") {
+            ok = parse_number(value, config.stages, false) && config.stages != 0;
+        } else if (key == "mispredict") {
+            ok = parse_number(value, config.mispredict, false);
+        } else if (key == "taken") {
+            ok = parse_number(value, config.taken, false);
+        } else if (key == "load_use") {
+            ok = parse_number(value, config.load_use, false);
+        } else if (key == "predictor") {
+            const std::vector<std::string> fields = split(value, ':');
+            ok = !fields.empty() && fields.size() <= 2
+                && parse_number(fields[0], config.predictor_entries, true)
+                && is_power_of_two(config.predictor_entries)
+                && (fields.size() < 2 || (parse_number(fields[1], config.history_bits, false)
+                                          && config.history_bits <= 31));
+        } else if (key == "icache") {
+            ok = parse_cache(value, config.icache);
+        } else if (key == "dcache") {
+            ok = parse_cache(value, config.dcache);
+        } else {
+            error = "unknown timing parameter: " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad timing parameter: " + item;
+            return false;
+        }
+    }
+    return true;
+}
+
+CacheModel::CacheModel(const CacheConfig &config)
+    : line_shift_(log2_of(config.line)),
+    set_mask_(config.size / config.line / config.ways - 1),
+    ways_(config.ways),
+    tags_(static_cast<size_t>(config.size / config.line), 0)
+{}
+
+bool CacheModel::fill(uint32_t *set, uint32_t tag) {
+    // Move-to-front keeps each set in LRU order.
+    uint32_t way = 1;
+    while (way < ways_ && set[way] != tag) {
+        ++way;
+    }
+    const bool hit = way < ways_;
+    if (!hit) {
+        ++misses;
+        way = ways_ - 1;
+    }
+    std::copy_backward(set, set + way, set + way + 1);
+    set[0] = tag;
+    return hit;
+}
+
+TimingModel::TimingModel(const TimingConfig &config)
+    : config_(config),
+    icache_(config.icache),
+    dcache_(config.dcache),
+    counters_(config.predictor_entries, 1),
+    counter_mask_(config.predictor_entries - 1),
+    history_mask_(config.history_bits == 0 ? 0 : (1u << config.history_bits) - 1),
+    cycles_(config.stages - 1)
+{}
+
+void TimingModel::report(std::ostream &out) const {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << "----- TIMING -----\n";
+    out << std::left << std::fixed << std::setprecision(4);
+    out << std::setw(16) << "cycles" << cycles_ << "\n";
+    out << std::setw(16) << "instructions" << instructions_ << "\n";
+    out << std::setw(16) << "cpi" << ratio(cycles_, instructions_) << "\n";
+    out << std::setw(16) << "icache-misses" << icache_.misses << " / " << icache_.accesses
+        << " (" << ratio(icache_.misses, icache_.accesses) << ")\n";
+    out << std::setw(16) << "dcache-misses" << dcache_.misses << " / " << dcache_.accesses
+        << " (" << ratio(dcache_.misses, dcache_.accesses) << ")\n";
+    out << std::setw(16) << "mispredicts" << mispredicts_ << " / " << branches_
+        << " (" << ratio(mispredicts_, branches_) << ")\n";
+    out << std::setw(16) << "load-use-stalls" << load_stalls_ << "\n";
+    out << "----- END OF TIMING -----\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+} // namespace Sim
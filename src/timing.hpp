@@ -0,0 +1,202 @@
+#ifndef TIMING_HPP_
+#define TIMING_HPP_
+
+#include "config.hpp"
+#include "block_cache.hpp"
+#include "instructions.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace Sim {
+
+struct CacheConfig {
+    uint32_t size = 32 * 1024;      // bytes
+    uint32_t ways = 4;
+    uint32_t line = 64;             // bytes
+    uint32_t miss_penalty = 20;     // cycles
+};
+
+// The core --timing models: an in-order pipeline that issues one
+// instruction a cycle unless it stalls, with L1 caches and a branch
+// predictor. Every field can be set from the command line, see
+// parse_timing_config().
+struct TimingConfig {
+    uint32_t stages = 5;            // the pipeline fills once, at the start
+    uint32_t mispredict = 2;        // cycles lost to a mispredicted branch
+    uint32_t taken = 0;             // bubble after a taken branch or j
+    uint32_t load_use = 1;          // stall when an op needs the word a ld just loaded
+    uint32_t predictor_entries = 4096;  // 2-bit counters
+    uint32_t history_bits = 8;      // global history, xored into the index; 0 for bimodal
+    CacheConfig icache;
+    CacheConfig dcache{32 * 1024, 8, 64, 20};
+};
+
+// "key=value,..." over the defaults. Keys: stages, mispredict, taken,
+// load_use, predictor=ENTRIES[:HISTORY_BITS] and icache/dcache=
+// SIZE[:WAYS[:LINE[:PENALTY]]], where SIZE may end in k. Sizes must be
+// powers of two; on failure error says which key was wrong.
+bool parse_timing_config(const std::string &spec, TimingConfig &config, std::string &error);
+
+// Set-associative cache with LRU replacement, modelling only tags.
+class CacheModel {
+private:
+    unsigned line_shift_;
+    uint32_t set_mask_;
+    uint32_t ways_;
+    std::vector<uint32_t> tags_;    // line + 1 (0: empty), most recent first in each set
+
+public:
+    uint64_t accesses = 0;
+    uint64_t misses = 0;
+
+    explicit CacheModel(const CacheConfig &config);
+
+    unsigned line_shift() const {
+        return line_shift_;
+    }
+
+    // True on a hit.
+    bool access(Address addr) {
+        ++accesses;
+        const uint32_t tag = (addr >> line_shift_) + 1;
+        uint32_t *set = &tags_[static_cast<size_t>((addr >> line_shift_) & set_mask_) * ways_];
+        if (set[0] == tag) {
+            return true;
+        }
+        return fill(set, tag);
+    }
+
+private:
+    bool fill(uint32_t *set, uint32_t tag);
+};
+
+// Instrumentation policy for --timing: counts the cycles a run would
+// take on the core TimingConfig describes. Like every policy it costs
+// nothing unless a run is given one.
+class TimingModel {
+public:
+    static constexpr bool kEnabled = true;
+
+private:
+    static constexpr Register_idx kNoRegister = 0xFF;
+
+    TimingConfig config_;
+    CacheModel icache_;
+    CacheModel dcache_;
+    std::vector<uint8_t> counters_;
+    uint32_t counter_mask_;
+    uint32_t history_mask_;
+    uint32_t history_ = 0;
+
+    uint64_t cycles_;
+    uint64_t instructions_ = 0;
+    uint64_t branches_ = 0;
+    uint64_t mispredicts_ = 0;
+    uint64_t load_stalls_ = 0;
+    uint64_t fetch_line_ = UINT64_MAX;
+    Register_idx loaded_ = kNoRegister;     // destination of the ld just retired
+
+    // Source registers of each kind: rs (1), rt (2) and rd (4).
+    static constexpr uint8_t sources(DecodedInstr kind) {
+        switch (kind) {
+            case DecodedInstr::j:
+            case DecodedInstr::syscall:
+            case DecodedInstr::unknown:
+                return 0;
+            case DecodedInstr::stp:
+                return 7;
+            case DecodedInstr::st:
+            case DecodedInstr::add:
+            case DecodedInstr::and_:
+            case DecodedInstr::bdep:
+            case DecodedInstr::beq:
+            case DecodedInstr::bne:
+                return 3;
+            default:
+                return 1;
+        }
+    }
+
+    static bool reads(const DecodedOp &op, Register_idx reg) {
+        const uint8_t mask = sources(op.kind);
+        return ((mask & 1) != 0 && op.rs == reg) || ((mask & 2) != 0 && op.rt == reg)
+            || ((mask & 4) != 0 && op.rd == reg);
+    }
+
+    // Predicts the branch at pc, learns its outcome and returns whether
+    // the prediction was right.
+    bool predict(Address pc, bool taken) {
+        uint8_t &counter = counters_[((pc >> 2) ^ (history_ & history_mask_)) & counter_mask_];
+        const bool right = (counter >= 2) == taken;
+        if (taken) {
+            counter += counter < 3 ? 1 : 0;
+        } else {
+            counter -= counter > 0 ? 1 : 0;
+        }
+        history_ = (history_ << 1) | (taken ? 1 : 0);
+        return right;
+    }
+
+public:
+    explicit TimingModel(const TimingConfig &config);
+
+    void on_block(const BasicBlock &) {}
+
+    void on_load(const DecodedOp &, Address addr) {
+        if (!dcache_.access(addr)) {
+            cycles_ += config_.dcache.miss_penalty;
+        }
+    }
+
+    // Stores retire into a store buffer: a miss allocates the line but
+    // does not stall.
+    void on_store(const DecodedOp &, Address addr) {
+        dcache_.access(addr);
+    }
+
+    void on_retire(const DecodedOp &op, Address next_pc) {
+        ++instructions_;
+        ++cycles_;
+
+        const uint64_t line = op.pc >> icache_.line_shift();
+        if (line != fetch_line_) {
+            fetch_line_ = line;
+            if (!icache_.access(op.pc)) {
+                cycles_ += config_.icache.miss_penalty;
+            }
+        }
+
+        if (loaded_ != kNoRegister && reads(op, loaded_)) {
+            cycles_ += config_.load_use;
+            ++load_stalls_;
+        }
+        loaded_ = op.kind == DecodedInstr::ld ? op.rt : kNoRegister;
+
+        if (op.kind == DecodedInstr::beq || op.kind == DecodedInstr::bne) {
+            ++branches_;
+            const bool taken = next_pc != op.next;
+            if (!predict(op.pc, taken)) {
+                ++mispredicts_;
+                cycles_ += config_.mispredict;
+            } else if (taken) {
+                cycles_ += config_.taken;
+            }
+        } else if (op.kind == DecodedInstr::j) {
+            cycles_ += config_.taken;
+        }
+    }
+
+    uint64_t cycles() const {
+        return cycles_;
+    }
+
+    void report(std::ostream &out) const;
+};
+
+} // namespace Sim
+
+#endif // TIMING_HPP_
@@ -0,0 +1,272 @@
+#include "trace.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace Sim {
+
+constexpr char TraceModel::kMagic[8];
+
+namespace {
+
+constexpr size_t kHeaderBytes = sizeof(TraceModel::kMagic) + 2 * sizeof(uint32_t);
+constexpr size_t kBatchRecords = 4096;
+constexpr size_t kFlushBytes = 256 * 1024;
+
+uint32_t zigzag(uint32_t delta) {
+    return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+}
+
+uint32_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+uint8_t *put_varint(uint32_t value, uint8_t *out) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+bool get_varint(const uint8_t *&cursor, const uint8_t *end, uint32_t &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 35; shift += 7) {
+        if (cursor == end) {
+            return false;
+        }
+        uint8_t byte = *cursor++;
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t *put_u32(uint32_t value, uint8_t *out) {
+    for (unsigned i = 0; i < 4; ++i) {
+        *out++ = static_cast<uint8_t>(value >> (8 * i));
+    }
+    return out;
+}
+
+uint32_t get_u32(const uint8_t *bytes) {
+    return static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8)
+        | (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+} // namespace
+
+//------------------ model -----------------------
+uint8_t *TraceModel::encode(const TraceRecord &record, uint8_t *out) {
+    uint8_t *flags = out++;
+    *flags = 0;
+
+    const Address predicted = pc_ + kInstructionBytes;
+    if (record.pc == predicted) {
+        *flags |= kSequential;
+    } else {
+        out = put_varint(zigzag(record.pc - predicted), out);
+    }
+    pc_ = record.pc;
+
+    WordSlot &word = slot(record.pc);
+    if (word.pc == record.pc && word.raw == record.raw) {
+        *flags |= kKnownWord;
+    } else {
+        out = put_u32(record.raw, out);
+        word.pc = record.pc;
+        word.raw = record.raw;
+    }
+
+    if (record.reg < kNumberOfRegisters) {
+        *flags |= kValue;
+        *out++ = record.reg;
+        out = put_varint(zigzag(record.value - values_[record.reg]), out);
+        values_[record.reg] = record.value;
+    }
+
+    if (record.has_addr) {
+        *flags |= kAddress;
+        out = put_varint(zigzag(record.addr - addr_), out);
+        addr_ = record.addr;
+    }
+    return out;
+}
+
+bool TraceModel::decode(const uint8_t *&cursor, const uint8_t *end, TraceRecord &record) {
+    if (cursor == end) {
+        return false;
+    }
+    const uint8_t flags = *cursor++;
+    if ((flags & ~(kSequential | kKnownWord | kValue | kAddress)) != 0) {
+        return false;
+    }
+
+    uint32_t delta = 0;
+    record.pc = pc_ + kInstructionBytes;
+    if ((flags & kSequential) == 0) {
+        if (!get_varint(cursor, end, delta)) {
+            return false;
+        }
+        record.pc += unzigzag(delta);
+    }
+    pc_ = record.pc;
+
+    WordSlot &word = slot(record.pc);
+    if ((flags & kKnownWord) != 0) {
+        if (word.pc != record.pc) {
+            return false;
+        }
+        record.raw = word.raw;
+    } else {
+        if (end - cursor < 4) {
+            return false;
+        }
+        record.raw = get_u32(cursor);
+        cursor += 4;
+        word.pc = record.pc;
+        word.raw = record.raw;
+    }
+
+    record.reg = kNoRegister;
+    record.value = 0;
+    if ((flags & kValue) != 0) {
+        if (cursor == end || *cursor >= kNumberOfRegisters) {
+            return false;
+        }
+        record.reg = *cursor++;
+        if (!get_varint(cursor, end, delta)) {
+            return false;
+        }
+        record.value = values_[record.reg] + unzigzag(delta);
+        values_[record.reg] = record.value;
+    }
+
+    record.has_addr = (flags & kAddress) != 0;
+    record.addr = 0;
+    if (record.has_addr) {
+        if (!get_varint(cursor, end, delta)) {
+            return false;
+        }
+        record.addr = addr_ + unzigzag(delta);
+        addr_ = record.addr;
+    }
+    return true;
+}
+
+//------------------ writer -----------------------
+TraceWriter::TraceWriter(const std::filesystem::path &path)
+    : out_(path, std::ios::binary | std::ios::trunc),
+    closing_(false),
+    failed_(false),
+    closed_(false)
+{
+    if (!out_) {
+        throw std::runtime_error("trace: cannot create file: " + path.string());
+    }
+
+    uint8_t header[kHeaderBytes];
+    std::memcpy(header, TraceModel::kMagic, sizeof(TraceModel::kMagic));
+    put_u32(0, put_u32(TraceModel::kVersion, header + sizeof(TraceModel::kMagic)));
+    out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    thread_ = std::thread(&TraceWriter::drain, this);
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+// Encoding happens here, off the execution thread; the guest only pays
+// for the ring push.
+void TraceWriter::drain() {
+    TraceModel model;
+    std::vector<TraceRecord> batch(kBatchRecords);
+    std::vector<uint8_t> encoded(kFlushBytes + kBatchRecords * TraceModel::kMaxRecordBytes);
+    uint8_t *end = encoded.data();
+
+    while (true) {
+        // Read the flag before popping so that nothing pushed before
+        // close() can be missed.
+        const bool closing = closing_.load(std::memory_order_acquire);
+        const size_t count = ring_.pop(batch.data(), batch.size());
+        for (size_t i = 0; i < count; ++i) {
+            end = model.encode(batch[i], end);
+        }
+
+        const size_t size = static_cast<size_t>(end - encoded.data());
+        if (size >= kFlushBytes || (count == 0 && size != 0)) {
+            out_.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(size));
+            end = encoded.data();
+        }
+
+        if (count == 0) {
+            if (closing) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    out_.flush();
+    failed_ = !out_;
+}
+
+bool TraceWriter::close() {
+    if (closed_) {
+        return !failed_;
+    }
+    closed_ = true;
+    closing_.store(true, std::memory_order_release);
+    thread_.join();
+    if (failed_) {
+        std::cerr << "trace: write failed\n";
+    }
+    return !failed_;
+}
+
+//------------------ reader -----------------------
+TraceReader::TraceReader(const std::filesystem::path &path)
+    : in_(path, std::ios::binary),
+    begin_(0),
+    bad_(false)
+{
+    uint8_t header[kHeaderBytes];
+    if (!in_ || !in_.read(reinterpret_cast<char*>(header), sizeof(header))
+        || std::memcmp(header, TraceModel::kMagic, sizeof(TraceModel::kMagic)) != 0) {
+        throw std::runtime_error("trace: not a trace file: " + path.string());
+    }
+    if (get_u32(header + sizeof(TraceModel::kMagic)) != TraceModel::kVersion) {
+        throw std::runtime_error("trace: unsupported version in: " + path.string());
+    }
+}
+
+bool TraceReader::next(TraceRecord &record) {
+    // Keep at least one whole record buffered unless the file has ended.
+    if (buffer_.size() - begin_ < TraceModel::kMaxRecordBytes && in_) {
+        buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<std::ptrdiff_t>(begin_));
+        begin_ = 0;
+        const size_t kept = buffer_.size();
+        buffer_.resize(kept + kFlushBytes);
+        in_.read(reinterpret_cast<char*>(buffer_.data() + kept), static_cast<std::streamsize>(kFlushBytes));
+        buffer_.resize(kept + static_cast<size_t>(in_.gcount()));
+    }
+
+    if (begin_ == buffer_.size()) {
+        return false;
+    }
+    const uint8_t *cursor = buffer_.data() + begin_;
+    if (!model_.decode(cursor, buffer_.data() + buffer_.size(), record)) {
+        bad_ = true;
+        return false;
+    }
+    begin_ = static_cast<size_t>(cursor - buffer_.data());
+    return true;
+}
+
+} // namespace Sim
@@ -0,0 +1,253 @@
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include "config.hpp"
+#include "block_cache.hpp"
+#include "cpu.hpp"
+#include "isa.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace Sim {
+
+constexpr uint8_t kNoRegister = 0xFF;
+
+// One retired instruction. reg is the register it wrote (kNoRegister
+// if none) and value what it holds afterwards; addr is the effective
+// address of ld/st/stp.
+struct TraceRecord {
+    Address pc;
+    Instruction raw;
+    Register value;
+    Address addr;
+    uint8_t reg;
+    bool has_addr;
+};
+
+// Single-producer single-consumer ring of records. The producer only
+// touches the shared indices when its cached view says the ring is
+// full, so a push is normally one slot write and one release store.
+class TraceRing {
+public:
+    static constexpr size_t kCapacity = size_t(1) << 16;
+
+private:
+    static constexpr size_t kMask = kCapacity - 1;
+
+    std::unique_ptr<TraceRecord[]> slots_;
+    alignas(64) std::atomic<size_t> head_;  // next slot to write
+    size_t cached_tail_;
+    alignas(64) std::atomic<size_t> tail_;  // next slot to read
+
+public:
+    TraceRing()
+        : slots_(new TraceRecord[kCapacity]),
+        head_(0),
+        cached_tail_(0),
+        tail_(0)
+    {}
+
+    // Waits for the consumer if the ring is full; records are never dropped.
+    void push(const TraceRecord &record) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head - cached_tail_ == kCapacity) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            while (head - cached_tail_ == kCapacity) {
+                std::this_thread::yield();
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+            }
+        }
+        slots_[head & kMask] = record;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Copies up to max records out; returns how many.
+    size_t pop(TraceRecord *out, size_t max) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t head = head_.load(std::memory_order_acquire);
+        size_t count = head - tail;
+        if (count > max) {
+            count = max;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = slots_[(tail + i) & kMask];
+        }
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+};
+
+// Delta coding shared by the writer and the reader, which run the same
+// model so that each record only carries what the model cannot predict.
+//
+// File: "TOYTRACE", uint32 version, uint32 reserved (little endian),
+// then one record after another:
+//
+//   flags byte    kSequential: pc is the previous pc + 4
+//                 kKnownWord:  raw is the word last seen at this pc
+//                 kValue, kAddress: the fields below are present
+//   varint        pc - (previous pc + 4), zigzag      unless kSequential
+//   4 bytes       raw                                 unless kKnownWord
+//   byte, varint  reg, value - previous value of reg  if kValue
+//   varint        addr - previous addr, zigzag        if kAddress
+class TraceModel {
+public:
+    static constexpr char kMagic[8] = {'T', 'O', 'Y', 'T', 'R', 'A', 'C', 'E'};
+    static constexpr uint32_t kVersion = 1;
+
+    static constexpr uint8_t kSequential = 0x01;
+    static constexpr uint8_t kKnownWord = 0x02;
+    static constexpr uint8_t kValue = 0x04;
+    static constexpr uint8_t kAddress = 0x08;
+
+    static constexpr size_t kMaxRecordBytes = 1 + 5 + 4 + 1 + 5 + 5;
+
+private:
+    static constexpr size_t kWordSlots = 4096;
+
+    struct WordSlot {
+        Address pc = 1;     // never a valid pc, so the slot starts empty
+        Instruction raw = 0;
+    };
+
+    std::vector<WordSlot> words_;
+    Register values_[kNumberOfRegisters] = {};
+    Address pc_ = static_cast<Address>(0u - kInstructionBytes);
+    Address addr_ = 0;
+
+    WordSlot &slot(Address pc) {
+        return words_[(pc >> 2) & (kWordSlots - 1)];
+    }
+
+public:
+    TraceModel()
+        : words_(kWordSlots)
+    {}
+
+    // Writes the encoding of record, at most kMaxRecordBytes, to out and
+    // returns the end of it.
+    uint8_t *encode(const TraceRecord &record, uint8_t *out);
+
+    // Decodes one record from [*cursor, end); false if it is cut short
+    // or malformed.
+    bool decode(const uint8_t *&cursor, const uint8_t *end, TraceRecord &record);
+};
+
+// Owns the ring and the thread that drains it into a file.
+class TraceWriter {
+private:
+    TraceRing ring_;
+    std::ofstream out_;
+    std::thread thread_;
+    std::atomic<bool> closing_;
+    bool failed_;
+    bool closed_;
+
+    void drain();
+
+public:
+    // Throws std::runtime_error if the file cannot be created.
+    explicit TraceWriter(const std::filesystem::path &path);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    void push(const TraceRecord &record) {
+        ring_.push(record);
+    }
+
+    // Writes out everything pushed so far and stops the thread; false
+    // if any write failed.
+    bool close();
+};
+
+class TraceReader {
+private:
+    std::ifstream in_;
+    std::vector<uint8_t> buffer_;
+    size_t begin_;
+    TraceModel model_;
+    bool bad_;
+
+public:
+    // Throws std::runtime_error if the file is missing or not a trace.
+    explicit TraceReader(const std::filesystem::path &path);
+
+    // False at the end of the trace or on a damaged record; bad() tells
+    // the two apart.
+    bool next(TraceRecord &record);
+
+    bool bad() const {
+        return bad_;
+    }
+};
+
+// The register an op writes, kNoRegister for branches, stores and syscalls.
+inline uint8_t destination_of(const DecodedOp &op) {
+    switch (describe(op.kind).format) {
+        case Format::rrr:
+        case Format::drr:
+        case Format::dr:
+        case Format::dri:
+            return static_cast<uint8_t>(op.rd);
+        case Format::imm16s:
+            return static_cast<uint8_t>(op.rt);
+        case Format::mem:
+            return op.kind == DecodedInstr::ld ? static_cast<uint8_t>(op.rt) : kNoRegister;
+        default:
+            return kNoRegister;
+    }
+}
+
+// Instrumentation policy for --trace: one record per retired instruction.
+class TraceInstrumentation {
+private:
+    const CPU &cpu_;
+    TraceWriter &writer_;
+    Address addr_ = 0;
+    bool has_addr_ = false;
+
+public:
+    static constexpr bool kEnabled = true;
+
+    TraceInstrumentation(const CPU &cpu, TraceWriter &writer)
+        : cpu_(cpu),
+        writer_(writer)
+    {}
+
+    void on_block(const BasicBlock &) {}
+
+    void on_load(const DecodedOp &, Address addr) {
+        addr_ = addr;
+        has_addr_ = true;
+    }
+
+    // stp reports both words; the record keeps the first.
+    void on_store(const DecodedOp &, Address addr) {
+        if (!has_addr_) {
+            addr_ = addr;
+            has_addr_ = true;
+        }
+    }
+
+    void on_retire(const DecodedOp &op, Address) {
+        TraceRecord record{op.pc, op.raw, 0, has_addr_ ? addr_ : 0, destination_of(op), has_addr_};
+        if (record.reg != kNoRegister) {
+            record.value = cpu_.get_register(record.reg);
+        }
+        writer_.push(record);
+        has_addr_ = false;
+    }
+};
+
+} // namespace Sim
+
+#endif // TRACE_HPP_
@@ -0,0 +1,76 @@
+#include "isa.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Writes the assembler's encoding tables (src/asm/isa_tables.rb) from
+// kIsa, so the Ruby and C++ sides cannot drift apart. Run through the
+// isa_tables build target after changing isa.hpp; with --check, as
+// every build does, it fails if the file differs from what it would
+// write.
+namespace {
+
+std::string binary(unsigned value) {
+    std::string bits = "0b";
+    for (int bit = 5; bit >= 0; --bit) {
+        bits += ((value >> bit) & 1) ? '1' : '0';
+    }
+    return bits;
+}
+
+// "name:" padded so the values line up, with at least one space.
+std::string key(const Sim::InstrDesc &desc) {
+    std::string text = std::string(desc.name) + ":";
+    text.append(text.size() < 9 ? 9 - text.size() : 1, ' ');
+    return text;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const bool check = argc == 3 && std::string(argv[1]) == "--check";
+    if (argc != 2 && !check) {
+        std::cerr << "Usage: " << argv[0] << " [--check] <isa_tables.rb>\n";
+        return 1;
+    }
+    const char *path = argv[argc - 1];
+
+    std::ostringstream out;
+    out << "# Generated by tools/isa_gen.cpp from src/isa.hpp; do not edit.\n"
+        << "module Isa\n"
+        << "    OPCODE = {\n";
+    for (const Sim::InstrDesc &desc : Sim::kIsa) {
+        out << "        " << key(desc) << binary(desc.opcode) << ",\n";
+    }
+    out << "    }.freeze\n"
+        << "\n"
+        << "    SUB_ENCODING = {\n";
+    for (const Sim::InstrDesc &desc : Sim::kIsa) {
+        if (desc.funct != Sim::kNoFunct) {
+            out << "        " << key(desc) << binary(static_cast<unsigned>(desc.funct)) << ",\n";
+        }
+    }
+    out << "    }.freeze\n"
+        << "end\n";
+
+    if (check) {
+        std::ifstream file(path);
+        std::ostringstream current;
+        current << file.rdbuf();
+        if (!file || current.str() != out.str()) {
+            std::cerr << path << " does not match src/isa.hpp; regenerate it with the isa_tables target\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    std::ofstream file(path, std::ios::trunc);
+    file << out.str();
+    if (!file) {
+        std::cerr << "Cannot write " << path << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "aot.hpp"
+#include "cli.hpp"
+#include "config.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Single-quoted for the shell.
+std::string quote(const std::string &text) {
+    std::string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+} // namespace
+
+// Translates a .bin ahead of time into a shared object for
+// toy_cpu --aot=FILE: writes the generated C++ next to the module as
+// FILE.cpp and compiles it with the host compiler ($CXX, else c++).
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <program.bin> <module.so> [--base=ADDR] [--entry=ADDR] [--cxx=COMPILER]\n";
+        return 1;
+    }
+
+    const std::filesystem::path program_path = argv[1];
+    const std::filesystem::path module_path = argv[2];
+    Sim::Address base = 0;
+    Sim::Address entry = 0;
+    bool has_entry = false;
+    const char *cxx = std::getenv("CXX");
+    std::string compiler = cxx != nullptr && *cxx != '\0' ? cxx : "c++";
+
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--base=", 0) == 0) {
+            if (!Sim::parse_address(arg.substr(std::string("--base=").size()), base)) {
+                std::cerr << "Bad address in argument: " << arg << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--entry=", 0) == 0) {
+            if (!Sim::parse_address(arg.substr(std::string("--entry=").size()), entry)) {
+                std::cerr << "Bad address in argument: " << arg << "\n";
+                return 1;
+            }
+            has_entry = true;
+        } else if (arg.rfind("--cxx=", 0) == 0) {
+            compiler = arg.substr(std::string("--cxx=").size());
+        } else {
+            std::cerr << "Unknown argument: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    std::ifstream in(program_path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Error: Input file '" << program_path.string() << "' not found.\n";
+        return 1;
+    }
+    const std::vector<Sim::Byte> program((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::filesystem::path source_path = module_path;
+    source_path += ".cpp";
+    std::ofstream source(source_path, std::ios::trunc);
+    Sim::AotStats stats;
+    if (!Sim::aot_translate(program.data(), program.size(), base, has_entry ? entry : base, source, &stats)
+        || !source.flush()) {
+        std::cerr << "Cannot write " << source_path.string() << "\n";
+        return 1;
+    }
+    source.close();
+
+    const std::string command = compiler + " -std=c++17 -O2 -shared -fPIC -o " + quote(module_path.string())
+        + " " + quote(source_path.string());
+    if (std::system(command.c_str()) != 0) {
+        std::cerr << "Failed: " << command << "\n";
+        return 1;
+    }
+    std::cout << "Translated " << stats.instructions << " instructions in " << stats.blocks
+              << " blocks into " << module_path.string() << "\n";
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "assembler.hpp"
+
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+// Writes path through write() under a private name and a rename, so a
+// run that has the old file loaded keeps it and none sees a partial
+// file. A symlink's target is replaced; anything but a regular file (a
+// pipe, /dev/stdout) is written in place.
+template <class Write>
+bool replace(const std::filesystem::path &path, Write write) {
+    std::error_code ec;
+    const std::filesystem::file_status status = std::filesystem::status(path, ec);
+    if (std::filesystem::exists(status) && !std::filesystem::is_regular_file(status)) {
+        return write(path);
+    }
+    std::filesystem::path target = path;
+    if (std::filesystem::is_symlink(std::filesystem::symlink_status(path, ec))) {
+        target = std::filesystem::canonical(path, ec);
+        if (ec) {
+            return false;
+        }
+    }
+    const std::filesystem::path partial = target.string() + "." + std::to_string(getpid());
+    if (!write(partial)) {
+        std::filesystem::remove(partial, ec);
+        return false;
+    }
+    std::filesystem::rename(partial, target, ec);
+    if (ec) {
+        std::filesystem::remove(partial, ec);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+// Assembles a .asm file into a raw little-endian .bin and its labels
+// into a .sym next to it, like src/asm/run_assembler.rb but without Ruby.
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <input_file.asm> <output_file.bin>\n";
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Error: Input file '" << argv[1] << "' not found.\n";
+        return 1;
+    }
+    const std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::vector<Sim::Instruction> words;
+    std::vector<Sim::Symbol> symbols;
+    std::string error;
+    if (!Sim::assemble(source, words, error, &symbols)) {
+        std::cerr << argv[1] << ": " << error << "\n";
+        return 1;
+    }
+
+    const std::filesystem::path path = argv[2];
+    auto write_words = [&words](const std::filesystem::path &file) {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        for (Sim::Instruction word : words) {
+            const char bytes[4] = {
+                static_cast<char>(word), static_cast<char>(word >> 8),
+                static_cast<char>(word >> 16), static_cast<char>(word >> 24)
+            };
+            out.write(bytes, sizeof(bytes));
+        }
+        out.close();
+        return static_cast<bool>(out);
+    };
+    auto write_symbols = [&symbols](const std::filesystem::path &file) {
+        return Sim::SymbolTable::write(file, symbols);
+    };
+    if (!replace(Sim::symbol_path(path), write_symbols) || !replace(path, write_words)) {
+        std::cerr << "Cannot write " << argv[2] << "\n";
+        return 1;
+    }
+    std::cout << "Assembled " << words.size() << " instructions into " << argv[2] << "\n";
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "trace.hpp"
+#include "config.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+// Prints a --trace file, one retired instruction per line:
+//
+//   pc  raw word  [xN = value]  [@ effective address]
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace file> [--limit=N] [--summary]\n";
+        return 1;
+    }
+
+    std::filesystem::path path = argv[1];
+    uint64_t limit = UINT64_MAX;
+    bool summary = false;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--limit=", 0) == 0) {
+            try {
+                limit = std::stoull(arg.substr(8));
+            } catch (const std::exception &) {
+                std::cerr << "Bad number in argument: " << arg << "\n";
+                return 1;
+            }
+        } else if (arg == "--summary") {
+            summary = true;
+        } else {
+            std::cerr << "Unknown argument: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    try {
+        Sim::TraceReader reader(path);
+        Sim::TraceRecord record{};
+        uint64_t records = 0;
+        uint64_t with_value = 0;
+        uint64_t with_address = 0;
+
+        std::cout << std::hex << std::setfill('0');
+        while (reader.next(record)) {
+            ++records;
+            with_value += record.reg != Sim::kNoRegister;
+            with_address += record.has_addr;
+            if (summary || records > limit) {
+                continue;
+            }
+
+            std::cout << "0x" << std::setw(8) << record.pc << "  0x" << std::setw(8) << record.raw;
+            if (record.reg != Sim::kNoRegister) {
+                std::cout << "  x" << std::dec << std::setfill(' ') << std::left << std::setw(2) << int(record.reg)
+                          << std::right << std::hex << std::setfill('0')
+                          << " = 0x" << std::setw(8) << record.value;
+            }
+            if (record.has_addr) {
+                std::cout << "  @0x" << std::setw(8) << record.addr;
+            }
+            std::cout << "\n";
+        }
+        std::cout << std::dec << std::setfill(' ');
+
+        if (reader.bad()) {
+            std::cerr << "trace: damaged record after " << records << " records\n";
+            return 1;
+        }
+
+        if (summary) {
+            const auto bytes = std::filesystem::file_size(path);
+            std::cout << "records        " << records << "\n"
+                      << "with value     " << with_value << "\n"
+                      << "with address   " << with_address << "\n"
+                      << "file bytes     " << bytes << "\n";
+            if (records != 0) {
+                std::cout << "bytes/record   " << std::fixed << std::setprecision(2)
+                          << static_cast<double>(bytes) / static_cast<double>(records) << "\n";
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}